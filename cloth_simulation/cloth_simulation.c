@@ -1,19 +1,68 @@
+#ifndef _WIN32
+#define _GNU_SOURCE
+#endif
 #include <SDL2/SDL.h>
 #include <math.h>
 #include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <emmintrin.h>
+#include <immintrin.h>
+#include <xmmintrin.h>
+#ifdef _WIN32
 #include <windows.h>
+#else
+#include <dirent.h>
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/time.h>
+#include <ucontext.h>
+#include <unistd.h>
+#endif
+#ifdef __linux__
+#include <errno.h>
+#include <linux/futex.h>
+#include <linux/io_uring.h>
+#include <linux/perf_event.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#endif
 
 #define SCREEN_WIDTH 800
 #define SCREEN_HEIGHT 600
 #define GRID_WIDTH 50
 #define GRID_HEIGHT 30
 #define PARTICLE_SPACING 15
+#define NUM_PARTICLES (GRID_WIDTH * GRID_HEIGHT)
+#define NUM_CONSTRAINTS ((GRID_WIDTH - 1) * GRID_HEIGHT + GRID_WIDTH * (GRID_HEIGHT - 1))
+#define SOLVER_ITERATIONS 5
+#define MAX_THREADS 64
+
+// Particles per AoSoA block: 8 matches AVX, 16 matches AVX-512
+#ifndef AOSOA_WIDTH
+#define AOSOA_WIDTH 8
+#endif
 
 // Function pointer types for physics laws
 typedef void (*ForceFunction)(void* particle, float dt);
 typedef float (*EnergyFunction)(void* particle, void** neighbors, int num_neighbors);
 typedef void (*ConstraintFunction)(void* particle1, void* particle2, float rest_length);
 
+// Accuracy of the reciprocal square root used by the force and constraint laws.
+// RSQRT_EXACT keeps sqrtf plus a divide; the other modes start from the ~12-bit
+// hardware estimate (rsqrtss) and refine it with 0, 1 or 2 Newton-Raphson steps.
+typedef enum {
+    RSQRT_EXACT,
+    RSQRT_APPROX,
+    RSQRT_NEWTON1,
+    RSQRT_NEWTON2
+} RsqrtAccuracy;
+
 // Material properties with function pointers
 typedef struct {
     float elasticity;
@@ -23,6 +72,7 @@ typedef struct {
     float tear_distance;
     float air_friction;
     float bend_stiffness;
+    RsqrtAccuracy rsqrt_accuracy;
     ForceFunction apply_force;
     EnergyFunction calc_energy;
     ConstraintFunction solve_constraint;
@@ -66,6 +116,7 @@ const Material COTTON = {
     .tear_distance = 25.0f,
     .air_friction = 0.02f,
     .bend_stiffness = 0.3f,
+    .rsqrt_accuracy = RSQRT_EXACT,
     .apply_force = apply_force_cotton,
     .calc_energy = calc_energy_cotton,
     .solve_constraint = solve_constraint_cotton
@@ -79,6 +130,7 @@ const Material SILK = {
     .tear_distance = 20.0f,
     .air_friction = 0.03f,
     .bend_stiffness = 0.2f,
+    .rsqrt_accuracy = RSQRT_EXACT,
     .apply_force = apply_force_silk,
     .calc_energy = calc_energy_silk,
     .solve_constraint = solve_constraint_silk
@@ -89,20 +141,188 @@ const Material DENIM = {
     .mass = 1.5f,
     .stiffness = 0.9f,
     .damping = 0.98f,
-    .tear_distance = 35.0f,
+    .tear_distance = 45.0f,
     .air_friction = 0.01f,
     .bend_stiffness = 0.7f,
+    .rsqrt_accuracy = RSQRT_EXACT,
     .apply_force = apply_force_denim,
     .calc_energy = calc_energy_denim,
     .solve_constraint = solve_constraint_denim
 };
 
-Particle particles[GRID_WIDTH * GRID_HEIGHT];
-Constraint constraints[(GRID_WIDTH - 1) * GRID_HEIGHT + GRID_WIDTH * (GRID_HEIGHT - 1)];
+// Storage layouts the integration and constraint kernels can run on.
+// AoS is the Particle array driven through the material callbacks; SoA keeps
+// each field in its own array; AoSoA packs AOSOA_WIDTH particles per block so
+// one particle's fields share a cache line while lanes stay contiguous.
+typedef enum {
+    LAYOUT_AOS,
+    LAYOUT_SOA,
+    LAYOUT_AOSOA
+} ParticleLayout;
+
+typedef struct {
+    Particle* p;
+} ParticlesAoS;
+
+typedef struct {
+    float *x, *y;
+    float *old_x, *old_y;
+    float *vx, *vy;
+    bool* locked;
+} ParticlesSoA;
+
+typedef struct {
+    float x[AOSOA_WIDTH], y[AOSOA_WIDTH];
+    float old_x[AOSOA_WIDTH], old_y[AOSOA_WIDTH];
+    float vx[AOSOA_WIDTH], vy[AOSOA_WIDTH];
+} ParticleBlock;
+
+typedef struct {
+    ParticleBlock* blocks;
+    bool* locked;
+} ParticlesAoSoA;
+
+// Constraint by particle index, usable with any layout
+typedef struct {
+    int a, b;
+    float rest_length;
+} ConstraintIndex;
+
+Particle particles[NUM_PARTICLES];
+Constraint constraints[NUM_CONSTRAINTS];
 Material current_material = COTTON;
+const Material* const MATERIALS[] = {&COTTON, &SILK, &DENIM};
+int current_material_index = 0;
+// Order of the Gauss-Seidel sweep over constraints[]
+typedef enum {
+    SWEEP_ROWS,      // all horizontal rows, then all vertical rows
+    SWEEP_RECURSIVE  // recursive bisection of the grid, cache-oblivious
+} SweepOrder;
+
+ParticleLayout particle_layout = LAYOUT_AOS;
+SweepOrder sweep_order = SWEEP_ROWS;
+ParticlesSoA particles_soa;
+ParticlesAoSoA particles_aosoa;
+ConstraintIndex constraint_indices[NUM_CONSTRAINTS];
+// constraints[] regrouped into four colors (even/odd horizontal, even/odd
+// vertical); no two constraints of one color share a particle
+#define NUM_CONSTRAINT_COLORS 4
+Constraint colored_constraints[NUM_CONSTRAINTS];
+ConstraintIndex colored_indices[NUM_CONSTRAINTS]; // the same, by particle index
+int color_offsets[NUM_CONSTRAINT_COLORS + 1];
+// The solver runs the first num_constraints entries of constraints[]; after
+// tearing that is the intact, awake subset of all_constraints, the full set
+// in build order (active_source maps each entry back into it)
+Constraint all_constraints[NUM_CONSTRAINTS];
+int active_source[NUM_CONSTRAINTS];
+int num_constraints = NUM_CONSTRAINTS;
 SDL_Point mouse = {0, 0};
 bool mouse_down = false;
 bool right_click = false;
+int rsqrt_override = -1; // -1 keeps each material's own accuracy
+
+// Solver settings; loaded from a config file and searched by --tune
+typedef struct {
+    int iterations;   // constraint sweeps per substep
+    int substeps;     // integration substeps per frame
+    float relaxation; // over-relaxation of each constraint correction
+    int threads;      // worker threads including the main thread
+} SolverConfig;
+
+SolverConfig solver = {SOLVER_ITERATIONS, 1, 1.0f, 1};
+
+// Scene: which particles are pinned and the circles the cloth drapes over
+typedef enum {
+    PINS_TOP_ROW,
+    PINS_CORNERS
+} PinMode;
+
+typedef struct {
+    float x, y, radius;
+} Collider;
+
+#define MAX_COLLIDERS 8
+PinMode pin_mode = PINS_TOP_ROW;
+Collider colliders[MAX_COLLIDERS];
+int num_colliders = 0;
+bool settle_start = true; // start from the static equilibrium, not the flat grid
+
+// Velocity damping. A material's damping is the fraction of motion relative
+// to the cloth's rigid motion kept per 60 Hz frame; fast settle uses
+// SETTLE_DAMPING instead. Once every free particle stays below SLEEP_SPEED
+// for SLEEP_FRAMES frames the cloth sleeps until input wakes it.
+#define SETTLE_DAMPING 0.8f
+#define SLEEP_SPEED 2.0f // pixels per second
+#define SLEEP_FRAMES 30
+bool fast_settle = false;
+bool cloth_asleep = false;
+int quiet_frames = 0;
+
+bool reduced_resync = false; // particles[] changed under the reduced model
+
+// Tearing and fragments (opt-in). A constraint stretched past its rest
+// length by more than the material's tear_distance breaks for good, which
+// can split the cloth into fragments: connected components of the intact
+// constraints, found by union-find and rebuilt at most every
+// FRAGMENT_REBUILD_FRAMES frames while tears keep coming. Each fragment
+// sleeps on its own, and one without pins that has left the view is culled
+// for good. Sleeping and culled fragments drop out of the solver: their
+// constraints leave constraints[] and their particles are frozen (held like
+// pins) until input wakes them.
+#define FRAGMENT_REBUILD_FRAMES 10
+#define FRAGMENT_CULL_MARGIN 100.0f // pixels beyond the view
+
+typedef struct {
+    int particles, pins;
+    int quiet_frames;
+    float speed_sq; // largest free-particle speed squared, last frame
+    bool asleep, culled;
+} Fragment;
+
+bool tearing = false;
+bool constraint_torn[NUM_CONSTRAINTS]; // by all_constraints index
+bool particle_frozen[NUM_PARTICLES];
+int particle_fragment[NUM_PARTICLES];
+Fragment fragments[NUM_PARTICLES];
+int num_fragments = 1;
+int frozen_particles = 0;
+bool fragments_dirty = false;  // tears since the last rebuild
+int frames_since_rebuild = 0;
+bool wake_fragments = false;
+ConstraintIndex all_constraint_indices[NUM_CONSTRAINTS]; // for drawing
+float view_x = 0, view_y = 0; // world position of the viewport's top-left corner
+
+// One fragment holding the whole cloth, nothing torn or frozen
+void reset_fragments() {
+    memset(constraint_torn, 0, sizeof(constraint_torn));
+    memset(particle_frozen, 0, sizeof(particle_frozen));
+    memset(particle_fragment, 0, sizeof(particle_fragment));
+    fragments[0] = (Fragment){NUM_PARTICLES, 0, 0, 0, false, false};
+    num_fragments = 1;
+    frozen_particles = 0;
+    fragments_dirty = false;
+    frames_since_rebuild = 0;
+    for (int i = 0; i < NUM_CONSTRAINTS; i++) active_source[i] = i;
+    num_constraints = NUM_CONSTRAINTS;
+}
+
+void wake_cloth() {
+    cloth_asleep = false;
+    quiet_frames = 0;
+    reduced_resync = true;
+    wake_fragments = true;
+}
+
+// Reciprocal square root of x (> 0) at the requested accuracy
+float rsqrt_refined(float x, RsqrtAccuracy accuracy) {
+    if (accuracy == RSQRT_EXACT) return 1.0f / sqrtf(x);
+
+    float r = _mm_cvtss_f32(_mm_rsqrt_ss(_mm_set_ss(x)));
+    for (int i = RSQRT_APPROX; i < (int)accuracy; i++) {
+        r = r * (1.5f - 0.5f * x * r * r);
+    }
+    return r;
+}
 
 // Implementation of physics functions
 void apply_force_cotton(void* particle_ptr, float dt) {
@@ -116,11 +336,18 @@ void apply_force_cotton(void* particle_ptr, float dt) {
     p->force_y = GRAVITY * p->mass;
     
     // Air resistance
-    float speed = sqrtf(p->vx * p->vx + p->vy * p->vy);
-    if (speed > 0) {
-        float air_force = speed * speed * p->material->air_friction;
-        p->force_x -= (p->vx / speed) * air_force;
-        p->force_y -= (p->vy / speed) * air_force;
+    float speed_sq = p->vx * p->vx + p->vy * p->vy;
+    if (speed_sq > 0) {
+        float air_force = speed_sq * p->material->air_friction;
+        if (p->material->rsqrt_accuracy == RSQRT_EXACT) {
+            float speed = sqrtf(speed_sq);
+            p->force_x -= (p->vx / speed) * air_force;
+            p->force_y -= (p->vy / speed) * air_force;
+        } else {
+            float inv_speed = rsqrt_refined(speed_sq, p->material->rsqrt_accuracy);
+            p->force_x -= p->vx * inv_speed * air_force;
+            p->force_y -= p->vy * inv_speed * air_force;
+        }
     }
     
     // Update velocity and position
@@ -137,20 +364,14 @@ void apply_force_cotton(void* particle_ptr, float dt) {
     p->old_y = temp_y;
 }
 
-// Similar implementations for silk and denim
+// Silk and denim share the cotton force law; their damping is applied to
+// the motion relative to the cloth by damp_relative_motion
 void apply_force_silk(void* particle_ptr, float dt) {
-    Particle* p = (Particle*)particle_ptr;
-    apply_force_cotton(p, dt); // Base implementation with silk-specific adjustments
-    p->vx *= p->material->damping;
-    p->vy *= p->material->damping;
+    apply_force_cotton(particle_ptr, dt);
 }
 
 void apply_force_denim(void* particle_ptr, float dt) {
-    Particle* p = (Particle*)particle_ptr;
-    apply_force_cotton(p, dt); // Base implementation with denim-specific adjustments
-    // Add more resistance to movement
-    p->vx *= p->material->damping * 0.9f;
-    p->vy *= p->material->damping * 0.9f;
+    apply_force_cotton(particle_ptr, dt);
 }
 
 float calc_energy_cotton(void* particle_ptr, void** neighbors, int num_neighbors) {
@@ -188,18 +409,25 @@ void solve_constraint_cotton(void* p1_ptr, void* p2_ptr, float rest_length) {
     
     float dx = p2->x - p1->x;
     float dy = p2->y - p1->y;
-    float dist = sqrtf(dx * dx + dy * dy);
+    float dist_sq = dx * dx + dy * dy;
     
-    if (dist > 0.0001f) {
-        float diff = (dist - rest_length) / dist;
+    if (dist_sq > 0.0001f * 0.0001f) {
+        float diff;
+        if (p1->material->rsqrt_accuracy == RSQRT_EXACT) {
+            float dist = sqrtf(dist_sq);
+            diff = (dist - rest_length) / dist;
+        } else {
+            // (dist - rest) / dist == 1 - rest / dist, no sqrt or divide needed
+            diff = 1.0f - rest_length * rsqrt_refined(dist_sq, p1->material->rsqrt_accuracy);
+        }
         
         if (!p1->locked) {
-            p1->x += dx * diff * 0.5f * p1->material->elasticity;
-            p1->y += dy * diff * 0.5f * p1->material->elasticity;
+            p1->x += dx * diff * (0.5f * solver.relaxation) * p1->material->elasticity;
+            p1->y += dy * diff * (0.5f * solver.relaxation) * p1->material->elasticity;
         }
         if (!p2->locked) {
-            p2->x -= dx * diff * 0.5f * p2->material->elasticity;
-            p2->y -= dy * diff * 0.5f * p2->material->elasticity;
+            p2->x -= dx * diff * (0.5f * solver.relaxation) * p2->material->elasticity;
+            p2->y -= dy * diff * (0.5f * solver.relaxation) * p2->material->elasticity;
         }
     }
 }
@@ -213,6 +441,214 @@ void solve_constraint_denim(void* p1_ptr, void* p2_ptr, float rest_length) {
     solve_constraint_cotton(p1_ptr, p2_ptr, rest_length * 0.9f);
 }
 
+// Fraction of the rest length a material's constraint law pulls to
+float material_rest_scale(const Material* m) {
+    return (m->solve_constraint == solve_constraint_denim) ? 0.9f : 1.0f;
+}
+
+// Layout-generic kernels. They implement the material laws (the reference
+// apply_force_* / solve_constraint_*, which differ only in the rest length
+// the constraints pull to) on index-addressed storage; each layout
+// instantiates them with its own field accessors.
+#define DEFINE_LAYOUT_KERNELS(suffix, Store, X, Y, OX, OY, VX, VY, LOCKED) \
+void integrate_##suffix(Store* s, int count, const Material* m, float dt) { \
+    const float GRAVITY = 980.0f; \
+    for (int i = 0; i < count; i++) { \
+        if (LOCKED(s, i)) continue; \
+        float vx = VX(s, i), vy = VY(s, i); \
+        float force_x = 0, force_y = GRAVITY * m->mass; \
+        float speed_sq = vx * vx + vy * vy; \
+        if (speed_sq > 0) { \
+            float air_force = speed_sq * m->air_friction; \
+            float inv_speed = rsqrt_refined(speed_sq, m->rsqrt_accuracy); \
+            force_x -= vx * inv_speed * air_force; \
+            force_y -= vy * inv_speed * air_force; \
+        } \
+        float ax = force_x / m->mass; \
+        float ay = force_y / m->mass; \
+        float x = X(s, i), y = Y(s, i); \
+        vx = (x - OX(s, i)) / dt + ax * dt; \
+        vy = (y - OY(s, i)) / dt + ay * dt; \
+        VX(s, i) = vx; \
+        VY(s, i) = vy; \
+        X(s, i) = x + vx * dt; \
+        Y(s, i) = y + vy * dt; \
+        OX(s, i) = x; \
+        OY(s, i) = y; \
+    } \
+} \
+\
+void drag_##suffix(Store* s, int count, float mx, float my) { \
+    for (int i = 0; i < count; i++) { \
+        float dx = X(s, i) - mx; \
+        float dy = Y(s, i) - my; \
+        if (dx * dx + dy * dy < 20.0f * 20.0f && !LOCKED(s, i)) { \
+            X(s, i) = OX(s, i) = mx; \
+            Y(s, i) = OY(s, i) = my; \
+        } \
+    } \
+} \
+\
+void solve_constraints_##suffix(Store* s, const ConstraintIndex* c, int count, const Material* m) { \
+    float k = 0.5f * m->elasticity * solver.relaxation; \
+    float rest_scale = material_rest_scale(m); \
+    for (int i = 0; i < count; i++) { \
+        int a = c[i].a, b = c[i].b; \
+        float dx = X(s, b) - X(s, a); \
+        float dy = Y(s, b) - Y(s, a); \
+        float dist_sq = dx * dx + dy * dy; \
+        if (dist_sq <= 0.0001f * 0.0001f) continue; \
+        float diff = 1.0f - c[i].rest_length * rest_scale * rsqrt_refined(dist_sq, m->rsqrt_accuracy); \
+        if (!LOCKED(s, a)) { \
+            X(s, a) += dx * diff * k; \
+            Y(s, a) += dy * diff * k; \
+        } \
+        if (!LOCKED(s, b)) { \
+            X(s, b) -= dx * diff * k; \
+            Y(s, b) -= dy * diff * k; \
+        } \
+    } \
+} \
+\
+void collide_##suffix(Store* s, int first, int last, const Collider* set, int set_count) { \
+    for (int i = first; i < last; i++) { \
+        if (LOCKED(s, i)) continue; \
+        for (int c = 0; c < set_count; c++) { \
+            float dx = X(s, i) - set[c].x; \
+            float dy = Y(s, i) - set[c].y; \
+            float dist_sq = dx * dx + dy * dy; \
+            float r = set[c].radius; \
+            if (dist_sq >= r * r || dist_sq <= 0) continue; \
+            float scale = r * rsqrt_refined(dist_sq, RSQRT_NEWTON2); \
+            X(s, i) = set[c].x + dx * scale; \
+            Y(s, i) = set[c].y + dy * scale; \
+        } \
+    } \
+}
+
+#define AOS_X(s, i) ((s)->p[i].x)
+#define AOS_Y(s, i) ((s)->p[i].y)
+#define AOS_OX(s, i) ((s)->p[i].old_x)
+#define AOS_OY(s, i) ((s)->p[i].old_y)
+#define AOS_VX(s, i) ((s)->p[i].vx)
+#define AOS_VY(s, i) ((s)->p[i].vy)
+#define AOS_LOCKED(s, i) ((s)->p[i].locked)
+
+#define SOA_X(s, i) ((s)->x[i])
+#define SOA_Y(s, i) ((s)->y[i])
+#define SOA_OX(s, i) ((s)->old_x[i])
+#define SOA_OY(s, i) ((s)->old_y[i])
+#define SOA_VX(s, i) ((s)->vx[i])
+#define SOA_VY(s, i) ((s)->vy[i])
+#define SOA_LOCKED(s, i) ((s)->locked[i])
+
+#define AOSOA_FIELD(s, i, f) ((s)->blocks[(unsigned)(i) / AOSOA_WIDTH].f[(unsigned)(i) % AOSOA_WIDTH])
+#define AOSOA_X(s, i) AOSOA_FIELD(s, i, x)
+#define AOSOA_Y(s, i) AOSOA_FIELD(s, i, y)
+#define AOSOA_OX(s, i) AOSOA_FIELD(s, i, old_x)
+#define AOSOA_OY(s, i) AOSOA_FIELD(s, i, old_y)
+#define AOSOA_VX(s, i) AOSOA_FIELD(s, i, vx)
+#define AOSOA_VY(s, i) AOSOA_FIELD(s, i, vy)
+#define AOSOA_LOCKED(s, i) ((s)->locked[i])
+
+DEFINE_LAYOUT_KERNELS(aos, ParticlesAoS, AOS_X, AOS_Y, AOS_OX, AOS_OY, AOS_VX, AOS_VY, AOS_LOCKED)
+DEFINE_LAYOUT_KERNELS(soa, ParticlesSoA, SOA_X, SOA_Y, SOA_OX, SOA_OY, SOA_VX, SOA_VY, SOA_LOCKED)
+DEFINE_LAYOUT_KERNELS(aosoa, ParticlesAoSoA, AOSOA_X, AOSOA_Y, AOSOA_OX, AOSOA_OY, AOSOA_VX, AOSOA_VY, AOSOA_LOCKED)
+
+bool alloc_soa(ParticlesSoA* s, int count) {
+    size_t bytes = sizeof(float) * count;
+    s->x = _mm_malloc(bytes, 64);
+    s->y = _mm_malloc(bytes, 64);
+    s->old_x = _mm_malloc(bytes, 64);
+    s->old_y = _mm_malloc(bytes, 64);
+    s->vx = _mm_malloc(bytes, 64);
+    s->vy = _mm_malloc(bytes, 64);
+    s->locked = _mm_malloc(sizeof(bool) * count, 64);
+    return s->x && s->y && s->old_x && s->old_y && s->vx && s->vy && s->locked;
+}
+
+void free_soa(ParticlesSoA* s) {
+    _mm_free(s->x);
+    _mm_free(s->y);
+    _mm_free(s->old_x);
+    _mm_free(s->old_y);
+    _mm_free(s->vx);
+    _mm_free(s->vy);
+    _mm_free(s->locked);
+}
+
+bool alloc_aosoa(ParticlesAoSoA* s, int count) {
+    int num_blocks = (count + AOSOA_WIDTH - 1) / AOSOA_WIDTH;
+    s->blocks = _mm_malloc(sizeof(ParticleBlock) * num_blocks, 64);
+    s->locked = _mm_malloc(sizeof(bool) * count, 64);
+    if (s->blocks) memset(s->blocks, 0, sizeof(ParticleBlock) * num_blocks);
+    return s->blocks && s->locked;
+}
+
+void free_aosoa(ParticlesAoSoA* s) {
+    _mm_free(s->blocks);
+    _mm_free(s->locked);
+}
+
+// Copy particle state between the Particle array and a layout store
+void load_soa(ParticlesSoA* s, const Particle* src, int count) {
+    for (int i = 0; i < count; i++) {
+        s->x[i] = src[i].x;
+        s->y[i] = src[i].y;
+        s->old_x[i] = src[i].old_x;
+        s->old_y[i] = src[i].old_y;
+        s->vx[i] = src[i].vx;
+        s->vy[i] = src[i].vy;
+        s->locked[i] = src[i].locked;
+    }
+}
+
+void store_soa(const ParticlesSoA* s, Particle* dst, int count) {
+    for (int i = 0; i < count; i++) {
+        dst[i].x = s->x[i];
+        dst[i].y = s->y[i];
+        dst[i].old_x = s->old_x[i];
+        dst[i].old_y = s->old_y[i];
+        dst[i].vx = s->vx[i];
+        dst[i].vy = s->vy[i];
+    }
+}
+
+void load_aosoa(ParticlesAoSoA* s, const Particle* src, int count) {
+    for (int i = 0; i < count; i++) {
+        AOSOA_X(s, i) = src[i].x;
+        AOSOA_Y(s, i) = src[i].y;
+        AOSOA_OX(s, i) = src[i].old_x;
+        AOSOA_OY(s, i) = src[i].old_y;
+        AOSOA_VX(s, i) = src[i].vx;
+        AOSOA_VY(s, i) = src[i].vy;
+        s->locked[i] = src[i].locked;
+    }
+}
+
+void store_aosoa(const ParticlesAoSoA* s, Particle* dst, int count) {
+    for (int i = 0; i < count; i++) {
+        dst[i].x = AOSOA_X(s, i);
+        dst[i].y = AOSOA_Y(s, i);
+        dst[i].old_x = AOSOA_OX(s, i);
+        dst[i].old_y = AOSOA_OY(s, i);
+        dst[i].vx = AOSOA_VX(s, i);
+        dst[i].vy = AOSOA_VY(s, i);
+    }
+}
+
+// Switch the active material, keeping any accuracy override from the command line
+void select_material(const Material* material) {
+    current_material = *material;
+    for (int i = 0; i < (int)SDL_arraysize(MATERIALS); i++) {
+        if (MATERIALS[i] == material) current_material_index = i;
+    }
+    if (rsqrt_override >= 0) {
+        current_material.rsqrt_accuracy = (RsqrtAccuracy)rsqrt_override;
+    }
+    wake_cloth();
+}
+
 void init_particles() {
     // Calculate starting position to center the cloth
     float start_x = (SCREEN_WIDTH - (GRID_WIDTH - 1) * PARTICLE_SPACING) / 2;
@@ -229,41 +665,237 @@ void init_particles() {
             p->force_x = p->force_y = 0;
             p->mass = current_material.mass;
             p->material = &current_material;
-            p->locked = (y == 0); // Lock entire top row
+            // Lock entire top row, or just its two corners
+            p->locked = (y == 0) && (pin_mode == PINS_TOP_ROW || x == 0 || x == GRID_WIDTH - 1);
             p->neighbors = NULL;
             p->num_neighbors = 0;
         }
     }
+    wake_cloth();
+}
+
+// Emit the constraints of the cells in [x0, x1) x [y0, y1) by halving the
+// longer side until single cells remain; each cell contributes its right and
+// down links. Every level of the recursion touches a compact block of rows,
+// so the sweep stays cache-resident at any grid width without a tile size.
+int emit_recursive_order(ConstraintIndex* out, int count, int width, int height, int x0, int y0, int x1, int y1) {
+    if (x1 - x0 == 1 && y1 - y0 == 1) {
+        int i = y0 * width + x0;
+        if (x0 < width - 1) out[count++] = (ConstraintIndex){i, i + 1, PARTICLE_SPACING};
+        if (y0 < height - 1) out[count++] = (ConstraintIndex){i, i + width, PARTICLE_SPACING};
+        return count;
+    }
+    if (x1 - x0 >= y1 - y0) {
+        int mid = (x0 + x1) / 2;
+        count = emit_recursive_order(out, count, width, height, x0, y0, mid, y1);
+        return emit_recursive_order(out, count, width, height, mid, y0, x1, y1);
+    }
+    int mid = (y0 + y1) / 2;
+    count = emit_recursive_order(out, count, width, height, x0, y0, x1, mid);
+    return emit_recursive_order(out, count, width, height, x0, mid, x1, y1);
 }
 
 void init_constraints() {
-    int index = 0;
-    for (int y = 0; y < GRID_HEIGHT; y++) {
-        for (int x = 0; x < GRID_WIDTH - 1; x++) {
-            constraints[index++] = (Constraint){
-                &particles[y * GRID_WIDTH + x],
-                &particles[y * GRID_WIDTH + x + 1],
+    if (sweep_order == SWEEP_RECURSIVE) {
+        static ConstraintIndex order[NUM_CONSTRAINTS];
+        emit_recursive_order(order, 0, GRID_WIDTH, GRID_HEIGHT, 0, 0, GRID_WIDTH, GRID_HEIGHT);
+        for (int i = 0; i < NUM_CONSTRAINTS; i++) {
+            constraints[i] = (Constraint){
+                &particles[order[i].a],
+                &particles[order[i].b],
                 PARTICLE_SPACING,
                 current_material.stiffness
             };
         }
+    } else {
+        int index = 0;
+        for (int y = 0; y < GRID_HEIGHT; y++) {
+            for (int x = 0; x < GRID_WIDTH - 1; x++) {
+                constraints[index++] = (Constraint){
+                    &particles[y * GRID_WIDTH + x],
+                    &particles[y * GRID_WIDTH + x + 1],
+                    PARTICLE_SPACING,
+                    current_material.stiffness
+                };
+            }
+        }
+        for (int y = 0; y < GRID_HEIGHT - 1; y++) {
+            for (int x = 0; x < GRID_WIDTH; x++) {
+                constraints[index++] = (Constraint){
+                    &particles[y * GRID_WIDTH + x],
+                    &particles[(y + 1) * GRID_WIDTH + x],
+                    PARTICLE_SPACING,
+                    current_material.stiffness
+                };
+            }
+        }
     }
-    for (int y = 0; y < GRID_HEIGHT - 1; y++) {
-        for (int x = 0; x < GRID_WIDTH; x++) {
-            constraints[index++] = (Constraint){
-                &particles[y * GRID_WIDTH + x],
-                &particles[(y + 1) * GRID_WIDTH + x],
-                PARTICLE_SPACING,
-                current_material.stiffness
-            };
+    memcpy(all_constraints, constraints, sizeof(constraints));
+    for (int i = 0; i < NUM_CONSTRAINTS; i++) {
+        all_constraint_indices[i] = (ConstraintIndex){
+            (int)(all_constraints[i].p1 - particles),
+            (int)(all_constraints[i].p2 - particles),
+            all_constraints[i].rest_length
+        };
+    }
+    reset_fragments();
+}
+
+// Index form of constraints[] for the layout kernels
+void init_constraint_indices() {
+    for (int i = 0; i < num_constraints; i++) {
+        constraint_indices[i] = (ConstraintIndex){
+            (int)(constraints[i].p1 - particles),
+            (int)(constraints[i].p2 - particles),
+            constraints[i].rest_length
+        };
+    }
+}
+
+void init_constraint_colors() {
+    int index = 0;
+    for (int color = 0; color < NUM_CONSTRAINT_COLORS; color++) {
+        color_offsets[color] = index;
+        for (int i = 0; i < num_constraints; i++) {
+            Constraint* c = &constraints[i];
+            int a = (int)(c->p1 - particles), b = (int)(c->p2 - particles);
+            bool horizontal = (b - a == 1);
+            int parity = horizontal ? (a % GRID_WIDTH) % 2 : (a / GRID_WIDTH) % 2;
+            if ((horizontal ? 0 : 2) + parity == color) colored_constraints[index++] = *c;
+        }
+    }
+    color_offsets[NUM_CONSTRAINT_COLORS] = index;
+    for (int i = 0; i < index; i++) {
+        colored_indices[i] = (ConstraintIndex){
+            (int)(colored_constraints[i].p1 - particles),
+            (int)(colored_constraints[i].p2 - particles),
+            colored_constraints[i].rest_length
+        };
+    }
+}
+
+// Wide constraint batches (--wide-batches, SoA layout). Each batch of
+// WIDE_BATCH constraints is solved as one: every constraint reads the
+// positions from before the batch, and the corrections are summed into the
+// particles. The batches run over the colored order, where a batch within
+// one color touches each particle once and so gives the same result as the
+// sequential sweep of that color; only batches straddling a color boundary
+// (or, for a mesh without a perfect coloring, any batch) have lanes sharing
+// a particle. The AVX-512 kernel resolves those during the scatter with
+// vpconflictd: each round writes the lanes whose earlier duplicates have
+// all been written, so every particle gets its corrections in lane order.
+// CPUs without AVX-512 CD take the split path, which applies the lanes one
+// by one in the same order. Both use the SoA kernel's arithmetic with the
+// exact reciprocal square root, whatever the material's rsqrt accuracy, so
+// they agree to the bit with each other and, batch by batch within a color,
+// with solve_constraints_soa on an exact material.
+#define WIDE_BATCH 16
+
+bool wide_batches = false;
+float wide_weight[NUM_PARTICLES]; // 0 for locked particles, else 1
+
+typedef void (*WideKernel)(ParticlesSoA* s, const ConstraintIndex* c, int count, float k, float rest_scale);
+
+void solve_constraints_wide_split(ParticlesSoA* s, const ConstraintIndex* c, int count, float k, float rest_scale) {
+    float fx[WIDE_BATCH], fy[WIDE_BATCH];
+    for (int first = 0; first < count; first += WIDE_BATCH) {
+        int n = count - first < WIDE_BATCH ? count - first : WIDE_BATCH;
+        const ConstraintIndex* batch = &c[first];
+        for (int lane = 0; lane < n; lane++) {
+            int a = batch[lane].a, b = batch[lane].b;
+            float dx = s->x[b] - s->x[a];
+            float dy = s->y[b] - s->y[a];
+            float dist_sq = dx * dx + dy * dy;
+            float diff = 0;
+            if (dist_sq > 0.0001f * 0.0001f) {
+                diff = 1.0f - batch[lane].rest_length * rest_scale * (1.0f / sqrtf(dist_sq));
+            }
+            fx[lane] = dx * diff * k;
+            fy[lane] = dy * diff * k;
+        }
+        for (int lane = 0; lane < n; lane++) {
+            int a = batch[lane].a;
+            s->x[a] += fx[lane] * wide_weight[a];
+            s->y[a] += fy[lane] * wide_weight[a];
+        }
+        for (int lane = 0; lane < n; lane++) {
+            int b = batch[lane].b;
+            s->x[b] -= fx[lane] * wide_weight[b];
+            s->y[b] -= fy[lane] * wide_weight[b];
         }
     }
 }
 
-void handle_mouse_interaction() {
-    if (!mouse_down) return;
-    
-    for (int i = 0; i < GRID_WIDTH * GRID_HEIGHT; i++) {
+// base[index] += delta for the lanes in mask, duplicates in lane order
+__attribute__((target("avx512f,avx512cd")))
+void wide_scatter_add(float* base, __m512i index, __m512 delta, __mmask16 mask) {
+    __m512i earlier = _mm512_maskz_conflict_epi32(mask, index);
+    __mmask16 pending = mask;
+    while (pending) {
+        __mmask16 ready = _mm512_mask_testn_epi32_mask(pending, earlier, _mm512_set1_epi32(pending));
+        __m512 value = _mm512_mask_i32gather_ps(_mm512_setzero_ps(), ready, index, base, 4);
+        _mm512_mask_i32scatter_ps(base, ready, index, _mm512_add_ps(value, delta), 4);
+        pending &= ~ready;
+    }
+}
+
+__attribute__((target("avx512f,avx512cd")))
+void solve_constraints_wide_avx512(ParticlesSoA* s, const ConstraintIndex* c, int count, float k, float rest_scale) {
+    // Lane offsets of a, b and rest_length in an array of ConstraintIndex
+    const __m512i fields = _mm512_mullo_epi32(_mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15),
+        _mm512_set1_epi32(sizeof(ConstraintIndex) / sizeof(int)));
+    const __m512i one = _mm512_set1_epi32(1);
+    const __m512 zero = _mm512_setzero_ps(), k16 = _mm512_set1_ps(k), scale16 = _mm512_set1_ps(rest_scale);
+    const __m512 one_ps = _mm512_set1_ps(1.0f);
+    const __m512 min_dist_sq = _mm512_set1_ps(0.0001f * 0.0001f);
+    for (int first = 0; first < count; first += WIDE_BATCH) {
+        int n = count - first < WIDE_BATCH ? count - first : WIDE_BATCH;
+        __mmask16 lanes = (__mmask16)((1u << n) - 1);
+        const int* batch = (const int*)&c[first];
+        __m512i a = _mm512_mask_i32gather_epi32(_mm512_setzero_si512(), lanes, fields, batch, 4);
+        __m512i b = _mm512_mask_i32gather_epi32(_mm512_setzero_si512(), lanes, _mm512_add_epi32(fields, one), batch, 4);
+        __m512 rest = _mm512_mask_i32gather_ps(zero, lanes, _mm512_add_epi32(fields, _mm512_add_epi32(one, one)), batch, 4);
+        __m512 dx = _mm512_sub_ps(_mm512_mask_i32gather_ps(zero, lanes, b, s->x, 4), _mm512_mask_i32gather_ps(zero, lanes, a, s->x, 4));
+        __m512 dy = _mm512_sub_ps(_mm512_mask_i32gather_ps(zero, lanes, b, s->y, 4), _mm512_mask_i32gather_ps(zero, lanes, a, s->y, 4));
+        // Rounded products, so the compiler cannot fuse them into FMAs the
+        // split path does not use
+        __m512 dist_sq = _mm512_add_ps(_mm512_mul_round_ps(dx, dx, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC),
+                                       _mm512_mul_round_ps(dy, dy, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC));
+        __mmask16 valid = _mm512_mask_cmp_ps_mask(lanes, dist_sq, min_dist_sq, _CMP_GT_OQ);
+        __m512 inv_dist = _mm512_div_ps(one_ps, _mm512_sqrt_ps(dist_sq));
+        __m512 pull = _mm512_mul_round_ps(_mm512_mul_round_ps(rest, scale16, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC),
+                                          inv_dist, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+        __m512 diff = _mm512_maskz_sub_ps(valid, one_ps, pull);
+        __m512 fx = _mm512_mul_ps(_mm512_mul_ps(dx, diff), k16);
+        __m512 fy = _mm512_mul_ps(_mm512_mul_ps(dy, diff), k16);
+        __m512 wa = _mm512_mask_i32gather_ps(zero, lanes, a, wide_weight, 4);
+        __m512 wb = _mm512_mask_i32gather_ps(zero, lanes, b, wide_weight, 4);
+        wide_scatter_add(s->x, a, _mm512_mul_round_ps(fx, wa, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC), lanes);
+        wide_scatter_add(s->y, a, _mm512_mul_round_ps(fy, wa, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC), lanes);
+        wide_scatter_add(s->x, b, _mm512_sub_ps(zero, _mm512_mul_round_ps(fx, wb, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC)), lanes);
+        wide_scatter_add(s->y, b, _mm512_sub_ps(zero, _mm512_mul_round_ps(fy, wb, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC)), lanes);
+    }
+}
+
+// The AVX-512 kernel where the CPU and OS support it, else the split path
+WideKernel wide_kernel() {
+    static WideKernel kernel = NULL;
+    if (!kernel) {
+        __builtin_cpu_init();
+        bool avx512 = __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512cd");
+        kernel = avx512 ? solve_constraints_wide_avx512 : solve_constraints_wide_split;
+    }
+    return kernel;
+}
+
+void solve_constraints_wide(ParticlesSoA* s, const ConstraintIndex* c, int count, const Material* m) {
+    for (int i = 0; i < NUM_PARTICLES; i++) wide_weight[i] = s->locked[i] ? 0.0f : 1.0f;
+    wide_kernel()(s, c, count, 0.5f * m->elasticity * solver.relaxation, material_rest_scale(m));
+}
+
+// Snap unlocked particles in [first, last) near the cursor onto it
+void drag_particle_range(int first, int last) {
+    for (int i = first; i < last; i++) {
         Particle *p = &particles[i];
         float dx = p->x - mouse.x;
         float dy = p->y - mouse.y;
@@ -278,99 +910,5869 @@ void handle_mouse_interaction() {
     }
 }
 
-void render_cloth(SDL_Renderer *renderer) {
-    // Draw constraints
-    SDL_SetRenderDrawColor(renderer, 200, 200, 200, 255);
-    for (int i = 0; i < (GRID_WIDTH - 1) * GRID_HEIGHT + GRID_WIDTH * (GRID_HEIGHT - 1); i++) {
-        Constraint *c = &constraints[i];
-        SDL_RenderDrawLine(renderer, 
-            (int)c->p1->x, (int)c->p1->y, 
-            (int)c->p2->x, (int)c->p2->y);
+void handle_mouse_interaction() {
+    if (!mouse_down) return;
+    drag_particle_range(0, NUM_PARTICLES);
+}
+
+// Broad phase by sweep and prune. The proxies are the cloth's tiles of
+// TILE_SIZE x TILE_SIZE particles, the colliders and the mouse; each has a
+// bounding box, and its endpoints stay sorted per axis across frames. Boxes
+// move little between substeps, so insertion sort re-sorts them in close to
+// linear time, and every swap of a min past a max adds or removes a
+// tile-vs-other pair. Pairs between two tiles or two non-tiles are never
+// stored. The mouse and collider passes each update the boxes from the
+// current positions and then visit only the paired tiles, so they move the
+// same particles the brute-force passes do.
+typedef enum {
+    BROAD_PHASE_BRUTE,
+    BROAD_PHASE_SAP
+} BroadPhaseMode;
+
+#define TILE_SIZE 5
+#define TILES_X ((GRID_WIDTH + TILE_SIZE - 1) / TILE_SIZE)
+#define TILES_Y ((GRID_HEIGHT + TILE_SIZE - 1) / TILE_SIZE)
+#define NUM_TILES (TILES_X * TILES_Y)
+#define PROXY_COLLIDER(c) (NUM_TILES + (c))
+#define PROXY_MOUSE (NUM_TILES + MAX_COLLIDERS)
+#define MAX_PROXIES (PROXY_MOUSE + 1)
+#define MAX_PAIRS (NUM_TILES * (MAX_COLLIDERS + 1))
+#define PROXY_PARKED 1e30f // box of an unused proxy
+
+typedef struct {
+    float min[2], max[2];
+} Bounds;
+
+typedef struct {
+    float value;
+    Uint16 proxy;
+    Uint16 is_max;
+} Endpoint;
+
+typedef struct {
+    Bounds bounds[MAX_PROXIES];
+    Endpoint endpoints[2][2 * MAX_PROXIES];
+    Uint16 pairs[MAX_PAIRS][2];               // tile, other
+    Sint16 pair_slot[NUM_TILES][MAX_PROXIES - NUM_TILES];
+    int num_pairs;
+    bool built;
+} BroadPhase;
+
+BroadPhaseMode broad_phase_mode = BROAD_PHASE_BRUTE;
+BroadPhase broad_phase;
+
+bool bounds_overlap(const Bounds* a, const Bounds* b) {
+    return a->min[0] <= b->max[0] && b->min[0] <= a->max[0] &&
+           a->min[1] <= b->max[1] && b->min[1] <= a->max[1];
+}
+
+void broad_phase_add_pair(int a, int b) {
+    if ((a < NUM_TILES) == (b < NUM_TILES)) return;
+    int tile = a < NUM_TILES ? a : b, other = a < NUM_TILES ? b : a;
+    Sint16* slot = &broad_phase.pair_slot[tile][other - NUM_TILES];
+    if (*slot >= 0) return;
+    *slot = (Sint16)broad_phase.num_pairs;
+    broad_phase.pairs[broad_phase.num_pairs][0] = (Uint16)tile;
+    broad_phase.pairs[broad_phase.num_pairs][1] = (Uint16)other;
+    broad_phase.num_pairs++;
+}
+
+void broad_phase_remove_pair(int a, int b) {
+    if ((a < NUM_TILES) == (b < NUM_TILES)) return;
+    int tile = a < NUM_TILES ? a : b, other = a < NUM_TILES ? b : a;
+    Sint16* slot = &broad_phase.pair_slot[tile][other - NUM_TILES];
+    if (*slot < 0) return;
+    // Swap-remove, then repoint the moved pair's slot
+    int last = --broad_phase.num_pairs;
+    broad_phase.pairs[*slot][0] = broad_phase.pairs[last][0];
+    broad_phase.pairs[*slot][1] = broad_phase.pairs[last][1];
+    broad_phase.pair_slot[broad_phase.pairs[*slot][0]][broad_phase.pairs[*slot][1] - NUM_TILES] = *slot;
+    *slot = -1;
+}
+
+// Current boxes: tiles from their particles, colliders
+// from their circles, the mouse from its grab radius while the button is down
+void broad_phase_bounds() {
+    for (int tile = 0; tile < NUM_TILES; tile++) {
+        Bounds* b = &broad_phase.bounds[tile];
+        b->min[0] = b->min[1] = PROXY_PARKED;
+        b->max[0] = b->max[1] = -PROXY_PARKED;
     }
-    
-    // Draw particles
-    for (int i = 0; i < GRID_WIDTH * GRID_HEIGHT; i++) {
-        Particle *p = &particles[i];
-        if (p->locked) {
-            SDL_SetRenderDrawColor(renderer, 255, 0, 0, 255);
+    // One pass in memory order; plain compares keep it branch-free
+    for (int y = 0; y < GRID_HEIGHT; y++) {
+        Bounds* row = &broad_phase.bounds[(y / TILE_SIZE) * TILES_X];
+        const Particle* p = &particles[y * GRID_WIDTH];
+        for (int x = 0; x < GRID_WIDTH; x++) {
+            Bounds* b = &row[x / TILE_SIZE];
+            b->min[0] = p[x].x < b->min[0] ? p[x].x : b->min[0];
+            b->max[0] = p[x].x > b->max[0] ? p[x].x : b->max[0];
+            b->min[1] = p[x].y < b->min[1] ? p[x].y : b->min[1];
+            b->max[1] = p[x].y > b->max[1] ? p[x].y : b->max[1];
+        }
+    }
+    for (int c = 0; c < MAX_COLLIDERS; c++) {
+        Bounds* b = &broad_phase.bounds[PROXY_COLLIDER(c)];
+        if (c < num_colliders) {
+            *b = (Bounds){{colliders[c].x - colliders[c].radius, colliders[c].y - colliders[c].radius},
+                          {colliders[c].x + colliders[c].radius, colliders[c].y + colliders[c].radius}};
         } else {
-            SDL_SetRenderDrawColor(renderer, 100, 100, 100, 255);
+            *b = (Bounds){{PROXY_PARKED, PROXY_PARKED}, {PROXY_PARKED, PROXY_PARKED}};
         }
-        SDL_Rect rect = {(int)p->x - 2, (int)p->y - 2, 4, 4};
-        SDL_RenderFillRect(renderer, &rect);
+    }
+    Bounds* m = &broad_phase.bounds[PROXY_MOUSE];
+    if (mouse_down) {
+        *m = (Bounds){{mouse.x - 20.0f, mouse.y - 20.0f}, {mouse.x + 20.0f, mouse.y + 20.0f}};
+    } else {
+        *m = (Bounds){{PROXY_PARKED, PROXY_PARKED}, {PROXY_PARKED, PROXY_PARKED}};
     }
 }
 
-int main(int argc, char *argv[]);
+// First use: sort from scratch and find the pairs by brute force
+void broad_phase_build() {
+    for (int axis = 0; axis < 2; axis++) {
+        Endpoint* e = broad_phase.endpoints[axis];
+        for (int i = 0; i < MAX_PROXIES; i++) {
+            e[2 * i] = (Endpoint){broad_phase.bounds[i].min[axis], (Uint16)i, 0};
+            e[2 * i + 1] = (Endpoint){broad_phase.bounds[i].max[axis], (Uint16)i, 1};
+        }
+        for (int i = 1; i < 2 * MAX_PROXIES; i++) {
+            Endpoint moving = e[i];
+            int j = i - 1;
+            for (; j >= 0 && e[j].value > moving.value; j--) e[j + 1] = e[j];
+            e[j + 1] = moving;
+        }
+    }
+    memset(broad_phase.pair_slot, 0xff, sizeof(broad_phase.pair_slot));
+    broad_phase.num_pairs = 0;
+    for (int tile = 0; tile < NUM_TILES; tile++) {
+        for (int other = NUM_TILES; other < MAX_PROXIES; other++) {
+            if (bounds_overlap(&broad_phase.bounds[tile], &broad_phase.bounds[other])) {
+                broad_phase_add_pair(tile, other);
+            }
+        }
+    }
+    broad_phase.built = true;
+}
 
-int WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR lpCmdLine, int nCmdShow) {
-    return main(__argc, __argv);
+// Refreshes the boxes and re-sorts both axes, updating pairs on each swap
+void broad_phase_update() {
+    broad_phase_bounds();
+    if (!broad_phase.built) {
+        broad_phase_build();
+        return;
+    }
+    for (int axis = 0; axis < 2; axis++) {
+        Endpoint* e = broad_phase.endpoints[axis];
+        for (int i = 0; i < 2 * MAX_PROXIES; i++) {
+            const Bounds* b = &broad_phase.bounds[e[i].proxy];
+            e[i].value = e[i].is_max ? b->max[axis] : b->min[axis];
+        }
+        for (int i = 1; i < 2 * MAX_PROXIES; i++) {
+            Endpoint moving = e[i];
+            int j = i - 1;
+            for (; j >= 0 && e[j].value > moving.value; j--) {
+                const Endpoint* passed = &e[j];
+                if (!moving.is_max && passed->is_max) {
+                    // A min moved below another box's max: they may now overlap
+                    if (bounds_overlap(&broad_phase.bounds[moving.proxy], &broad_phase.bounds[passed->proxy])) {
+                        broad_phase_add_pair(moving.proxy, passed->proxy);
+                    }
+                } else if (moving.is_max && !passed->is_max) {
+                    // A max moved below another box's min: they separate
+                    broad_phase_remove_pair(moving.proxy, passed->proxy);
+                }
+                e[j + 1] = e[j];
+            }
+            e[j + 1] = moving;
+        }
+    }
 }
 
-int main(int argc, char *argv[]) {
-    SDL_Init(SDL_INIT_VIDEO);
-    SDL_Window *window = SDL_CreateWindow("Encoded Physics Cloth Simulation",
-        SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED,
-        SCREEN_WIDTH, SCREEN_HEIGHT, 0);
-    SDL_Renderer *renderer = SDL_CreateRenderer(window, -1,
-        SDL_RENDERER_ACCELERATED);
+// Calls visit(first, last) for each particle row of a tile
+void tile_rows(int tile, void (*visit)(int first, int last)) {
+    int tx = tile % TILES_X, ty = tile / TILES_X;
+    int x0 = tx * TILE_SIZE, x1 = (x0 + TILE_SIZE < GRID_WIDTH) ? x0 + TILE_SIZE : GRID_WIDTH;
+    for (int y = ty * TILE_SIZE; y < (ty + 1) * TILE_SIZE && y < GRID_HEIGHT; y++) {
+        visit(y * GRID_WIDTH + x0, y * GRID_WIDTH + x1);
+    }
+}
 
-    init_particles();
-    init_constraints();
+// Calls visit(first, last) for each particle row of each tile paired with
+// the given proxy
+void broad_phase_visit(int proxy, void (*visit)(int first, int last)) {
+    for (int i = 0; i < broad_phase.num_pairs; i++) {
+        if (broad_phase.pairs[i][1] == proxy) tile_rows(broad_phase.pairs[i][0], visit);
+    }
+}
 
-    bool running = true;
-    SDL_Event event;
-    Uint32 last_time = SDL_GetTicks();
+const Collider* tile_collider; // collider collide_tile_row pushes particles out of
 
-    while (running) {
-        while (SDL_PollEvent(&event)) {
-            if (event.type == SDL_QUIT) {
-                running = false;
-            } else if (event.type == SDL_MOUSEBUTTONDOWN) {
-                mouse_down = true;
-                mouse.x = event.button.x;
-                mouse.y = event.button.y;
-            } else if (event.type == SDL_MOUSEBUTTONUP) {
-                mouse_down = false;
-            } else if (event.type == SDL_MOUSEMOTION) {
-                mouse.x = event.motion.x;
-                mouse.y = event.motion.y;
-            } else if (event.type == SDL_KEYDOWN) {
-                switch (event.key.keysym.sym) {
-                    case SDLK_1: current_material = COTTON; break;
-                    case SDLK_2: current_material = SILK; break;
-                    case SDLK_3: current_material = DENIM; break;
-                }
-            }
+void collide_tile_row(int first, int last) {
+    ParticlesAoS aos = {particles};
+    collide_aos(&aos, first, last, tile_collider, 1);
+}
+
+// Colliders in index order, as collide_aos visits them, so a particle inside
+// two overlapping colliders ends up where the brute-force pass puts it. A
+// particle pushed out of one collider lands inside that collider's box, so a
+// tile is also visited for every later collider overlapping the box of one it
+// was visited for.
+void broad_phase_collide() {
+    Uint8 visited[NUM_TILES] = {0}; // colliders each tile was visited for
+    for (int c = 0; c < num_colliders; c++) {
+        const Bounds* box = &broad_phase.bounds[PROXY_COLLIDER(c)];
+        Uint8 reach = 0; // earlier colliders whose boxes overlap this one
+        for (int e = 0; e < c; e++) {
+            if (bounds_overlap(box, &broad_phase.bounds[PROXY_COLLIDER(e)])) reach |= (Uint8)(1 << e);
+        }
+        tile_collider = &colliders[c];
+        for (int tile = 0; tile < NUM_TILES; tile++) {
+            if (broad_phase.pair_slot[tile][PROXY_COLLIDER(c) - NUM_TILES] < 0 && !(visited[tile] & reach)) continue;
+            visited[tile] |= (Uint8)(1 << c);
+            tile_rows(tile, collide_tile_row);
         }
+    }
+}
 
-        Uint32 current_time = SDL_GetTicks();
-        float dt = (current_time - last_time) / 1000.0f;
-        last_time = current_time;
+// Fixed pool of worker threads. parallel_for splits [0, count) into one
+// contiguous slice per thread; the calling thread runs slice 0 and returns
+// once every slice is done.
+typedef void (*RangeFunction)(int first, int last, void* context);
 
-        // Update physics using encoded laws
-        for (int i = 0; i < GRID_WIDTH * GRID_HEIGHT; i++) {
-            current_material.apply_force(&particles[i], dt);
-        }
+typedef struct {
+    SDL_Thread* threads[MAX_THREADS];
+    int num_threads;
+    SDL_mutex* lock;
+    SDL_cond* work_ready;
+    SDL_cond* work_done;
+    RangeFunction fn;
+    void* context;
+    int count;
+    int generation;
+    int pending;
+    bool quit;
+} ThreadPool;
 
-        handle_mouse_interaction();
+ThreadPool thread_pool = {.num_threads = 1};
 
-        // Solve constraints using material-specific solvers
-        for (int j = 0; j < 5; j++) {
-            for (int i = 0; i < (GRID_WIDTH - 1) * GRID_HEIGHT + GRID_WIDTH * (GRID_HEIGHT - 1); i++) {
-                Constraint* c = &constraints[i];
-                current_material.solve_constraint(c->p1, c->p2, c->rest_length);
-            }
+typedef struct {
+    int index;
+} WorkerArgs;
+
+WorkerArgs worker_args[MAX_THREADS];
+
+void profiler_register_thread();
+
+int thread_pool_worker(void* data) {
+    int index = ((WorkerArgs*)data)->index;
+    int seen = 0;
+    profiler_register_thread();
+    SDL_LockMutex(thread_pool.lock);
+    for (;;) {
+        while (thread_pool.generation == seen && !thread_pool.quit) {
+            SDL_CondWait(thread_pool.work_ready, thread_pool.lock);
         }
+        if (thread_pool.quit) break;
+        seen = thread_pool.generation;
+        RangeFunction fn = thread_pool.fn;
+        void* context = thread_pool.context;
+        int count = thread_pool.count, n = thread_pool.num_threads;
+        SDL_UnlockMutex(thread_pool.lock);
 
-        SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
-        SDL_RenderClear(renderer);
-        render_cloth(renderer);
+        fn(count * index / n, count * (index + 1) / n, context);
+
+        SDL_LockMutex(thread_pool.lock);
+        if (--thread_pool.pending == 0) SDL_CondSignal(thread_pool.work_done);
+    }
+    SDL_UnlockMutex(thread_pool.lock);
+    return 0;
+}
+
+void thread_pool_stop() {
+    if (thread_pool.num_threads <= 1) return;
+    SDL_LockMutex(thread_pool.lock);
+    thread_pool.quit = true;
+    SDL_CondBroadcast(thread_pool.work_ready);
+    SDL_UnlockMutex(thread_pool.lock);
+    for (int i = 1; i < thread_pool.num_threads; i++) {
+        SDL_WaitThread(thread_pool.threads[i], NULL);
+    }
+    SDL_DestroyCond(thread_pool.work_ready);
+    SDL_DestroyCond(thread_pool.work_done);
+    SDL_DestroyMutex(thread_pool.lock);
+    memset(&thread_pool, 0, sizeof(thread_pool));
+    thread_pool.num_threads = 1;
+}
+
+void thread_pool_start(int num_threads) {
+    thread_pool_stop();
+    if (num_threads > MAX_THREADS) num_threads = MAX_THREADS;
+    if (num_threads <= 1) return;
+    thread_pool.lock = SDL_CreateMutex();
+    thread_pool.work_ready = SDL_CreateCond();
+    thread_pool.work_done = SDL_CreateCond();
+    thread_pool.num_threads = num_threads;
+    for (int i = 1; i < num_threads; i++) {
+        worker_args[i].index = i;
+        thread_pool.threads[i] = SDL_CreateThread(thread_pool_worker, "cloth worker", &worker_args[i]);
+    }
+}
+
+void parallel_for(int count, RangeFunction fn, void* context) {
+    int n = thread_pool.num_threads;
+    if (n <= 1) {
+        fn(0, count, context);
+        return;
+    }
+    SDL_LockMutex(thread_pool.lock);
+    thread_pool.fn = fn;
+    thread_pool.context = context;
+    thread_pool.count = count;
+    thread_pool.pending = n - 1;
+    thread_pool.generation++;
+    SDL_CondBroadcast(thread_pool.work_ready);
+    SDL_UnlockMutex(thread_pool.lock);
+
+    fn(0, count / n, context);
+
+    SDL_LockMutex(thread_pool.lock);
+    while (thread_pool.pending > 0) SDL_CondWait(thread_pool.work_done, thread_pool.lock);
+    SDL_UnlockMutex(thread_pool.lock);
+}
+
+void apply_force_range(int first, int last, void* context) {
+    float dt = *(float*)context;
+    for (int i = first; i < last; i++) {
+        current_material.apply_force(&particles[i], dt);
+    }
+}
+
+void solve_constraint_range(int first, int last, void* context) {
+    Constraint* batch = (Constraint*)context;
+    for (int i = first; i < last; i++) {
+        current_material.solve_constraint(batch[i].p1, batch[i].p2, batch[i].rest_length);
+    }
+}
+
+// Force fields. Unlike the per-particle ForceFunction, a field is handed SoA
+// slices covering a whole range of particles and adds its force into the
+// fx/fy accumulators, so it can run several particles per instruction. The
+// summed field force is applied after integration as a Verlet kick,
+// x += f / m * dt^2. SoA slices point straight into the SoA store, AoSoA
+// passes one slice per block, and AoS gathers chunks of FIELD_CHUNK
+// particles on the thread pool.
+//
+// Fields are compiled in (vortex, attractor, explosion) or loaded from a
+// shared library exporting
+//     const ForceFieldPlugin* cloth_force_field_plugin(void);
+// with the two structs below copied verbatim and abi_version set to
+// FORCE_FIELD_ABI. A field is named as "name:params" or "path:params".
+#define FORCE_FIELD_ABI 1
+#define MAX_FORCE_FIELDS 8
+#define FIELD_CHUNK 256
+
+typedef struct {
+    const float* x;
+    const float* y;
+    const float* vx;
+    const float* vy;
+    float* fx;        // accumulators, zeroed before the first field
+    float* fy;
+    int count;
+    float mass;       // per particle
+    float time;       // seconds since the fields were set up
+    float dt;
+} ForceFieldSlice;
+
+typedef struct {
+    int abi_version;
+    const char* name;
+    void* (*create)(const char* params); // NULL rejects the parameters
+    void (*apply)(void* state, const ForceFieldSlice* slice);
+    void (*destroy)(void* state);
+} ForceFieldPlugin;
+
+typedef struct {
+    const ForceFieldPlugin* plugin;
+    void* state;
+    void* library; // dlopen/LoadLibrary handle, NULL when compiled in
+    char spec[256]; // as given, for write_config
+} ForceField;
+
+ForceField force_fields[MAX_FORCE_FIELDS];
+int num_force_fields = 0;
+float field_time = 0;
+
+// Built-in fields share one parameter block: centre, strength and a radius
+// that softens the singularity at the centre (explosion: decay time)
+typedef struct {
+    float cx, cy, strength, radius;
+} FieldParams;
+
+void* field_params_create(const char* params) {
+    FieldParams* f = calloc(1, sizeof(FieldParams));
+    if (!f) return NULL;
+    if (!params || sscanf(params, "%f,%f,%f,%f", &f->cx, &f->cy, &f->strength, &f->radius) != 4 || f->radius <= 0) {
+        free(f);
+        return NULL;
+    }
+    return f;
+}
+
+// Swirl: tangential force strength / (r^2 + radius^2) times the offset
+void vortex_apply(void* state, const ForceFieldSlice* s) {
+    const FieldParams* f = (const FieldParams*)state;
+    const __m128 cx = _mm_set1_ps(f->cx), cy = _mm_set1_ps(f->cy);
+    const __m128 strength = _mm_set1_ps(f->strength), soft = _mm_set1_ps(f->radius * f->radius);
+    int i = 0;
+    for (; i + 4 <= s->count; i += 4) {
+        __m128 dx = _mm_sub_ps(_mm_loadu_ps(&s->x[i]), cx);
+        __m128 dy = _mm_sub_ps(_mm_loadu_ps(&s->y[i]), cy);
+        __m128 scale = _mm_div_ps(strength, _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), soft));
+        _mm_storeu_ps(&s->fx[i], _mm_sub_ps(_mm_loadu_ps(&s->fx[i]), _mm_mul_ps(dy, scale)));
+        _mm_storeu_ps(&s->fy[i], _mm_add_ps(_mm_loadu_ps(&s->fy[i]), _mm_mul_ps(dx, scale)));
+    }
+    for (; i < s->count; i++) {
+        float dx = s->x[i] - f->cx, dy = s->y[i] - f->cy;
+        float scale = f->strength / (dx * dx + dy * dy + f->radius * f->radius);
+        s->fx[i] -= dy * scale;
+        s->fy[i] += dx * scale;
+    }
+}
+
+// Softened inverse-square pull towards the centre (negative strength pushes)
+void attractor_apply(void* state, const ForceFieldSlice* s) {
+    const FieldParams* f = (const FieldParams*)state;
+    const __m128 cx = _mm_set1_ps(f->cx), cy = _mm_set1_ps(f->cy);
+    const __m128 strength = _mm_set1_ps(f->strength), soft = _mm_set1_ps(f->radius * f->radius);
+    const __m128 half = _mm_set1_ps(0.5f), three_halves = _mm_set1_ps(1.5f);
+    int i = 0;
+    for (; i + 4 <= s->count; i += 4) {
+        __m128 dx = _mm_sub_ps(cx, _mm_loadu_ps(&s->x[i]));
+        __m128 dy = _mm_sub_ps(cy, _mm_loadu_ps(&s->y[i]));
+        __m128 d2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), soft);
+        __m128 r = _mm_rsqrt_ps(d2);
+        r = _mm_mul_ps(r, _mm_sub_ps(three_halves, _mm_mul_ps(_mm_mul_ps(_mm_mul_ps(half, d2), r), r)));
+        __m128 scale = _mm_mul_ps(strength, _mm_mul_ps(r, _mm_mul_ps(r, r)));
+        _mm_storeu_ps(&s->fx[i], _mm_add_ps(_mm_loadu_ps(&s->fx[i]), _mm_mul_ps(dx, scale)));
+        _mm_storeu_ps(&s->fy[i], _mm_add_ps(_mm_loadu_ps(&s->fy[i]), _mm_mul_ps(dy, scale)));
+    }
+    for (; i < s->count; i++) {
+        float dx = f->cx - s->x[i], dy = f->cy - s->y[i];
+        float r = rsqrt_refined(dx * dx + dy * dy + f->radius * f->radius, RSQRT_NEWTON1);
+        float scale = f->strength * r * r * r;
+        s->fx[i] += dx * scale;
+        s->fy[i] += dy * scale;
+    }
+}
+
+// Radial blast from the centre, fading as exp(-time / decay)
+void explosion_apply(void* state, const ForceFieldSlice* s) {
+    const FieldParams* f = (const FieldParams*)state;
+    float fade = f->strength * expf(-s->time / f->radius);
+    if (fabsf(fade) < 1e-3f) return;
+    const __m128 cx = _mm_set1_ps(f->cx), cy = _mm_set1_ps(f->cy);
+    const __m128 strength = _mm_set1_ps(fade), soft = _mm_set1_ps(PARTICLE_SPACING * PARTICLE_SPACING);
+    int i = 0;
+    for (; i + 4 <= s->count; i += 4) {
+        __m128 dx = _mm_sub_ps(_mm_loadu_ps(&s->x[i]), cx);
+        __m128 dy = _mm_sub_ps(_mm_loadu_ps(&s->y[i]), cy);
+        __m128 scale = _mm_div_ps(strength, _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), soft));
+        _mm_storeu_ps(&s->fx[i], _mm_add_ps(_mm_loadu_ps(&s->fx[i]), _mm_mul_ps(dx, scale)));
+        _mm_storeu_ps(&s->fy[i], _mm_add_ps(_mm_loadu_ps(&s->fy[i]), _mm_mul_ps(dy, scale)));
+    }
+    for (; i < s->count; i++) {
+        float dx = s->x[i] - f->cx, dy = s->y[i] - f->cy;
+        float scale = fade / (dx * dx + dy * dy + PARTICLE_SPACING * PARTICLE_SPACING);
+        s->fx[i] += dx * scale;
+        s->fy[i] += dy * scale;
+    }
+}
+
+const ForceFieldPlugin BUILTIN_FIELDS[] = {
+    {FORCE_FIELD_ABI, "vortex", field_params_create, vortex_apply, free},
+    {FORCE_FIELD_ABI, "attractor", field_params_create, attractor_apply, free},
+    {FORCE_FIELD_ABI, "explosion", field_params_create, explosion_apply, free},
+};
+
+// Adds a field from "name:params"; name is a built-in or a library path
+bool force_field_add(const char* spec) {
+    if (num_force_fields == MAX_FORCE_FIELDS) {
+        fprintf(stderr, "force field: at most %d fields\n", MAX_FORCE_FIELDS);
+        return false;
+    }
+    char name[256];
+    if (strlen(spec) >= sizeof(force_fields[0].spec)) return false;
+    const char* colon = strrchr(spec, ':');
+#ifdef _WIN32
+    if (colon == spec + 1) colon = NULL; // drive letter, no parameters
+#endif
+    size_t length = colon ? (size_t)(colon - spec) : strlen(spec);
+    if (length >= sizeof(name)) return false;
+    memcpy(name, spec, length);
+    name[length] = '\0';
+    const char* params = colon ? colon + 1 : NULL;
+
+    ForceField field = {NULL, NULL, NULL, ""};
+    strcpy(field.spec, spec);
+    for (int i = 0; i < (int)SDL_arraysize(BUILTIN_FIELDS); i++) {
+        if (strcmp(name, BUILTIN_FIELDS[i].name) == 0) field.plugin = &BUILTIN_FIELDS[i];
+    }
+    if (!field.plugin) {
+        typedef const ForceFieldPlugin* (*PluginEntry)(void);
+        PluginEntry entry = NULL;
+#ifdef _WIN32
+        HMODULE library = LoadLibraryA(name);
+        if (library) entry = (PluginEntry)(void*)GetProcAddress(library, "cloth_force_field_plugin");
+#else
+        void* library = dlopen(name, RTLD_NOW | RTLD_LOCAL);
+        if (library) *(void**)&entry = dlsym(library, "cloth_force_field_plugin");
+#endif
+        field.library = (void*)library;
+        field.plugin = entry ? entry() : NULL;
+        if (!field.plugin || field.plugin->abi_version != FORCE_FIELD_ABI || !field.plugin->apply) {
+            fprintf(stderr, "force field: '%s' is neither built in nor a plugin (ABI %d)\n", name, FORCE_FIELD_ABI);
+            if (library) {
+#ifdef _WIN32
+                FreeLibrary(library);
+#else
+                dlclose(library);
+#endif
+            }
+            return false;
+        }
+    }
+    if (field.plugin->create && !(field.state = field.plugin->create(params))) {
+        fprintf(stderr, "force field: %s rejected parameters '%s'\n", field.plugin->name, params ? params : "");
+        if (field.library) {
+#ifdef _WIN32
+            FreeLibrary((HMODULE)field.library);
+#else
+            dlclose(field.library);
+#endif
+        }
+        return false;
+    }
+    force_fields[num_force_fields++] = field;
+    return true;
+}
+
+// Drops every field past the first keep
+void force_fields_truncate(int keep) {
+    for (int i = keep; i < num_force_fields; i++) {
+        ForceField* field = &force_fields[i];
+        if (field->plugin->destroy) field->plugin->destroy(field->state);
+        if (field->library) {
+#ifdef _WIN32
+            FreeLibrary((HMODULE)field->library);
+#else
+            dlclose(field->library);
+#endif
+        }
+    }
+    if (num_force_fields > keep) num_force_fields = keep;
+    if (keep == 0) field_time = 0;
+}
+
+// Runs every field on one slice, zeroing the accumulators first
+void force_fields_apply_slice(ForceFieldSlice* slice) {
+    memset(slice->fx, 0, sizeof(float) * slice->count);
+    memset(slice->fy, 0, sizeof(float) * slice->count);
+    for (int f = 0; f < num_force_fields; f++) {
+        force_fields[f].plugin->apply(force_fields[f].state, slice);
+    }
+}
+
+// AoS: gather a chunk into SoA scratch, run the fields, kick unlocked particles
+void force_field_range(int first, int last, void* context) {
+    float dt = *(float*)context;
+    float k = dt * dt / current_material.mass;
+    for (int start = first; start < last; start += FIELD_CHUNK) {
+        float x[FIELD_CHUNK], y[FIELD_CHUNK], vx[FIELD_CHUNK], vy[FIELD_CHUNK], fx[FIELD_CHUNK], fy[FIELD_CHUNK];
+        int count = (last - start < FIELD_CHUNK) ? last - start : FIELD_CHUNK;
+        for (int i = 0; i < count; i++) {
+            const Particle* p = &particles[start + i];
+            x[i] = p->x;
+            y[i] = p->y;
+            vx[i] = p->vx;
+            vy[i] = p->vy;
+        }
+        ForceFieldSlice slice = {x, y, vx, vy, fx, fy, count, current_material.mass, field_time, dt};
+        force_fields_apply_slice(&slice);
+        for (int i = 0; i < count; i++) {
+            Particle* p = &particles[start + i];
+            if (p->locked) continue;
+            p->x += fx[i] * k;
+            p->y += fy[i] * k;
+            p->vx += fx[i] * k / dt;
+            p->vy += fy[i] * k / dt;
+        }
+    }
+}
+
+void apply_force_fields(float dt) {
+    static float scratch_x[NUM_PARTICLES], scratch_y[NUM_PARTICLES];
+    float k = dt * dt / current_material.mass;
+    if (particle_layout == LAYOUT_SOA) {
+        ParticlesSoA* s = &particles_soa;
+        ForceFieldSlice slice = {s->x, s->y, s->vx, s->vy, scratch_x, scratch_y, NUM_PARTICLES, current_material.mass, field_time, dt};
+        force_fields_apply_slice(&slice);
+        for (int i = 0; i < NUM_PARTICLES; i++) {
+            if (s->locked[i]) continue;
+            s->x[i] += scratch_x[i] * k;
+            s->y[i] += scratch_y[i] * k;
+            s->vx[i] += scratch_x[i] * k / dt;
+            s->vy[i] += scratch_y[i] * k / dt;
+        }
+    } else if (particle_layout == LAYOUT_AOSOA) {
+        for (int b = 0; b * AOSOA_WIDTH < NUM_PARTICLES; b++) {
+            ParticleBlock* block = &particles_aosoa.blocks[b];
+            int count = (NUM_PARTICLES - b * AOSOA_WIDTH < AOSOA_WIDTH) ? NUM_PARTICLES - b * AOSOA_WIDTH : AOSOA_WIDTH;
+            ForceFieldSlice slice = {block->x, block->y, block->vx, block->vy, scratch_x, scratch_y, count, current_material.mass, field_time, dt};
+            force_fields_apply_slice(&slice);
+            for (int i = 0; i < count; i++) {
+                if (particles_aosoa.locked[b * AOSOA_WIDTH + i]) continue;
+                block->x[i] += scratch_x[i] * k;
+                block->y[i] += scratch_y[i] * k;
+                block->vx[i] += scratch_x[i] * k / dt;
+                block->vy[i] += scratch_y[i] * k / dt;
+            }
+        }
+    } else {
+        parallel_for(NUM_PARTICLES, force_field_range, &dt);
+    }
+    field_time += dt;
+}
+
+// Per-kernel instrumentation for roofline reporting. Bytes are the analytic
+// compulsory traffic of one call for the active layout (every touched cache
+// line read once and, if modified, written once); FLOPs count the arithmetic
+// of the cotton law per particle or constraint.
+typedef enum {
+    KERNEL_APPLY_FORCE,
+    KERNEL_MOUSE,
+    KERNEL_SOLVE_CONSTRAINT,
+    NUM_KERNELS
+} KernelId;
+
+typedef struct {
+    const char* name;
+    Uint64 calls;
+    Uint64 ticks;
+    double bytes;
+    double flops;
+    double dram_bytes;
+    Uint64 start;
+    double dram_start;
+} KernelStats;
+
+#define FLOPS_PER_PARTICLE_FORCE 25.0
+#define FLOPS_PER_PARTICLE_MOUSE 5.0
+#define FLOPS_PER_CONSTRAINT 22.0
+
+bool roofline_enabled = false;
+KernelStats kernel_stats[NUM_KERNELS] = {
+    {.name = "apply_force"},
+    {.name = "mouse"},
+    {.name = "solve_constraint"}
+};
+
+// Uncore memory-controller counters (Linux, needs perf_event_paranoid <= 0)
+#define UNCORE_MAX_COUNTERS 32
+int uncore_fds[UNCORE_MAX_COUNTERS];
+double uncore_scale[UNCORE_MAX_COUNTERS];
+int uncore_count = 0;
+
+#ifdef __linux__
+bool read_sysfs(const char* path, char* out, size_t size) {
+    FILE* f = fopen(path, "r");
+    if (!f) return false;
+    bool ok = fgets(out, (int)size, f) != NULL;
+    fclose(f);
+    if (ok) out[strcspn(out, "\n")] = '\0';
+    return ok;
+}
+
+// Shift of a "config:lo-hi" format field such as uncore_imc_0/format/umask
+int uncore_field_shift(const char* pmu, const char* field) {
+    char path[512], value[64];
+    snprintf(path, sizeof(path), "/sys/bus/event_source/devices/%s/format/%s", pmu, field);
+    if (!read_sysfs(path, value, sizeof(value)) || strncmp(value, "config:", 7) != 0) return -1;
+    return atoi(value + 7);
+}
+
+// Open cas_count_read/write on every uncore_imc PMU; returns counters opened
+int uncore_open() {
+    DIR* dir = opendir("/sys/bus/event_source/devices");
+    if (!dir) return 0;
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL && uncore_count < UNCORE_MAX_COUNTERS - 1) {
+        if (strncmp(entry->d_name, "uncore_imc", 10) != 0) continue;
+        const char* events[] = {"cas_count_read", "cas_count_write"};
+        char path[512], value[128];
+        snprintf(path, sizeof(path), "/sys/bus/event_source/devices/%s/type", entry->d_name);
+        if (!read_sysfs(path, value, sizeof(value))) continue;
+        int type = atoi(value);
+        snprintf(path, sizeof(path), "/sys/bus/event_source/devices/%s/cpumask", entry->d_name);
+        int cpu = read_sysfs(path, value, sizeof(value)) ? atoi(value) : 0;
+
+        for (int e = 0; e < 2; e++) {
+            snprintf(path, sizeof(path), "/sys/bus/event_source/devices/%s/events/%s", entry->d_name, events[e]);
+            if (!read_sysfs(path, value, sizeof(value))) continue;
+            // "event=0x04,umask=0x03" -> config bits via the PMU's format fields
+            unsigned long long config = 0;
+            for (char* term = strtok(value, ","); term; term = strtok(NULL, ",")) {
+                char* eq = strchr(term, '=');
+                if (!eq) continue;
+                *eq = '\0';
+                int shift = uncore_field_shift(entry->d_name, term);
+                if (shift >= 0) config |= strtoull(eq + 1, NULL, 0) << shift;
+            }
+            snprintf(path, sizeof(path), "/sys/bus/event_source/devices/%s/events/%s.scale", entry->d_name, events[e]);
+            double scale = read_sysfs(path, value, sizeof(value)) ? atof(value) : 64.0 / 1048576.0;
+
+            struct perf_event_attr attr;
+            memset(&attr, 0, sizeof(attr));
+            attr.size = sizeof(attr);
+            attr.type = type;
+            attr.config = config;
+            int fd = (int)syscall(SYS_perf_event_open, &attr, -1, cpu, -1, 0);
+            if (fd < 0) continue;
+            uncore_fds[uncore_count] = fd;
+            uncore_scale[uncore_count] = scale * 1048576.0; // scale is in MiB
+            uncore_count++;
+        }
+    }
+    closedir(dir);
+    return uncore_count;
+}
+
+double uncore_read_bytes() {
+    double bytes = 0;
+    for (int i = 0; i < uncore_count; i++) {
+        unsigned long long value;
+        if (read(uncore_fds[i], &value, sizeof(value)) == sizeof(value)) {
+            bytes += value * uncore_scale[i];
+        }
+    }
+    return bytes;
+}
+#else
+int uncore_open() {
+    return 0;
+}
+
+double uncore_read_bytes() {
+    return 0;
+}
+#endif
+
+// Analytic traffic and FLOPs of one call of a kernel on the active layout
+void kernel_traffic(KernelId id, double* bytes, double* flops) {
+    // x, y, old_x, old_y, vx, vy; the layouts keep locked in a byte array
+    double moved = 6 * sizeof(float);
+    double record_read = (particle_layout == LAYOUT_AOS) ? sizeof(Particle) : moved + sizeof(bool);
+    double record_write = (particle_layout == LAYOUT_AOS) ? sizeof(Particle) : moved;
+    // Constraints only need x, y (and locked) of each endpoint once per sweep
+    double position_read = (particle_layout == LAYOUT_AOS) ? sizeof(Particle) : 2 * sizeof(float) + sizeof(bool);
+    double position_write = (particle_layout == LAYOUT_AOS) ? sizeof(Particle) : 2 * sizeof(float);
+    double constraint_size = (particle_layout == LAYOUT_AOS) ? sizeof(Constraint) : sizeof(ConstraintIndex);
+
+    switch (id) {
+        case KERNEL_APPLY_FORCE:
+            *bytes = NUM_PARTICLES * (record_read + record_write);
+            *flops = NUM_PARTICLES * FLOPS_PER_PARTICLE_FORCE;
+            break;
+        case KERNEL_MOUSE:
+            *bytes = NUM_PARTICLES * position_read;
+            *flops = NUM_PARTICLES * FLOPS_PER_PARTICLE_MOUSE;
+            break;
+        default:
+            *bytes = solver.iterations * ((double)num_constraints * constraint_size +
+                NUM_PARTICLES * (position_read + position_write));
+            *flops = solver.iterations * (double)num_constraints * FLOPS_PER_CONSTRAINT;
+            break;
+    }
+}
+
+// Metrics exported in Prometheus text format for node exporters' textfile
+// collector. The step path is the only writer: it bumps plain counters with
+// relaxed atomic stores (no locks, no RMW), and an exporter thread reads them
+// with relaxed loads and rewrites the file every few seconds.
+#define NUM_STEP_BUCKETS 9
+const double STEP_BUCKETS[NUM_STEP_BUCKETS] = {0.0005, 0.001, 0.002, 0.004, 0.008, 0.016, 0.033, 0.066, 0.133};
+
+typedef struct {
+    Uint64 step_buckets[NUM_STEP_BUCKETS + 1]; // last bucket is +Inf
+    Uint64 step_ns_sum;
+    Uint64 steps;
+    Uint64 phase_ns[NUM_KERNELS];
+    Uint64 torn_constraints;
+    Uint64 nan_recoveries;
+    Uint64 sleeping_particles;
+    Uint64 quality_tier;
+    Uint64 constraints;
+} SimMetrics;
+
+SimMetrics sim_metrics;
+bool metrics_enabled = false;
+const char* metrics_path = NULL;
+int metrics_interval_ms = 5000;
+SDL_Thread* metrics_thread = NULL;
+SDL_atomic_t metrics_quit;
+
+void metric_add(Uint64* counter, Uint64 value) {
+    __atomic_store_n(counter, *counter + value, __ATOMIC_RELAXED);
+}
+
+void metric_set(Uint64* gauge, Uint64 value) {
+    __atomic_store_n(gauge, value, __ATOMIC_RELAXED);
+}
+
+Uint64 metric_get(Uint64* counter) {
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+Uint64 ticks_to_ns(Uint64 ticks) {
+    return (Uint64)((double)ticks * 1e9 / SDL_GetPerformanceFrequency());
+}
+
+void metrics_record_step(Uint64 ticks) {
+    if (!metrics_enabled) return;
+    Uint64 ns = ticks_to_ns(ticks);
+    int bucket = 0;
+    while (bucket < NUM_STEP_BUCKETS && ns > STEP_BUCKETS[bucket] * 1e9) bucket++;
+    metric_add(&sim_metrics.step_buckets[bucket], 1);
+    metric_add(&sim_metrics.step_ns_sum, ns);
+    metric_add(&sim_metrics.steps, 1);
+}
+
+bool metrics_write(const char* path) {
+    const char* phases[NUM_KERNELS] = {"apply_force", "mouse", "solve_constraint"};
+    char tmp_path[512];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    FILE* f = fopen(tmp_path, "w");
+    if (!f) return false;
+
+    fprintf(f, "# HELP cloth_step_seconds Wall time of one simulation step.\n");
+    fprintf(f, "# TYPE cloth_step_seconds histogram\n");
+    Uint64 cumulative = 0;
+    for (int i = 0; i < NUM_STEP_BUCKETS; i++) {
+        cumulative += metric_get(&sim_metrics.step_buckets[i]);
+        fprintf(f, "cloth_step_seconds_bucket{le=\"%g\"} %llu\n", STEP_BUCKETS[i], (unsigned long long)cumulative);
+    }
+    cumulative += metric_get(&sim_metrics.step_buckets[NUM_STEP_BUCKETS]);
+    fprintf(f, "cloth_step_seconds_bucket{le=\"+Inf\"} %llu\n", (unsigned long long)cumulative);
+    fprintf(f, "cloth_step_seconds_sum %.9f\n", metric_get(&sim_metrics.step_ns_sum) / 1e9);
+    fprintf(f, "cloth_step_seconds_count %llu\n", (unsigned long long)metric_get(&sim_metrics.steps));
+
+    fprintf(f, "# HELP cloth_phase_seconds_total Time spent per step phase.\n");
+    fprintf(f, "# TYPE cloth_phase_seconds_total counter\n");
+    for (int i = 0; i < NUM_KERNELS; i++) {
+        fprintf(f, "cloth_phase_seconds_total{phase=\"%s\"} %.9f\n", phases[i], metric_get(&sim_metrics.phase_ns[i]) / 1e9);
+    }
+
+    fprintf(f, "# HELP cloth_particles Particles in the simulation.\n");
+    fprintf(f, "# TYPE cloth_particles gauge\n");
+    fprintf(f, "cloth_particles %d\n", NUM_PARTICLES);
+    fprintf(f, "# HELP cloth_constraints Constraints in the simulation.\n");
+    fprintf(f, "# TYPE cloth_constraints gauge\n");
+    fprintf(f, "cloth_constraints %llu\n", (unsigned long long)metric_get(&sim_metrics.constraints));
+    fprintf(f, "# HELP cloth_torn_constraints_total Constraints broken by tearing.\n");
+    fprintf(f, "# TYPE cloth_torn_constraints_total counter\n");
+    fprintf(f, "cloth_torn_constraints_total %llu\n", (unsigned long long)metric_get(&sim_metrics.torn_constraints));
+    fprintf(f, "# HELP cloth_sleeping_fraction Fraction of particles asleep.\n");
+    fprintf(f, "# TYPE cloth_sleeping_fraction gauge\n");
+    fprintf(f, "cloth_sleeping_fraction %.4f\n", (double)metric_get(&sim_metrics.sleeping_particles) / NUM_PARTICLES);
+    fprintf(f, "# HELP cloth_nan_recoveries_total Times non-finite state forced a reset.\n");
+    fprintf(f, "# TYPE cloth_nan_recoveries_total counter\n");
+    fprintf(f, "cloth_nan_recoveries_total %llu\n", (unsigned long long)metric_get(&sim_metrics.nan_recoveries));
+    fprintf(f, "# HELP cloth_quality_tier Quality tier the viewer is running at (0 is full quality).\n");
+    fprintf(f, "# TYPE cloth_quality_tier gauge\n");
+    fprintf(f, "cloth_quality_tier %llu\n", (unsigned long long)metric_get(&sim_metrics.quality_tier));
+    fclose(f);
+
+    // Replace atomically so a scrape never sees a half-written file
+#ifdef _WIN32
+    return MoveFileExA(tmp_path, path, MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+    return rename(tmp_path, path) == 0;
+#endif
+}
+
+int metrics_exporter(void* unused) {
+    while (!SDL_AtomicGet(&metrics_quit)) {
+        for (int waited = 0; waited < metrics_interval_ms && !SDL_AtomicGet(&metrics_quit); waited += 100) {
+            SDL_Delay(100);
+        }
+        if (!metrics_write(metrics_path)) {
+            fprintf(stderr, "metrics: cannot write %s\n", metrics_path);
+        }
+    }
+    return 0;
+}
+
+void metrics_start(const char* path) {
+    metrics_path = path;
+    metrics_enabled = true;
+    metric_set(&sim_metrics.constraints, (Uint64)num_constraints);
+    SDL_AtomicSet(&metrics_quit, 0);
+    metrics_thread = SDL_CreateThread(metrics_exporter, "cloth metrics", NULL);
+}
+
+void metrics_stop() {
+    if (!metrics_thread) return;
+    SDL_AtomicSet(&metrics_quit, 1);
+    SDL_WaitThread(metrics_thread, NULL);
+    metrics_thread = NULL;
+}
+
+// Asynchronous file output for recorders. output_write() copies the data into
+// one of OUTPUT_SLOTS fixed slots and returns; the slots are the bounded
+// in-flight queue, and a caller only waits when every slot is still being
+// written. On Linux the slots are registered io_uring buffers written with
+// IORING_OP_WRITE_FIXED at explicit offsets; elsewhere, or when io_uring is
+// unavailable, a writer thread drains them in order.
+#define OUTPUT_SLOTS 16
+#define OUTPUT_SLOT_BYTES (64 * 1024)
+
+typedef struct {
+    FILE* file;
+    Uint64 offset; // bytes queued so far
+    int pending;   // slots queued or in flight
+    bool failed;
+} OutputStream;
+
+typedef struct {
+    OutputStream* stream;
+    Uint64 offset;  // where the slot goes in the stream's file
+    Uint32 size;
+    Uint32 written; // io_uring: bytes already on file after short writes
+    bool in_flight; // io_uring: submitted and not yet completed
+} OutputSlot;
+
+typedef struct {
+    bool started;
+    bool uring;
+    unsigned char* buffers;      // OUTPUT_SLOTS * OUTPUT_SLOT_BYTES
+    OutputSlot slots[OUTPUT_SLOTS];
+    int free_slots[OUTPUT_SLOTS];
+    int num_free;
+    // Writer thread backend: FIFO of queued slot indices
+    SDL_Thread* thread;
+    SDL_mutex* lock;
+    SDL_cond* changed;
+    int queue[OUTPUT_SLOTS];
+    int queue_head, queue_count;
+    bool quit;
+#ifdef __linux__
+    // io_uring backend
+    int ring_fd;
+    void* sq_ring;
+    void* cq_ring;
+    size_t sq_ring_bytes, cq_ring_bytes;
+    struct io_uring_sqe* sqes;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    struct io_uring_cqe* cqes;
+#endif
+} OutputQueue;
+
+OutputQueue output;
+bool output_force_thread = false; // --output-thread: skip io_uring
+
+void output_complete(int slot, bool ok) {
+    OutputStream* stream = output.slots[slot].stream;
+    if (!ok && !stream->failed) {
+        fprintf(stderr, "output: write failed\n");
+        stream->failed = true;
+    }
+    stream->pending--;
+    output.slots[slot].in_flight = false;
+    output.free_slots[output.num_free++] = slot;
+}
+
+#ifdef __linux__
+// Unmaps whichever of the rings were mapped and closes the ring
+void output_uring_close(int fd) {
+    if (output.sqes != MAP_FAILED) munmap(output.sqes, OUTPUT_SLOTS * sizeof(struct io_uring_sqe));
+    if (output.cq_ring != MAP_FAILED && output.cq_ring != output.sq_ring) munmap(output.cq_ring, output.cq_ring_bytes);
+    if (output.sq_ring != MAP_FAILED) munmap(output.sq_ring, output.sq_ring_bytes);
+    close(fd);
+}
+
+bool output_uring_open() {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int fd = (int)syscall(__NR_io_uring_setup, OUTPUT_SLOTS, &params);
+    if (fd < 0) return false;
+    if (params.sq_entries != OUTPUT_SLOTS) {
+        close(fd);
+        return false;
+    }
+
+    output.sq_ring_bytes = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    output.cq_ring_bytes = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    bool single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single_mmap && output.cq_ring_bytes > output.sq_ring_bytes) output.sq_ring_bytes = output.cq_ring_bytes;
+    output.sq_ring = mmap(NULL, output.sq_ring_bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    output.cq_ring = single_mmap ? output.sq_ring :
+        mmap(NULL, output.cq_ring_bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    output.sqes = mmap(NULL, OUTPUT_SLOTS * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (output.sq_ring == MAP_FAILED || output.cq_ring == MAP_FAILED || output.sqes == MAP_FAILED) {
+        output_uring_close(fd);
+        return false;
+    }
+    unsigned char* sq = output.sq_ring;
+    unsigned char* cq = output.cq_ring;
+    output.sq_tail = (unsigned*)(sq + params.sq_off.tail);
+    output.sq_mask = (unsigned*)(sq + params.sq_off.ring_mask);
+    output.sq_array = (unsigned*)(sq + params.sq_off.array);
+    output.cq_head = (unsigned*)(cq + params.cq_off.head);
+    output.cq_tail = (unsigned*)(cq + params.cq_off.tail);
+    output.cq_mask = (unsigned*)(cq + params.cq_off.ring_mask);
+    output.cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+
+    // Register the slots once so each write skips pinning and mapping pages
+    struct iovec buffers[OUTPUT_SLOTS];
+    for (int i = 0; i < OUTPUT_SLOTS; i++) {
+        buffers[i].iov_base = output.buffers + (size_t)i * OUTPUT_SLOT_BYTES;
+        buffers[i].iov_len = OUTPUT_SLOT_BYTES;
+    }
+    if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_BUFFERS, buffers, OUTPUT_SLOTS) < 0) {
+        output_uring_close(fd);
+        return false;
+    }
+    output.ring_fd = fd;
+    return true;
+}
+
+void output_uring_submit(int slot);
+
+// Collects finished writes; with wait, blocks until at least one finishes.
+// A short write is queued again for its remaining bytes.
+void output_uring_reap(bool wait) {
+    while (wait && syscall(__NR_io_uring_enter, output.ring_fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0) {
+        if (errno == EINTR) continue;
+        // The ring is unusable: nothing in flight will ever be reported
+        fprintf(stderr, "output: io_uring wait failed: %s\n", strerror(errno));
+        for (int slot = 0; slot < OUTPUT_SLOTS; slot++) {
+            if (output.slots[slot].in_flight) output_complete(slot, false);
+        }
+        return;
+    }
+    // The head is published before each completion is handled, since a
+    // resubmission may reap again from inside this loop
+    for (;;) {
+        unsigned head = *output.cq_head;
+        if (head == __atomic_load_n(output.cq_tail, __ATOMIC_ACQUIRE)) break;
+        struct io_uring_cqe* cqe = &output.cqes[head & *output.cq_mask];
+        int slot = (int)cqe->user_data, res = cqe->res;
+        __atomic_store_n(output.cq_head, head + 1, __ATOMIC_RELEASE);
+
+        OutputSlot* s = &output.slots[slot];
+        if (res >= 0) s->written += (Uint32)res;
+        if (res >= 0 && s->written == s->size) {
+            output_complete(slot, true);
+        } else if ((res >= 0 && s->written < s->size) || res == -EINTR || res == -EAGAIN) {
+            output_uring_submit(slot);
+        } else {
+            output_complete(slot, false);
+        }
+    }
+}
+
+// Queues the slot's unwritten bytes at their offset in the file
+void output_uring_submit(int slot) {
+    OutputSlot* s = &output.slots[slot];
+    unsigned tail = *output.sq_tail;
+    unsigned index = tail & *output.sq_mask;
+    struct io_uring_sqe* sqe = &output.sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_WRITE_FIXED;
+    sqe->flags = IOSQE_ASYNC; // buffered writes would otherwise copy inline, on this thread
+    sqe->fd = fileno(s->stream->file);
+    sqe->addr = (Uint64)(uintptr_t)(output.buffers + (size_t)slot * OUTPUT_SLOT_BYTES + s->written);
+    sqe->len = s->size - s->written;
+    sqe->off = s->offset + s->written;
+    sqe->buf_index = (Uint16)slot;
+    sqe->user_data = (Uint64)slot;
+    output.sq_array[index] = index;
+    __atomic_store_n(output.sq_tail, tail + 1, __ATOMIC_RELEASE);
+    s->in_flight = true;
+    for (;;) {
+        long submitted = syscall(__NR_io_uring_enter, output.ring_fd, 1, 0, 0, NULL, 0);
+        if (submitted == 1) return;
+        if (submitted >= 0 || (errno != EINTR && errno != EAGAIN && errno != EBUSY)) break;
+        if (errno == EINTR) continue;
+        // Out of kernel resources or completion space: make room and retry
+        bool others_in_flight = false;
+        for (int i = 0; i < OUTPUT_SLOTS; i++) others_in_flight |= i != slot && output.slots[i].in_flight;
+        if (others_in_flight) output_uring_reap(true);
+        else SDL_Delay(1);
+    }
+    __atomic_store_n(output.sq_tail, tail, __ATOMIC_RELEASE);
+    output_complete(slot, false);
+}
+#endif
+
+int output_writer(void* unused) {
+    SDL_LockMutex(output.lock);
+    while (!output.quit || output.queue_count > 0) {
+        if (output.queue_count == 0) {
+            SDL_CondWait(output.changed, output.lock);
+            continue;
+        }
+        int slot = output.queue[output.queue_head];
+        SDL_UnlockMutex(output.lock);
+
+        OutputSlot* s = &output.slots[slot];
+        bool ok = fwrite(output.buffers + (size_t)slot * OUTPUT_SLOT_BYTES, 1, s->size, s->stream->file) == s->size;
+
+        SDL_LockMutex(output.lock);
+        output.queue_head = (output.queue_head + 1) % OUTPUT_SLOTS;
+        output.queue_count--;
+        output_complete(slot, ok);
+        SDL_CondBroadcast(output.changed);
+    }
+    SDL_UnlockMutex(output.lock);
+    return 0;
+}
+
+bool output_start() {
+    if (output.started) return true;
+    output.buffers = _mm_malloc((size_t)OUTPUT_SLOTS * OUTPUT_SLOT_BYTES, 4096);
+    if (!output.buffers) return false;
+    for (int i = 0; i < OUTPUT_SLOTS; i++) output.free_slots[i] = i;
+    output.num_free = OUTPUT_SLOTS;
+#ifdef __linux__
+    output.uring = !output_force_thread && output_uring_open();
+#endif
+    if (!output.uring) {
+        output.lock = SDL_CreateMutex();
+        output.changed = SDL_CreateCond();
+        output.quit = false;
+        output.thread = SDL_CreateThread(output_writer, "cloth output", NULL);
+    }
+    output.started = true;
+    return true;
+}
+
+// Blocks until a slot is free and returns it
+int output_acquire() {
+#ifdef __linux__
+    if (output.uring) {
+        output_uring_reap(false);
+        while (output.num_free == 0) output_uring_reap(true);
+        return output.free_slots[--output.num_free];
+    }
+#endif
+    SDL_LockMutex(output.lock);
+    while (output.num_free == 0) SDL_CondWait(output.changed, output.lock);
+    int slot = output.free_slots[--output.num_free];
+    SDL_UnlockMutex(output.lock);
+    return slot;
+}
+
+void output_submit(OutputStream* stream, int slot, Uint32 size) {
+    output.slots[slot].stream = stream;
+    output.slots[slot].offset = stream->offset;
+    output.slots[slot].size = size;
+    output.slots[slot].written = 0;
+#ifdef __linux__
+    if (output.uring) {
+        stream->pending++;
+        output_uring_submit(slot);
+        stream->offset += size;
+        return;
+    }
+#endif
+    SDL_LockMutex(output.lock);
+    stream->pending++;
+    output.queue[(output.queue_head + output.queue_count) % OUTPUT_SLOTS] = slot;
+    output.queue_count++;
+    SDL_CondBroadcast(output.changed);
+    SDL_UnlockMutex(output.lock);
+    stream->offset += size;
+}
+
+OutputStream* output_open(const char* path) {
+    if (!output_start()) return NULL;
+    OutputStream* stream = calloc(1, sizeof(OutputStream));
+    if (!stream) return NULL;
+    stream->file = fopen(path, "wb");
+    if (!stream->file) {
+        fprintf(stderr, "output: cannot open %s\n", path);
+        free(stream);
+        return NULL;
+    }
+    return stream;
+}
+
+// Queues size bytes for writing; returns as soon as they are copied
+void output_write(OutputStream* stream, const void* data, size_t size) {
+    const unsigned char* bytes = (const unsigned char*)data;
+    while (size > 0 && !stream->failed) {
+        Uint32 chunk = size < OUTPUT_SLOT_BYTES ? (Uint32)size : OUTPUT_SLOT_BYTES;
+        int slot = output_acquire();
+        memcpy(output.buffers + (size_t)slot * OUTPUT_SLOT_BYTES, bytes, chunk);
+        output_submit(stream, slot, chunk);
+        bytes += chunk;
+        size -= chunk;
+    }
+}
+
+// Waits for the stream's queued writes, then closes it; false if any failed
+bool output_close(OutputStream* stream) {
+    if (!stream) return true;
+#ifdef __linux__
+    if (output.uring) {
+        while (stream->pending > 0) output_uring_reap(true);
+    }
+#endif
+    if (!output.uring) {
+        SDL_LockMutex(output.lock);
+        while (stream->pending > 0) SDL_CondWait(output.changed, output.lock);
+        SDL_UnlockMutex(output.lock);
+    }
+    bool ok = !stream->failed && fclose(stream->file) == 0;
+    if (stream->failed) fclose(stream->file);
+    free(stream);
+    return ok;
+}
+
+void output_stop() {
+    if (!output.started) return;
+#ifdef __linux__
+    if (output.uring) {
+        while (output.num_free < OUTPUT_SLOTS) output_uring_reap(true);
+        output_uring_close(output.ring_fd);
+    }
+#endif
+    if (!output.uring) {
+        SDL_LockMutex(output.lock);
+        output.quit = true;
+        SDL_CondBroadcast(output.changed);
+        SDL_UnlockMutex(output.lock);
+        SDL_WaitThread(output.thread, NULL);
+        SDL_DestroyCond(output.changed);
+        SDL_DestroyMutex(output.lock);
+    }
+    _mm_free(output.buffers);
+    memset(&output, 0, sizeof(output));
+}
+
+// Trajectory recorder: a header, then every simulated frame's positions
+typedef struct {
+    char magic[8];   // "CLTHTRAJ"
+    Uint32 version;
+    Uint32 particles;
+    Uint32 grid_width, grid_height;
+} TrajectoryHeader;
+
+typedef struct {
+    Uint32 frame;
+    float dt;
+    float positions[2 * NUM_PARTICLES];
+} TrajectoryFrame;
+
+OutputStream* trajectory = NULL;
+Uint32 trajectory_frames = 0;
+
+bool trajectory_start(const char* path) {
+    trajectory = output_open(path);
+    if (!trajectory) return false;
+    TrajectoryHeader header = {{'C', 'L', 'T', 'H', 'T', 'R', 'A', 'J'}, 1, NUM_PARTICLES, GRID_WIDTH, GRID_HEIGHT};
+    output_write(trajectory, &header, sizeof(header));
+    return true;
+}
+
+void trajectory_record(float dt) {
+    static TrajectoryFrame frame;
+    if (!trajectory) return;
+    frame.frame = trajectory_frames++;
+    frame.dt = dt;
+    for (int i = 0; i < NUM_PARTICLES; i++) {
+        frame.positions[2 * i] = particles[i].x;
+        frame.positions[2 * i + 1] = particles[i].y;
+    }
+    output_write(trajectory, &frame, sizeof(frame));
+}
+
+void trajectory_stop() {
+    if (trajectory && !output_close(trajectory)) fprintf(stderr, "output: trajectory incomplete\n");
+    trajectory = NULL;
+}
+
+void kernel_begin(KernelId id) {
+    if (!roofline_enabled && !metrics_enabled) return;
+    if (uncore_count) kernel_stats[id].dram_start = uncore_read_bytes();
+    kernel_stats[id].start = SDL_GetPerformanceCounter();
+}
+
+void kernel_end(KernelId id) {
+    if (!roofline_enabled && !metrics_enabled) return;
+    KernelStats* k = &kernel_stats[id];
+    Uint64 ticks = SDL_GetPerformanceCounter() - k->start;
+    if (metrics_enabled) metric_add(&sim_metrics.phase_ns[id], ticks_to_ns(ticks));
+    if (!roofline_enabled) return;
+    k->ticks += ticks;
+    if (uncore_count) k->dram_bytes += uncore_read_bytes() - k->dram_start;
+    double bytes, flops;
+    kernel_traffic(id, &bytes, &flops);
+    k->bytes += bytes;
+    k->flops += flops;
+    k->calls++;
+}
+
+// Static equilibrium of the pinned cloth over its colliders. Minimises the
+// energy of calc_energy_cotton's model (gravity plus 0.5 * k * (length -
+// rest)^2 per constraint; screen y grows downwards, so the gravity term is
+// -m g y) plus a stiff penalty inside each collider, using damped Newton
+// steps with a Jacobi-preconditioned conjugate gradient inner solve and a
+// backtracking line search. The flat grid has no shear stiffness, so the
+// Hessian starts out singular; a Levenberg-Marquardt damping term keeps the
+// steps short until the cloth is under tension. The material's nominal
+// stiffness is far too soft for what the constraint projection does, so k is
+// the stiffness the projection behaves like at h = 1/(60 * substeps): mass *
+// iterations * c / (h^2 * (2 - c)) with c = elasticity * relaxation, which
+// matches the settled dynamics across iterations, substeps and materials.
+// The minimum is then the state the dynamics settle to.
+#define STATIC_NEWTON_ITERATIONS 100
+#define STATIC_CG_ITERATIONS 300
+#define STATIC_COLLIDER_SCALE 10.0
+
+// Spring constant the constraint projection behaves like (see above)
+double projection_stiffness() {
+    double h = 1.0 / (60.0 * solver.substeps);
+    double c = current_material.elasticity * solver.relaxation;
+    return current_material.mass * solver.iterations * c / (h * h * (2 - c));
+}
+
+typedef struct {
+    double k, collider_k;
+    double rest_scale; // rest length the material's constraint law pulls to
+    double damping;    // Levenberg-Marquardt term added to the Hessian diagonal
+    double* pos;       // x, y per particle
+    double* grad;
+    double* blocks;    // xx, xy, yy of each constraint's Hessian block
+    double* diag;      // xx, xy, yy of each particle's own (collider) block
+} StaticProblem;
+
+int particle_index(const Particle* p) {
+    return (int)(p - particles);
+}
+
+double static_energy(const StaticProblem* sp, const double* pos) {
+    const double GRAVITY = 980.0;
+    double energy = 0;
+    for (int i = 0; i < NUM_PARTICLES; i++) {
+        if (particles[i].locked) continue;
+        energy -= particles[i].mass * GRAVITY * pos[2 * i + 1];
+        for (int c = 0; c < num_colliders; c++) {
+            double dx = pos[2 * i] - colliders[c].x, dy = pos[2 * i + 1] - colliders[c].y;
+            double depth = colliders[c].radius - sqrt(dx * dx + dy * dy);
+            if (depth > 0) energy += 0.5 * sp->collider_k * depth * depth;
+        }
+    }
+    for (int e = 0; e < num_constraints; e++) {
+        int a = particle_index(constraints[e].p1), b = particle_index(constraints[e].p2);
+        double dx = pos[2 * b] - pos[2 * a], dy = pos[2 * b + 1] - pos[2 * a + 1];
+        double stretch = sqrt(dx * dx + dy * dy) - sp->rest_scale * constraints[e].rest_length;
+        energy += 0.5 * sp->k * stretch * stretch;
+    }
+    return energy;
+}
+
+// Gradient and Hessian blocks at sp->pos. Compressed constraints drop the
+// negative transverse term so every block stays positive semi-definite.
+// Returns the largest force on a free particle.
+double static_linearize(StaticProblem* sp) {
+    const double GRAVITY = 980.0;
+    const double* pos = sp->pos;
+    memset(sp->grad, 0, sizeof(double) * 2 * NUM_PARTICLES);
+    memset(sp->diag, 0, sizeof(double) * 3 * NUM_PARTICLES);
+    for (int i = 0; i < NUM_PARTICLES; i++) {
+        if (particles[i].locked) continue;
+        sp->grad[2 * i + 1] -= particles[i].mass * GRAVITY;
+        for (int c = 0; c < num_colliders; c++) {
+            double dx = pos[2 * i] - colliders[c].x, dy = pos[2 * i + 1] - colliders[c].y;
+            double dist = sqrt(dx * dx + dy * dy);
+            double depth = colliders[c].radius - dist;
+            if (depth <= 0 || dist <= 0) continue;
+            double nx = dx / dist, ny = dy / dist;
+            sp->grad[2 * i] -= sp->collider_k * depth * nx;
+            sp->grad[2 * i + 1] -= sp->collider_k * depth * ny;
+            sp->diag[3 * i] += sp->collider_k * nx * nx;
+            sp->diag[3 * i + 1] += sp->collider_k * nx * ny;
+            sp->diag[3 * i + 2] += sp->collider_k * ny * ny;
+        }
+    }
+    for (int e = 0; e < num_constraints; e++) {
+        int a = particle_index(constraints[e].p1), b = particle_index(constraints[e].p2);
+        double dx = pos[2 * b] - pos[2 * a], dy = pos[2 * b + 1] - pos[2 * a + 1];
+        double length = sqrt(dx * dx + dy * dy);
+        double* block = &sp->blocks[3 * e];
+        if (length <= 0) {
+            block[0] = block[1] = block[2] = 0;
+            continue;
+        }
+        double rest = sp->rest_scale * constraints[e].rest_length;
+        double nx = dx / length, ny = dy / length;
+        double force = sp->k * (length - rest);
+        sp->grad[2 * a] -= force * nx;
+        sp->grad[2 * a + 1] -= force * ny;
+        sp->grad[2 * b] += force * nx;
+        sp->grad[2 * b + 1] += force * ny;
+        double transverse = fmax(0.0, 1.0 - rest / length);
+        block[0] = sp->k * (nx * nx + transverse * (1 - nx * nx));
+        block[1] = sp->k * (nx * ny - transverse * nx * ny);
+        block[2] = sp->k * (ny * ny + transverse * (1 - ny * ny));
+    }
+    double max_force = 0;
+    for (int i = 0; i < NUM_PARTICLES; i++) {
+        if (particles[i].locked) {
+            sp->grad[2 * i] = sp->grad[2 * i + 1] = 0;
+            continue;
+        }
+        max_force = fmax(max_force, fmax(fabs(sp->grad[2 * i]), fabs(sp->grad[2 * i + 1])));
+    }
+    return max_force;
+}
+
+// out = (H + damping) * v, with locked particles held fixed
+void static_hessian_apply(const StaticProblem* sp, const double* v, double* out) {
+    for (int i = 0; i < NUM_PARTICLES; i++) {
+        const double* d = &sp->diag[3 * i];
+        out[2 * i] = (d[0] + sp->damping) * v[2 * i] + d[1] * v[2 * i + 1];
+        out[2 * i + 1] = d[1] * v[2 * i] + (d[2] + sp->damping) * v[2 * i + 1];
+    }
+    for (int e = 0; e < num_constraints; e++) {
+        int a = particle_index(constraints[e].p1), b = particle_index(constraints[e].p2);
+        const double* block = &sp->blocks[3 * e];
+        double rx = v[2 * a] - v[2 * b], ry = v[2 * a + 1] - v[2 * b + 1];
+        double fx = block[0] * rx + block[1] * ry, fy = block[1] * rx + block[2] * ry;
+        out[2 * a] += fx;
+        out[2 * a + 1] += fy;
+        out[2 * b] -= fx;
+        out[2 * b + 1] -= fy;
+    }
+    for (int i = 0; i < NUM_PARTICLES; i++) {
+        if (particles[i].locked) out[2 * i] = out[2 * i + 1] = 0;
+    }
+}
+
+// Moves particles[] to the static equilibrium at rest; false if it did not
+// converge, in which case particles[] is left unchanged
+bool settle_static() {
+    const int n = 2 * NUM_PARTICLES;
+    StaticProblem sp;
+    sp.k = projection_stiffness();
+    sp.collider_k = STATIC_COLLIDER_SCALE * sp.k;
+    sp.damping = sp.k;
+    sp.rest_scale = material_rest_scale(&current_material);
+    double* scratch = malloc(sizeof(double) * (7 * n + 3 * NUM_PARTICLES + 3 * NUM_CONSTRAINTS));
+    if (!scratch) return false;
+    sp.pos = scratch;
+    sp.grad = sp.pos + n;
+    double* step = sp.grad + n;
+    double* residual = step + n;
+    double* direction = residual + n;
+    double* product = direction + n;
+    double* trial = product + n;
+    sp.diag = trial + n;
+    sp.blocks = sp.diag + 3 * NUM_PARTICLES;
+
+    for (int i = 0; i < NUM_PARTICLES; i++) {
+        sp.pos[2 * i] = particles[i].x;
+        sp.pos[2 * i + 1] = particles[i].y;
+    }
+    double tolerance = 1e-3 * current_material.mass * 980.0;
+    double energy = static_energy(&sp, sp.pos);
+    bool converged = false;
+    for (int newton = 0; newton < STATIC_NEWTON_ITERATIONS; newton++) {
+        if (static_linearize(&sp) < tolerance) {
+            converged = true;
+            break;
+        }
+
+        // Solve H * step = -grad by preconditioned CG; the preconditioner is
+        // the inverse of each degree of freedom's diagonal Hessian entry
+        double* precond = trial;
+        for (int i = 0; i < n; i++) precond[i] = sp.diag[3 * (i / 2) + (i % 2) * 2] + sp.damping;
+        for (int e = 0; e < num_constraints; e++) {
+            int a = particle_index(constraints[e].p1), b = particle_index(constraints[e].p2);
+            precond[2 * a] += sp.blocks[3 * e];
+            precond[2 * a + 1] += sp.blocks[3 * e + 2];
+            precond[2 * b] += sp.blocks[3 * e];
+            precond[2 * b + 1] += sp.blocks[3 * e + 2];
+        }
+        double rz = 0, rr0 = 0;
+        for (int i = 0; i < n; i++) {
+            precond[i] = 1.0 / precond[i];
+            step[i] = 0;
+            residual[i] = -sp.grad[i];
+            direction[i] = residual[i] * precond[i];
+            rz += residual[i] * direction[i];
+            rr0 += residual[i] * residual[i];
+        }
+        for (int cg = 0; cg < STATIC_CG_ITERATIONS; cg++) {
+            static_hessian_apply(&sp, direction, product);
+            double curvature = 0;
+            for (int i = 0; i < n; i++) curvature += direction[i] * product[i];
+            if (curvature <= 0) break;
+            double alpha = rz / curvature, rr = 0, rz_next = 0;
+            for (int i = 0; i < n; i++) {
+                step[i] += alpha * direction[i];
+                residual[i] -= alpha * product[i];
+                rr += residual[i] * residual[i];
+                rz_next += residual[i] * residual[i] * precond[i];
+            }
+            if (rr < 1e-8 * rr0) break;
+            for (int i = 0; i < n; i++) direction[i] = residual[i] * precond[i] + (rz_next / rz) * direction[i];
+            rz = rz_next;
+        }
+
+        // Backtrack until the energy drops enough
+        double slope = 0;
+        for (int i = 0; i < n; i++) slope += sp.grad[i] * step[i];
+        if (slope >= 0) break;
+        double t = 1.0, next_energy = energy;
+        for (int tries = 0; tries < 30; tries++, t *= 0.5) {
+            for (int i = 0; i < n; i++) trial[i] = sp.pos[i] + t * step[i];
+            next_energy = static_energy(&sp, trial);
+            if (next_energy <= energy + 1e-4 * t * slope) break;
+        }
+        if (next_energy > energy) break;
+        memcpy(sp.pos, trial, sizeof(double) * n);
+        energy = next_energy;
+        sp.damping = (t == 1.0) ? fmax(sp.damping * 0.25, 1e-9 * sp.k) : sp.damping * 4;
+    }
+    if (!converged) converged = static_linearize(&sp) < tolerance;
+
+    if (converged) {
+        for (int i = 0; i < NUM_PARTICLES; i++) {
+            Particle* p = &particles[i];
+            p->x = p->old_x = (float)sp.pos[2 * i];
+            p->y = p->old_y = (float)sp.pos[2 * i + 1];
+            p->vx = p->vy = 0;
+        }
+    }
+    free(scratch);
+    return converged;
+}
+
+// Settled-state cache. A settled cloth is a pure function of the scene, so
+// its positions are stored under a hash of everything the static solve reads:
+// grid and screen size, the material (its fields and which constraint law),
+// solver settings, layout, pins and colliders. Files are written once and
+// mapped read-only on later runs.
+#define SETTLE_CACHE_VERSION 1
+
+typedef struct {
+    char magic[8];   // "CLTHSETL"
+    Uint32 version;
+    Uint32 count;    // particles
+    Uint64 key;
+} SettleCacheHeader;
+
+const char* settle_cache_dir = NULL;
+
+// FNV-1a over raw bytes
+Uint64 hash_bytes(Uint64 hash, const void* data, size_t size) {
+    const unsigned char* bytes = (const unsigned char*)data;
+    for (size_t i = 0; i < size; i++) {
+        hash = (hash ^ bytes[i]) * 1099511628211ull;
+    }
+    return hash;
+}
+
+#define HASH_VALUE(hash, value) hash_bytes(hash, &(value), sizeof(value))
+
+Uint64 settle_cache_key() {
+    const int dims[] = {SETTLE_CACHE_VERSION, GRID_WIDTH, GRID_HEIGHT, PARTICLE_SPACING, SCREEN_WIDTH, SCREEN_HEIGHT};
+    const Material* m = &current_material;
+    int law = (m->solve_constraint == solve_constraint_denim) ? 2 : (m->solve_constraint == solve_constraint_silk) ? 1 : 0;
+    Uint64 hash = 14695981039346656037ull;
+    hash = hash_bytes(hash, dims, sizeof(dims));
+    hash = HASH_VALUE(hash, m->elasticity);
+    hash = HASH_VALUE(hash, m->mass);
+    hash = HASH_VALUE(hash, m->stiffness);
+    hash = HASH_VALUE(hash, m->damping);
+    hash = HASH_VALUE(hash, m->tear_distance);
+    hash = HASH_VALUE(hash, m->air_friction);
+    hash = HASH_VALUE(hash, m->bend_stiffness);
+    hash = HASH_VALUE(hash, law);
+    hash = HASH_VALUE(hash, solver.iterations);
+    hash = HASH_VALUE(hash, solver.substeps);
+    hash = HASH_VALUE(hash, solver.relaxation);
+    hash = HASH_VALUE(hash, particle_layout);
+    hash = HASH_VALUE(hash, pin_mode);
+    hash = HASH_VALUE(hash, num_colliders);
+    for (int i = 0; i < num_colliders; i++) {
+        hash = HASH_VALUE(hash, colliders[i].x);
+        hash = HASH_VALUE(hash, colliders[i].y);
+        hash = HASH_VALUE(hash, colliders[i].radius);
+    }
+    return hash;
+}
+
+void settle_cache_path(char* path, size_t size, Uint64 key) {
+    snprintf(path, size, "%s/%016llx.settled", settle_cache_dir, (unsigned long long)key);
+}
+
+// Maps a whole file read-only; *size receives its length
+const void* map_file(const char* path, size_t* size, void** handle) {
+#ifdef _WIN32
+    HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE) return NULL;
+    LARGE_INTEGER length;
+    HANDLE mapping = NULL;
+    if (GetFileSizeEx(file, &length) && length.QuadPart > 0) {
+        mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    }
+    CloseHandle(file);
+    if (!mapping) return NULL;
+    const void* data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    if (!data) {
+        CloseHandle(mapping);
+        return NULL;
+    }
+    *size = (size_t)length.QuadPart;
+    *handle = mapping;
+    return data;
+#elif defined(__linux__)
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return NULL;
+    struct stat st;
+    void* data = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (data == MAP_FAILED) return NULL;
+    *size = (size_t)st.st_size;
+    *handle = NULL;
+    return data;
+#else
+    // No mapping API: read the file into memory instead
+    FILE* f = fopen(path, "rb");
+    if (!f) return NULL;
+    void* data = NULL;
+    long length = (fseek(f, 0, SEEK_END) == 0) ? ftell(f) : -1;
+    if (length > 0 && fseek(f, 0, SEEK_SET) == 0 && (data = malloc((size_t)length)) != NULL &&
+        fread(data, 1, (size_t)length, f) != (size_t)length) {
+        free(data);
+        data = NULL;
+    }
+    fclose(f);
+    *size = (size_t)length;
+    *handle = data;
+    return data;
+#endif
+}
+
+void unmap_file(const void* data, size_t size, void* handle) {
+#ifdef _WIN32
+    UnmapViewOfFile(data);
+    CloseHandle((HANDLE)handle);
+#elif defined(__linux__)
+    munmap((void*)data, size);
+#else
+    free(handle);
+#endif
+}
+
+// Loads the cached settled state for the current scene into particles[]
+bool settle_cache_load(Uint64 key) {
+    char path[512];
+    settle_cache_path(path, sizeof(path), key);
+    size_t size = 0;
+    void* handle = NULL;
+    const unsigned char* data = map_file(path, &size, &handle);
+    if (!data) return false;
+
+    const SettleCacheHeader* header = (const SettleCacheHeader*)data;
+    bool valid = size == sizeof(SettleCacheHeader) + sizeof(float) * 2 * NUM_PARTICLES &&
+        memcmp(header->magic, "CLTHSETL", 8) == 0 && header->version == SETTLE_CACHE_VERSION &&
+        header->count == NUM_PARTICLES && header->key == key;
+    if (valid) {
+        const float* positions = (const float*)(data + sizeof(SettleCacheHeader));
+        for (int i = 0; i < NUM_PARTICLES; i++) {
+            valid = valid && isfinite(positions[2 * i]) && isfinite(positions[2 * i + 1]);
+        }
+        for (int i = 0; valid && i < NUM_PARTICLES; i++) {
+            Particle* p = &particles[i];
+            p->x = p->old_x = positions[2 * i];
+            p->y = p->old_y = positions[2 * i + 1];
+            p->vx = p->vy = 0;
+        }
+    }
+    unmap_file(data, size, handle);
+    if (!valid) fprintf(stderr, "settle cache: ignoring stale or damaged %s\n", path);
+    return valid;
+}
+
+// Stores particles[] as the settled state for the current scene
+bool settle_cache_store(Uint64 key) {
+    char path[512], tmp_path[530];
+    settle_cache_path(path, sizeof(path), key);
+#ifdef _WIN32
+    unsigned long pid = GetCurrentProcessId();
+#else
+    unsigned long pid = (unsigned long)getpid();
+#endif
+    snprintf(tmp_path, sizeof(tmp_path), "%s.%lu.tmp", path, pid);
+    FILE* f = fopen(tmp_path, "wb");
+    if (!f) return false;
+    SettleCacheHeader header = {{'C', 'L', 'T', 'H', 'S', 'E', 'T', 'L'}, SETTLE_CACHE_VERSION, NUM_PARTICLES, key};
+    bool ok = fwrite(&header, sizeof(header), 1, f) == 1;
+    for (int i = 0; ok && i < NUM_PARTICLES; i++) {
+        float position[2] = {particles[i].x, particles[i].y};
+        ok = fwrite(position, sizeof(position), 1, f) == 1;
+    }
+    ok = (fclose(f) == 0) && ok;
+
+    // Publish atomically so a concurrent run never maps a partial file
+#ifdef _WIN32
+    ok = ok && MoveFileExA(tmp_path, path, MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+    ok = ok && rename(tmp_path, path) == 0;
+#endif
+    if (!ok) remove(tmp_path);
+    return ok;
+}
+
+// Runs start from the settled state unless --no-settle, taken from the
+// settle cache when one is configured and holds this scene
+void settle_cloth() {
+    if (!settle_start) return;
+    Uint64 key = settle_cache_dir ? settle_cache_key() : 0;
+    if (settle_cache_dir && settle_cache_load(key)) return;
+    if (!settle_static()) {
+        fprintf(stderr, "settle: static solve did not converge, starting flat\n");
+    } else if (settle_cache_dir && !settle_cache_store(key)) {
+        fprintf(stderr, "settle cache: cannot write to %s\n", settle_cache_dir);
+    }
+}
+
+typedef struct Transport Transport;
+extern Transport* domain_transport;
+
+// A non-finite position spreads through the constraints within a frame and
+// never recovers, so restart the cloth from its initial state instead. The
+// restart is flat: settling again could stall this step for seconds. A rank
+// of a domain run only holds its own band, so it is left alone there.
+void recover_non_finite() {
+    if (domain_transport) return;
+    for (int i = 0; i < NUM_PARTICLES; i++) {
+        if (!isfinite(particles[i].x) || !isfinite(particles[i].y)) {
+            init_particles();
+            init_constraints();
+            init_constraint_indices();
+            init_constraint_colors();
+            metric_add(&sim_metrics.nan_recoveries, 1);
+            return;
+        }
+    }
+}
+
+// Damps each free particle's velocity relative to the rigid motion (mean
+// velocity plus spin about the centre of mass) of the free particles, so
+// stretching and flapping die out while swinging and falling are kept. Verlet
+// velocity is implicit, so the damped velocity is written back through old_x.
+// Returns the largest remaining free-particle speed squared.
+float damp_relative_motion(float h, float retention) {
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 inv_h = _mm_set1_ps(1.0f / h);
+    __m128 sum_w = zero, sum_x = zero, sum_y = zero, sum_vx = zero, sum_vy = zero;
+    int i = 0;
+    for (; i + 4 <= NUM_PARTICLES; i += 4) {
+        const Particle* p = &particles[i];
+        __m128 w = _mm_setr_ps(p[0].locked ? 0 : p[0].mass, p[1].locked ? 0 : p[1].mass,
+                               p[2].locked ? 0 : p[2].mass, p[3].locked ? 0 : p[3].mass);
+        __m128 x = _mm_setr_ps(p[0].x, p[1].x, p[2].x, p[3].x);
+        __m128 y = _mm_setr_ps(p[0].y, p[1].y, p[2].y, p[3].y);
+        __m128 vx = _mm_mul_ps(_mm_sub_ps(x, _mm_setr_ps(p[0].old_x, p[1].old_x, p[2].old_x, p[3].old_x)), inv_h);
+        __m128 vy = _mm_mul_ps(_mm_sub_ps(y, _mm_setr_ps(p[0].old_y, p[1].old_y, p[2].old_y, p[3].old_y)), inv_h);
+        sum_w = _mm_add_ps(sum_w, w);
+        sum_x = _mm_add_ps(sum_x, _mm_mul_ps(w, x));
+        sum_y = _mm_add_ps(sum_y, _mm_mul_ps(w, y));
+        sum_vx = _mm_add_ps(sum_vx, _mm_mul_ps(w, vx));
+        sum_vy = _mm_add_ps(sum_vy, _mm_mul_ps(w, vy));
+    }
+    float lanes[5][4];
+    _mm_storeu_ps(lanes[0], sum_w);
+    _mm_storeu_ps(lanes[1], sum_x);
+    _mm_storeu_ps(lanes[2], sum_y);
+    _mm_storeu_ps(lanes[3], sum_vx);
+    _mm_storeu_ps(lanes[4], sum_vy);
+    double total[5] = {0};
+    for (int k = 0; k < 5; k++) {
+        for (int lane = 0; lane < 4; lane++) total[k] += lanes[k][lane];
+    }
+    for (; i < NUM_PARTICLES; i++) {
+        const Particle* p = &particles[i];
+        if (p->locked) continue;
+        total[0] += p->mass;
+        total[1] += p->mass * p->x;
+        total[2] += p->mass * p->y;
+        total[3] += p->mass * (p->x - p->old_x) / h;
+        total[4] += p->mass * (p->y - p->old_y) / h;
+    }
+    if (total[0] <= 0) return 0;
+    float cx = (float)(total[1] / total[0]), cy = (float)(total[2] / total[0]);
+    float cvx = (float)(total[3] / total[0]), cvy = (float)(total[4] / total[0]);
+
+    // Spin about the centre of mass: angular momentum over moment of inertia
+    double momentum = 0, inertia = 0;
+    for (i = 0; i < NUM_PARTICLES; i++) {
+        const Particle* p = &particles[i];
+        if (p->locked) continue;
+        float rx = p->x - cx, ry = p->y - cy;
+        float vx = (p->x - p->old_x) / h - cvx, vy = (p->y - p->old_y) / h - cvy;
+        momentum += p->mass * (rx * vy - ry * vx);
+        inertia += p->mass * (rx * rx + ry * ry);
+    }
+    float omega = inertia > 0 ? (float)(momentum / inertia) : 0;
+
+    const __m128 keep = _mm_set1_ps(retention), h4 = _mm_set1_ps(h);
+    const __m128 cx4 = _mm_set1_ps(cx), cy4 = _mm_set1_ps(cy);
+    const __m128 cvx4 = _mm_set1_ps(cvx), cvy4 = _mm_set1_ps(cvy), omega4 = _mm_set1_ps(omega);
+    __m128 max_speed_sq = zero;
+    float out[4][4];
+    for (i = 0; i + 4 <= NUM_PARTICLES; i += 4) {
+        Particle* p = &particles[i];
+        __m128 x = _mm_setr_ps(p[0].x, p[1].x, p[2].x, p[3].x);
+        __m128 y = _mm_setr_ps(p[0].y, p[1].y, p[2].y, p[3].y);
+        __m128 vx = _mm_mul_ps(_mm_sub_ps(x, _mm_setr_ps(p[0].old_x, p[1].old_x, p[2].old_x, p[3].old_x)), inv_h);
+        __m128 vy = _mm_mul_ps(_mm_sub_ps(y, _mm_setr_ps(p[0].old_y, p[1].old_y, p[2].old_y, p[3].old_y)), inv_h);
+        __m128 rigid_vx = _mm_sub_ps(cvx4, _mm_mul_ps(omega4, _mm_sub_ps(y, cy4)));
+        __m128 rigid_vy = _mm_add_ps(cvy4, _mm_mul_ps(omega4, _mm_sub_ps(x, cx4)));
+        vx = _mm_add_ps(rigid_vx, _mm_mul_ps(keep, _mm_sub_ps(vx, rigid_vx)));
+        vy = _mm_add_ps(rigid_vy, _mm_mul_ps(keep, _mm_sub_ps(vy, rigid_vy)));
+        _mm_storeu_ps(out[0], _mm_sub_ps(x, _mm_mul_ps(vx, h4)));
+        _mm_storeu_ps(out[1], _mm_sub_ps(y, _mm_mul_ps(vy, h4)));
+        _mm_storeu_ps(out[2], vx);
+        _mm_storeu_ps(out[3], vy);
+        __m128 locked = _mm_cmpneq_ps(_mm_setr_ps(p[0].locked, p[1].locked, p[2].locked, p[3].locked), zero);
+        __m128 speed_sq = _mm_add_ps(_mm_mul_ps(vx, vx), _mm_mul_ps(vy, vy));
+        max_speed_sq = _mm_max_ps(max_speed_sq, _mm_andnot_ps(locked, speed_sq));
+        for (int lane = 0; lane < 4; lane++) {
+            if (p[lane].locked) continue;
+            p[lane].old_x = out[0][lane];
+            p[lane].old_y = out[1][lane];
+            p[lane].vx = out[2][lane];
+            p[lane].vy = out[3][lane];
+        }
+    }
+    max_speed_sq = _mm_max_ps(max_speed_sq, _mm_movehl_ps(max_speed_sq, max_speed_sq));
+    max_speed_sq = _mm_max_ss(max_speed_sq, _mm_shuffle_ps(max_speed_sq, max_speed_sq, 1));
+    float result = _mm_cvtss_f32(max_speed_sq);
+    for (; i < NUM_PARTICLES; i++) {
+        Particle* p = &particles[i];
+        if (p->locked) continue;
+        float rigid_vx = cvx - omega * (p->y - cy), rigid_vy = cvy + omega * (p->x - cx);
+        p->vx = rigid_vx + retention * ((p->x - p->old_x) / h - rigid_vx);
+        p->vy = rigid_vy + retention * ((p->y - p->old_y) / h - rigid_vy);
+        p->old_x = p->x - p->vx * h;
+        p->old_y = p->y - p->vy * h;
+        result = fmaxf(result, p->vx * p->vx + p->vy * p->vy);
+    }
+    return result;
+}
+
+// Union-find root with path halving
+int fragment_root(int* parent, int i) {
+    while (parent[i] != i) {
+        parent[i] = parent[parent[i]];
+        i = parent[i];
+    }
+    return i;
+}
+
+// Refills constraints[] with the intact constraints of awake fragments, then
+// the index and color forms the solvers read
+void rebuild_active_constraints() {
+    num_constraints = 0;
+    for (int e = 0; e < NUM_CONSTRAINTS; e++) {
+        if (constraint_torn[e]) continue;
+        const Fragment* f = &fragments[particle_fragment[all_constraint_indices[e].a]];
+        if (f->asleep || f->culled) continue;
+        active_source[num_constraints] = e;
+        constraints[num_constraints++] = all_constraints[e];
+    }
+    init_constraint_indices();
+    init_constraint_colors();
+}
+
+// Labels particle_fragment[] with the connected components of the intact
+// constraints, numbered by their lowest particle. Tears only ever split a
+// fragment, so each new one takes over the sleep state of the one it came
+// from.
+void rebuild_fragments() {
+    static int parent[NUM_PARTICLES], size[NUM_PARTICLES], label[NUM_PARTICLES];
+    static Fragment previous[NUM_PARTICLES];
+    memcpy(previous, fragments, sizeof(Fragment) * num_fragments);
+    for (int i = 0; i < NUM_PARTICLES; i++) {
+        parent[i] = i;
+        size[i] = 1;
+        label[i] = -1;
+    }
+    for (int e = 0; e < NUM_CONSTRAINTS; e++) {
+        if (constraint_torn[e]) continue;
+        int a = fragment_root(parent, all_constraint_indices[e].a);
+        int b = fragment_root(parent, all_constraint_indices[e].b);
+        if (a == b) continue;
+        if (size[a] < size[b]) {
+            int swap = a;
+            a = b;
+            b = swap;
+        }
+        parent[b] = a;
+        size[a] += size[b];
+    }
+    num_fragments = 0;
+    for (int i = 0; i < NUM_PARTICLES; i++) {
+        int root = fragment_root(parent, i);
+        if (label[root] < 0) {
+            label[root] = num_fragments;
+            fragments[num_fragments] = previous[particle_fragment[i]];
+            fragments[num_fragments].particles = fragments[num_fragments].pins = 0;
+            num_fragments++;
+        }
+        Fragment* f = &fragments[label[root]];
+        particle_fragment[i] = label[root];
+        f->particles++;
+        if (particles[i].locked && !particle_frozen[i]) f->pins++;
+    }
+}
+
+// Breaks active constraints stretched past their rest length by more than
+// the material's tear distance
+void tear_constraints() {
+    int torn = 0;
+    for (int i = 0; i < num_constraints; i++) {
+        const Constraint* c = &constraints[i];
+        float dx = c->p2->x - c->p1->x, dy = c->p2->y - c->p1->y;
+        float limit = c->rest_length + current_material.tear_distance;
+        if (dx * dx + dy * dy > limit * limit) {
+            constraint_torn[active_source[i]] = true;
+            torn++;
+        }
+    }
+    if (torn == 0) return;
+    metric_add(&sim_metrics.torn_constraints, torn);
+    fragments_dirty = true;
+    rebuild_active_constraints();
+}
+
+// Holds a fragment's free particles where they are, like pins
+void freeze_fragment(int fragment) {
+    for (int i = 0; i < NUM_PARTICLES; i++) {
+        Particle* p = &particles[i];
+        if (particle_fragment[i] != fragment || p->locked) continue;
+        p->locked = true;
+        p->old_x = p->x;
+        p->old_y = p->y;
+        p->vx = p->vy = 0;
+        particle_frozen[i] = true;
+        frozen_particles++;
+    }
+}
+
+// Wakes every sleeping fragment; culled ones stay frozen
+void thaw_fragments() {
+    wake_fragments = false;
+    bool thawed = false;
+    for (int f = 0; f < num_fragments; f++) {
+        if (!fragments[f].asleep) continue;
+        fragments[f].asleep = false;
+        fragments[f].quiet_frames = 0;
+        thawed = true;
+    }
+    if (!thawed) return;
+    for (int i = 0; i < NUM_PARTICLES; i++) {
+        if (!particle_frozen[i] || fragments[particle_fragment[i]].culled) continue;
+        particles[i].locked = false;
+        particle_frozen[i] = false;
+        frozen_particles--;
+    }
+    rebuild_active_constraints();
+}
+
+// damp_relative_motion for each fragment on its own, so pieces flying apart
+// are not damped towards one common motion. Records each fragment's largest
+// remaining free-particle speed squared.
+void damp_fragment_motion(float h, float retention) {
+    static double sums[NUM_PARTICLES][7]; // mass, x, y, vx, vy, momentum, inertia
+    memset(sums, 0, sizeof(sums[0]) * num_fragments);
+    for (int i = 0; i < NUM_PARTICLES; i++) {
+        const Particle* p = &particles[i];
+        if (p->locked) continue;
+        double* s = sums[particle_fragment[i]];
+        s[0] += p->mass;
+        s[1] += p->mass * p->x;
+        s[2] += p->mass * p->y;
+        s[3] += p->mass * (p->x - p->old_x) / h;
+        s[4] += p->mass * (p->y - p->old_y) / h;
+    }
+    for (int f = 0; f < num_fragments; f++) {
+        double* s = sums[f];
+        if (s[0] <= 0) continue;
+        for (int k = 1; k < 5; k++) s[k] /= s[0];
+    }
+    for (int i = 0; i < NUM_PARTICLES; i++) {
+        const Particle* p = &particles[i];
+        if (p->locked) continue;
+        double* s = sums[particle_fragment[i]];
+        float rx = p->x - (float)s[1], ry = p->y - (float)s[2];
+        float vx = (p->x - p->old_x) / h - (float)s[3], vy = (p->y - p->old_y) / h - (float)s[4];
+        s[5] += p->mass * (rx * vy - ry * vx);
+        s[6] += p->mass * (rx * rx + ry * ry);
+    }
+    for (int f = 0; f < num_fragments; f++) fragments[f].speed_sq = 0;
+    for (int i = 0; i < NUM_PARTICLES; i++) {
+        Particle* p = &particles[i];
+        if (p->locked) continue;
+        const double* s = sums[particle_fragment[i]];
+        float cx = (float)s[1], cy = (float)s[2], cvx = (float)s[3], cvy = (float)s[4];
+        float omega = s[6] > 0 ? (float)(s[5] / s[6]) : 0;
+        float rigid_vx = cvx - omega * (p->y - cy), rigid_vy = cvy + omega * (p->x - cx);
+        p->vx = rigid_vx + retention * ((p->x - p->old_x) / h - rigid_vx);
+        p->vy = rigid_vy + retention * ((p->y - p->old_y) / h - rigid_vy);
+        p->old_x = p->x - p->vx * h;
+        p->old_y = p->y - p->vy * h;
+        Fragment* f = &fragments[particle_fragment[i]];
+        f->speed_sq = fmaxf(f->speed_sq, p->vx * p->vx + p->vy * p->vy);
+    }
+}
+
+// Once per frame after the solver: relabels fragments if tears are pending
+// and the last rebuild is FRAGMENT_REBUILD_FRAMES old, then puts quiet
+// fragments to sleep (only once the cloth has come apart; a whole cloth
+// sleeps as before) and culls pin-less fragments that have left the view.
+void update_fragments() {
+    static float bounds[NUM_PARTICLES][4];
+    frames_since_rebuild++;
+    if (fragments_dirty && frames_since_rebuild >= FRAGMENT_REBUILD_FRAMES) {
+        rebuild_fragments();
+        fragments_dirty = false;
+        frames_since_rebuild = 0;
+    }
+
+    for (int f = 0; f < num_fragments; f++) {
+        bounds[f][0] = bounds[f][1] = INFINITY;
+        bounds[f][2] = bounds[f][3] = -INFINITY;
+    }
+    for (int i = 0; i < NUM_PARTICLES; i++) {
+        float* b = bounds[particle_fragment[i]];
+        b[0] = fminf(b[0], particles[i].x);
+        b[1] = fminf(b[1], particles[i].y);
+        b[2] = fmaxf(b[2], particles[i].x);
+        b[3] = fmaxf(b[3], particles[i].y);
+    }
+    bool changed = false;
+    for (int f = 0; f < num_fragments; f++) {
+        Fragment* fragment = &fragments[f];
+        if (fragment->culled) continue;
+        const float* b = bounds[f];
+        if (fragment->pins == 0 &&
+            (b[2] < view_x - FRAGMENT_CULL_MARGIN || b[0] > view_x + SCREEN_WIDTH + FRAGMENT_CULL_MARGIN ||
+             b[3] < view_y - FRAGMENT_CULL_MARGIN || b[1] > view_y + SCREEN_HEIGHT + FRAGMENT_CULL_MARGIN)) {
+            fragment->culled = true;
+            freeze_fragment(f);
+            changed = true;
+            continue;
+        }
+        if (num_fragments == 1 || fragment->asleep) continue;
+        fragment->quiet_frames = (fragment->speed_sq < SLEEP_SPEED * SLEEP_SPEED) ? fragment->quiet_frames + 1 : 0;
+        if (fragment->quiet_frames >= SLEEP_FRAMES && num_force_fields == 0) {
+            fragment->asleep = true;
+            freeze_fragment(f);
+            changed = true;
+        }
+    }
+    if (changed) rebuild_active_constraints();
+}
+
+// Reduced-order mode for background and preview cloth. A few dozen modes
+// are found by PCA of full simulations of the current scene (the settled
+// start kicked by a different low-frequency velocity pattern per episode),
+// and the cloth then moves only within them: positions = mean + basis * q.
+// The constraint springs (stiffness from projection_stiffness) are
+// integrated by cubature, a small weighted set of constraints chosen
+// greedily with non-negative least squares so that their reduced forces
+// match those of all constraints over the training states. Each frame is a
+// linearized backward Euler step in q, costing O(cubature * modes^2 +
+// modes^3) whatever the grid size; only writing particles[] back (an SSE
+// matrix-vector product) touches every particle. Mouse, colliders and
+// force fields do not act on the reduced cloth.
+#define REDUCED_MAX_MODES 64
+#define REDUCED_EPISODES 4
+#define REDUCED_EPISODE_FRAMES 150
+#define REDUCED_SNAPSHOTS (REDUCED_EPISODES * REDUCED_EPISODE_FRAMES)
+#define REDUCED_CUBATURE_SAMPLES 48
+#define REDUCED_MAX_CUBATURE 192
+#define REDUCED_CUBATURE_TOLERANCE 0.01
+#define REDUCED_POWER_ITERATIONS 20
+
+typedef struct {
+    int constraint;
+    float weight;
+    float mean_dx, mean_dy, rest_length;
+    float dx[REDUCED_MAX_MODES], dy[REDUCED_MAX_MODES]; // (basis_b - basis_a) rows
+} ReducedElement;
+
+typedef struct {
+    bool enabled;
+    int modes;
+    float* mean;  // 2 * NUM_PARTICLES
+    float* basis; // modes columns of 2 * NUM_PARTICLES, one after another
+    float gravity[REDUCED_MAX_MODES];
+    ReducedElement* elements;
+    int num_elements;
+    double q[REDUCED_MAX_MODES], v[REDUCED_MAX_MODES];
+} ReducedModel;
+
+ReducedModel reduced;
+int reduced_modes = 0; // --reduced / reduced = modes; 0 runs the full model
+
+void step_simulation(float dt);
+
+// Eigen-decomposition of the symmetric n x n matrix a by cyclic Jacobi
+// rotations: a ends up diagonal, vectors holds the eigenvectors as columns
+void jacobi_eigen(double* a, double* vectors, int n) {
+    for (int i = 0; i < n * n; i++) vectors[i] = (i % (n + 1) == 0) ? 1 : 0;
+    for (int sweep = 0; sweep < 50; sweep++) {
+        double off = 0;
+        for (int i = 0; i < n; i++) {
+            for (int j = i + 1; j < n; j++) off += a[i * n + j] * a[i * n + j];
+        }
+        if (off < 1e-22) break;
+        for (int p = 0; p < n; p++) {
+            for (int q = p + 1; q < n; q++) {
+                if (fabs(a[p * n + q]) < 1e-300) continue;
+                double theta = (a[q * n + q] - a[p * n + p]) / (2 * a[p * n + q]);
+                double t = (theta >= 0 ? 1 : -1) / (fabs(theta) + sqrt(theta * theta + 1));
+                double c = 1 / sqrt(t * t + 1), s = t * c;
+                for (int k = 0; k < n; k++) {
+                    double akp = a[k * n + p], akq = a[k * n + q];
+                    a[k * n + p] = c * akp - s * akq;
+                    a[k * n + q] = s * akp + c * akq;
+                }
+                for (int k = 0; k < n; k++) {
+                    double apk = a[p * n + k], aqk = a[q * n + k];
+                    a[p * n + k] = c * apk - s * aqk;
+                    a[q * n + k] = s * apk + c * aqk;
+                }
+                for (int k = 0; k < n; k++) {
+                    double vkp = vectors[k * n + p], vkq = vectors[k * n + q];
+                    vectors[k * n + p] = c * vkp - s * vkq;
+                    vectors[k * n + q] = s * vkp + c * vkq;
+                }
+            }
+        }
+    }
+}
+
+// Solves the symmetric positive definite n x n system a x = b in place
+// (a is overwritten by its Cholesky factor); false if a is not SPD
+bool cholesky_solve(double* a, double* b, int n) {
+    for (int j = 0; j < n; j++) {
+        double d = a[j * n + j];
+        for (int k = 0; k < j; k++) d -= a[j * n + k] * a[j * n + k];
+        if (d <= 0) return false;
+        a[j * n + j] = sqrt(d);
+        for (int i = j + 1; i < n; i++) {
+            double s = a[i * n + j];
+            for (int k = 0; k < j; k++) s -= a[i * n + k] * a[j * n + k];
+            a[i * n + j] = s / a[j * n + j];
+        }
+    }
+    for (int i = 0; i < n; i++) {
+        for (int k = 0; k < i; k++) b[i] -= a[i * n + k] * b[k];
+        b[i] /= a[i * n + i];
+    }
+    for (int i = n - 1; i >= 0; i--) {
+        for (int k = i + 1; k < n; k++) b[i] -= a[k * n + i] * b[k];
+        b[i] /= a[i * n + i];
+    }
+    return true;
+}
+
+// Dot product of two float arrays, four lanes at a time
+double dot_floats(const float* a, const float* b, int n) {
+    __m128 sum = _mm_setzero_ps();
+    int i = 0;
+    for (; i + 4 <= n; i += 4) sum = _mm_add_ps(sum, _mm_mul_ps(_mm_loadu_ps(&a[i]), _mm_loadu_ps(&b[i])));
+    float lanes[4];
+    _mm_storeu_ps(lanes, sum);
+    double total = (double)lanes[0] + lanes[1] + lanes[2] + lanes[3];
+    for (; i < n; i++) total += a[i] * b[i];
+    return total;
+}
+
+// Reduced coordinates of particles[] and, when v is given, of their
+// velocities over a step of dt
+void reduced_project(double* q, double* v, float dt) {
+    int n = 2 * NUM_PARTICLES;
+    for (int j = 0; j < reduced.modes; j++) {
+        const float* column = reduced.basis + (size_t)j * n;
+        double sum = 0, speed = 0;
+        for (int i = 0; i < NUM_PARTICLES; i++) {
+            const Particle* p = &particles[i];
+            sum += column[2 * i] * (p->x - reduced.mean[2 * i]) + column[2 * i + 1] * (p->y - reduced.mean[2 * i + 1]);
+            speed += column[2 * i] * (p->x - p->old_x) + column[2 * i + 1] * (p->y - p->old_y);
+        }
+        q[j] = sum;
+        if (v) v[j] = speed / dt;
+    }
+}
+
+// positions = mean + basis * q, four coordinates per SSE lane group
+void reduced_reconstruct(const double* q, float* positions) {
+    int n = 2 * NUM_PARTICLES, i = 0;
+    float qf[REDUCED_MAX_MODES];
+    for (int j = 0; j < reduced.modes; j++) qf[j] = (float)q[j];
+    for (; i + 4 <= n; i += 4) {
+        __m128 sum = _mm_loadu_ps(&reduced.mean[i]);
+        for (int j = 0; j < reduced.modes; j++) {
+            sum = _mm_add_ps(sum, _mm_mul_ps(_mm_set1_ps(qf[j]), _mm_loadu_ps(&reduced.basis[(size_t)j * n + i])));
+        }
+        _mm_storeu_ps(&positions[i], sum);
+    }
+    for (; i < n; i++) {
+        float sum = reduced.mean[i];
+        for (int j = 0; j < reduced.modes; j++) sum += qf[j] * reduced.basis[(size_t)j * n + i];
+        positions[i] = sum;
+    }
+}
+
+// Element geometry for constraint e in the current basis
+void reduced_element_init(ReducedElement* el, int e, float rest_scale) {
+    const ConstraintIndex* ci = &constraint_indices[e];
+    int n = 2 * NUM_PARTICLES;
+    el->constraint = e;
+    el->weight = 1;
+    el->mean_dx = reduced.mean[2 * ci->b] - reduced.mean[2 * ci->a];
+    el->mean_dy = reduced.mean[2 * ci->b + 1] - reduced.mean[2 * ci->a + 1];
+    el->rest_length = rest_scale * ci->rest_length;
+    for (int j = 0; j < reduced.modes; j++) {
+        const float* column = reduced.basis + (size_t)j * n;
+        el->dx[j] = column[2 * ci->b] - column[2 * ci->a];
+        el->dy[j] = column[2 * ci->b + 1] - column[2 * ci->a + 1];
+    }
+}
+
+// Adds an element's spring force (times its weight) to force and, when given,
+// its stiffness to the upper triangle of the modes x modes matrix stiffness;
+// compression keeps only the axial term so the matrix stays semi-definite
+void reduced_element_force(const ReducedElement* el, const double* q, double k, double* force, double* stiffness) {
+    int r = reduced.modes;
+    double dx = el->mean_dx, dy = el->mean_dy;
+    for (int j = 0; j < r; j++) {
+        dx += el->dx[j] * q[j];
+        dy += el->dy[j] * q[j];
+    }
+    double length = sqrt(dx * dx + dy * dy);
+    if (length < 1e-6) return;
+    double nx = dx / length, ny = dy / length;
+    double tension = el->weight * k * (length - el->rest_length);
+    double axial[REDUCED_MAX_MODES], normal[REDUCED_MAX_MODES];
+    for (int j = 0; j < r; j++) {
+        axial[j] = nx * el->dx[j] + ny * el->dy[j];
+        normal[j] = nx * el->dy[j] - ny * el->dx[j];
+        force[j] -= tension * axial[j];
+    }
+    if (!stiffness) return;
+    double ka = el->weight * k, kn = el->weight * k * fmax(0.0, 1.0 - el->rest_length / length);
+    for (int i = 0; i < r; i++) {
+        double ai = ka * axial[i], ni = kn * normal[i];
+        __m128d a2 = _mm_set1_pd(ai), n2 = _mm_set1_pd(ni);
+        double* row = &stiffness[i * r];
+        int j = i & ~1; // the lower entry this may touch is overwritten later
+        for (; j + 2 <= r; j += 2) {
+            __m128d update = _mm_add_pd(_mm_mul_pd(a2, _mm_loadu_pd(&axial[j])), _mm_mul_pd(n2, _mm_loadu_pd(&normal[j])));
+            _mm_storeu_pd(&row[j], _mm_add_pd(_mm_loadu_pd(&row[j]), update));
+        }
+        for (; j < r; j++) row[j] += ai * axial[j] + ni * normal[j];
+    }
+}
+
+// Principal components of the snapshots (count x n, rows): mean and the
+// first modes directions via subspace iteration on the count x count Gram
+// matrix (method of snapshots). Returns the captured variance fraction.
+double reduced_pca(const float* snapshots, int count, int modes) {
+    int n = 2 * NUM_PARTICLES, p = modes + 8 < count ? modes + 8 : count;
+    double* gram = malloc(sizeof(double) * count * count);
+    double* basis = malloc(sizeof(double) * count * p);
+    double* next = malloc(sizeof(double) * count * p);
+    double* small = malloc(sizeof(double) * p * p);
+    double* vectors = malloc(sizeof(double) * p * p);
+    float* centred = malloc(sizeof(float) * (size_t)count * n);
+    if (!gram || !basis || !next || !small || !vectors || !centred) {
+        free(gram); free(basis); free(next); free(small); free(vectors); free(centred);
+        return -1;
+    }
+    for (int d = 0; d < n; d++) {
+        double sum = 0;
+        for (int s = 0; s < count; s++) sum += snapshots[(size_t)s * n + d];
+        reduced.mean[d] = (float)(sum / count);
+    }
+    for (int s = 0; s < count; s++) {
+        for (int d = 0; d < n; d++) centred[(size_t)s * n + d] = snapshots[(size_t)s * n + d] - reduced.mean[d];
+    }
+    double trace = 0;
+    for (int a = 0; a < count; a++) {
+        for (int b = a; b < count; b++) {
+            gram[a * count + b] = gram[b * count + a] = dot_floats(centred + (size_t)a * n, centred + (size_t)b * n, n);
+        }
+        trace += gram[a * count + a];
+    }
+
+    // Subspace iteration: basis <- orthonormalized gram * basis
+    Uint32 seed = 12345;
+    for (int i = 0; i < count * p; i++) {
+        seed = seed * 1664525u + 1013904223u;
+        basis[i] = (seed >> 8) / 8388608.0 - 1;
+    }
+    for (int iteration = 0; iteration <= REDUCED_POWER_ITERATIONS; iteration++) {
+        for (int c = 0; c < p; c++) {
+            for (int j = 0; j < c; j++) {
+                double dot = 0;
+                for (int i = 0; i < count; i++) dot += basis[i * p + c] * basis[i * p + j];
+                for (int i = 0; i < count; i++) basis[i * p + c] -= dot * basis[i * p + j];
+            }
+            double norm = 0;
+            for (int i = 0; i < count; i++) norm += basis[i * p + c] * basis[i * p + c];
+            norm = norm > 0 ? 1 / sqrt(norm) : 0;
+            for (int i = 0; i < count; i++) basis[i * p + c] *= norm;
+        }
+        if (iteration == REDUCED_POWER_ITERATIONS) break;
+        for (int i = 0; i < count; i++) {
+            for (int c = 0; c < p; c++) {
+                double sum = 0;
+                for (int k = 0; k < count; k++) sum += gram[i * count + k] * basis[k * p + c];
+                next[i * p + c] = sum;
+            }
+        }
+        memcpy(basis, next, sizeof(double) * count * p);
+    }
+
+    // Rayleigh-Ritz: eigenvectors of basis^T gram basis, largest first
+    for (int i = 0; i < count; i++) {
+        for (int c = 0; c < p; c++) {
+            double sum = 0;
+            for (int k = 0; k < count; k++) sum += gram[i * count + k] * basis[k * p + c];
+            next[i * p + c] = sum;
+        }
+    }
+    for (int a = 0; a < p; a++) {
+        for (int b = 0; b < p; b++) {
+            double sum = 0;
+            for (int i = 0; i < count; i++) sum += basis[i * p + a] * next[i * p + b];
+            small[a * p + b] = sum;
+        }
+    }
+    jacobi_eigen(small, vectors, p);
+    int order[REDUCED_MAX_MODES + 8];
+    for (int i = 0; i < p; i++) order[i] = i;
+    for (int i = 1; i < p; i++) {
+        for (int j = i; j > 0 && small[order[j] * (p + 1)] > small[order[j - 1] * (p + 1)]; j--) {
+            int swap = order[j];
+            order[j] = order[j - 1];
+            order[j - 1] = swap;
+        }
+    }
+
+    // Mode j = centred^T * (basis * vector j), normalized
+    double captured = 0;
+    for (int j = 0; j < modes; j++) {
+        double weights[REDUCED_SNAPSHOTS];
+        for (int i = 0; i < count; i++) {
+            double sum = 0;
+            for (int c = 0; c < p; c++) sum += basis[i * p + c] * vectors[c * p + order[j]];
+            weights[i] = sum;
+        }
+        float* column = reduced.basis + (size_t)j * n;
+        double norm = 0;
+        for (int d = 0; d < n; d++) {
+            double sum = 0;
+            for (int s = 0; s < count; s++) sum += weights[s] * centred[(size_t)s * n + d];
+            column[d] = (float)sum;
+            norm += sum * sum;
+        }
+        norm = norm > 0 ? 1 / sqrt(norm) : 0;
+        for (int d = 0; d < n; d++) column[d] = (float)(column[d] * norm);
+        captured += small[order[j] * (p + 1)];
+    }
+    free(gram); free(basis); free(next); free(small); free(vectors); free(centred);
+    return trace > 0 ? captured / trace : 1;
+}
+
+// Greedy cubature: repeatedly adds the constraint whose reduced force over
+// the sample states best matches what is still unexplained, refitting
+// non-negative weights each time. Returns the relative residual.
+double reduced_cubature(const float* snapshots, int count, float rest_scale) {
+    int r = reduced.modes, rows = REDUCED_CUBATURE_SAMPLES * r;
+    double k = projection_stiffness();
+    float* columns = malloc(sizeof(float) * (size_t)NUM_CONSTRAINTS * rows);
+    double* target = calloc(rows, sizeof(double));
+    double* residual = malloc(sizeof(double) * rows);
+    double* normal = malloc(sizeof(double) * REDUCED_MAX_CUBATURE * REDUCED_MAX_CUBATURE);
+    double* cross = malloc(sizeof(double) * REDUCED_MAX_CUBATURE * REDUCED_MAX_CUBATURE);
+    double* weights = malloc(sizeof(double) * REDUCED_MAX_CUBATURE);
+    double* column_norm = malloc(sizeof(double) * NUM_CONSTRAINTS);
+    float* residual_floats = malloc(sizeof(float) * rows);
+    bool* excluded = calloc(NUM_CONSTRAINTS, sizeof(bool));
+    int selected[REDUCED_MAX_CUBATURE];
+    double projected[REDUCED_MAX_CUBATURE];
+    if (!columns || !target || !residual || !normal || !cross || !weights || !column_norm || !residual_floats || !excluded) {
+        free(columns); free(target); free(residual); free(normal); free(cross); free(weights); free(column_norm);
+        free(residual_floats); free(excluded);
+        return -1;
+    }
+
+    // Column e: constraint e's reduced force at every sample state
+    static Particle saved[NUM_PARTICLES];
+    memcpy(saved, particles, sizeof(particles));
+    double q[REDUCED_MAX_MODES];
+    ReducedElement el;
+    for (int s = 0; s < REDUCED_CUBATURE_SAMPLES; s++) {
+        const float* snapshot = snapshots + (size_t)(s * count / REDUCED_CUBATURE_SAMPLES) * 2 * NUM_PARTICLES;
+        for (int i = 0; i < NUM_PARTICLES; i++) {
+            particles[i].x = snapshot[2 * i];
+            particles[i].y = snapshot[2 * i + 1];
+        }
+        reduced_project(q, NULL, 0);
+        for (int e = 0; e < NUM_CONSTRAINTS; e++) {
+            double force[REDUCED_MAX_MODES] = {0};
+            reduced_element_init(&el, e, rest_scale);
+            reduced_element_force(&el, q, k, force, NULL);
+            for (int j = 0; j < r; j++) {
+                columns[(size_t)e * rows + s * r + j] = (float)force[j];
+                target[s * r + j] += force[j];
+            }
+        }
+    }
+    memcpy(particles, saved, sizeof(particles));
+
+    for (int e = 0; e < NUM_CONSTRAINTS; e++) {
+        double norm = dot_floats(columns + (size_t)e * rows, columns + (size_t)e * rows, rows);
+        column_norm[e] = sqrt(norm);
+        excluded[e] = norm == 0;
+    }
+    double target_norm = 0;
+    for (int i = 0; i < rows; i++) target_norm += target[i] * target[i];
+    target_norm = sqrt(target_norm);
+    memcpy(residual, target, sizeof(double) * rows);
+    int num_selected = 0;
+    double error = 1;
+    while (num_selected < REDUCED_MAX_CUBATURE && error > REDUCED_CUBATURE_TOLERANCE) {
+        for (int i = 0; i < rows; i++) residual_floats[i] = (float)residual[i];
+        int best = -1;
+        double best_score = 0;
+        for (int e = 0; e < NUM_CONSTRAINTS; e++) {
+            if (excluded[e]) continue;
+            double score = dot_floats(columns + (size_t)e * rows, residual_floats, rows) / column_norm[e];
+            if (score > best_score) {
+                best_score = score;
+                best = e;
+            }
+        }
+        if (best < 0) break;
+        excluded[best] = true;
+        const float* column = columns + (size_t)best * rows;
+        for (int a = 0; a <= num_selected; a++) {
+            const float* other = (a < num_selected) ? columns + (size_t)selected[a] * rows : column;
+            double sum = dot_floats(column, other, rows);
+            cross[a * REDUCED_MAX_CUBATURE + num_selected] = cross[num_selected * REDUCED_MAX_CUBATURE + a] = sum;
+        }
+        double dot = 0;
+        for (int i = 0; i < rows; i++) dot += column[i] * target[i];
+        projected[num_selected] = dot;
+        selected[num_selected++] = best;
+
+        // Least squares on the selected columns (normal equations from the
+        // cached cross products), dropping any that go negative
+        for (;;) {
+            int m = num_selected;
+            for (int a = 0; a < m; a++) {
+                for (int b = 0; b < m; b++) normal[a * m + b] = cross[a * REDUCED_MAX_CUBATURE + b];
+                normal[a * m + a] *= 1 + 1e-9;
+                weights[a] = projected[a];
+            }
+            int worst = -1;
+            if (!cholesky_solve(normal, weights, m)) {
+                worst = m - 1;
+            } else {
+                for (int a = 0; a < m; a++) {
+                    if (weights[a] < 0 && (worst < 0 || weights[a] < weights[worst])) worst = a;
+                }
+            }
+            if (worst < 0) break;
+            int last = --num_selected;
+            selected[worst] = selected[last];
+            projected[worst] = projected[last];
+            for (int a = 0; a < last; a++) {
+                cross[worst * REDUCED_MAX_CUBATURE + a] = cross[last * REDUCED_MAX_CUBATURE + a];
+                cross[a * REDUCED_MAX_CUBATURE + worst] = cross[a * REDUCED_MAX_CUBATURE + last];
+            }
+            cross[worst * REDUCED_MAX_CUBATURE + worst] = cross[last * REDUCED_MAX_CUBATURE + last];
+            if (num_selected == 0) break;
+        }
+        memcpy(residual, target, sizeof(double) * rows);
+        for (int a = 0; a < num_selected; a++) {
+            const float* ca = columns + (size_t)selected[a] * rows;
+            for (int i = 0; i < rows; i++) residual[i] -= weights[a] * ca[i];
+        }
+        double norm = 0;
+        for (int i = 0; i < rows; i++) norm += residual[i] * residual[i];
+        error = target_norm > 0 ? sqrt(norm) / target_norm : 0;
+    }
+
+    reduced.num_elements = num_selected;
+    for (int a = 0; a < num_selected; a++) {
+        reduced_element_init(&reduced.elements[a], selected[a], rest_scale);
+        reduced.elements[a].weight = (float)weights[a];
+    }
+    free(columns); free(target); free(residual); free(normal); free(cross); free(weights); free(column_norm);
+    free(residual_floats); free(excluded);
+    return error;
+}
+
+void reduced_free() {
+    _mm_free(reduced.mean);
+    _mm_free(reduced.basis);
+    free(reduced.elements);
+    memset(&reduced, 0, sizeof(reduced));
+}
+
+// Trains the reduced model from full runs of the current scene, then
+// starts it from the current particles[]; report prints what it kept
+bool reduced_build(int modes, bool report) {
+    int n = 2 * NUM_PARTICLES;
+    if (modes < 1 || modes > REDUCED_MAX_MODES) {
+        fprintf(stderr, "reduced: modes must be 1..%d\n", REDUCED_MAX_MODES);
+        return false;
+    }
+    float* snapshots = malloc(sizeof(float) * (size_t)REDUCED_SNAPSHOTS * n);
+    reduced.mean = _mm_malloc(sizeof(float) * n, 16);
+    reduced.basis = _mm_malloc(sizeof(float) * (size_t)modes * n, 16);
+    reduced.elements = malloc(sizeof(ReducedElement) * REDUCED_MAX_CUBATURE);
+    if (!snapshots || !reduced.mean || !reduced.basis || !reduced.elements) {
+        free(snapshots);
+        reduced_free();
+        return false;
+    }
+    reduced.modes = modes;
+
+    // Episodes: the start state kicked by sin/cos velocity patterns
+    const float PI = 3.14159265f;
+    static Particle start[NUM_PARTICLES];
+    memcpy(start, particles, sizeof(particles));
+    bool tore = tearing;
+    tearing = false;
+    Uint64 begin = SDL_GetPerformanceCounter();
+    for (int episode = 0; episode < REDUCED_EPISODES; episode++) {
+        memcpy(particles, start, sizeof(particles));
+        wake_cloth();
+        for (int i = 0; i < NUM_PARTICLES; i++) {
+            Particle* p = &particles[i];
+            if (p->locked) continue;
+            float u = (float)(i % GRID_WIDTH) / (GRID_WIDTH - 1), w = (float)(i / GRID_WIDTH) / (GRID_HEIGHT - 1);
+            float kick_x = 300 * sinf(PI * (episode + 1) * u) * w;
+            float kick_y = 200 * cosf(PI * (episode % 2 + 1) * u) * w;
+            p->old_x = p->x - kick_x / 60;
+            p->old_y = p->y - kick_y / 60;
+        }
+        for (int f = 0; f < REDUCED_EPISODE_FRAMES; f++) {
+            step_simulation(1.0f / 60);
+            float* snapshot = snapshots + (size_t)(episode * REDUCED_EPISODE_FRAMES + f) * n;
+            for (int i = 0; i < NUM_PARTICLES; i++) {
+                snapshot[2 * i] = particles[i].x;
+                snapshot[2 * i + 1] = particles[i].y;
+            }
+        }
+    }
+    memcpy(particles, start, sizeof(particles));
+    tearing = tore;
+    wake_cloth();
+
+    double captured = reduced_pca(snapshots, REDUCED_SNAPSHOTS, modes);
+    float rest_scale = material_rest_scale(&current_material);
+    double residual = captured < 0 ? -1 : reduced_cubature(snapshots, REDUCED_SNAPSHOTS, rest_scale);
+    free(snapshots);
+    if (residual < 0) {
+        reduced_free();
+        return false;
+    }
+
+    for (int j = 0; j < modes; j++) {
+        const float* column = reduced.basis + (size_t)j * n;
+        double sum = 0;
+        for (int i = 0; i < NUM_PARTICLES; i++) {
+            if (!particles[i].locked) sum += column[2 * i + 1] * particles[i].mass * 980.0;
+        }
+        reduced.gravity[j] = (float)sum;
+    }
+    reduced.enabled = true;
+    if (report) printf("reduced: %d modes keep %.2f%% of the variance, %d cubature constraints (force error %.2f%%), %.2f s\n",
+        modes, 100 * captured, reduced.num_elements, 100 * residual,
+        (double)(SDL_GetPerformanceCounter() - begin) / SDL_GetPerformanceFrequency());
+    return true;
+}
+
+// One frame in the subspace: (m + dt^2 K) dv = dt (f - dt K v), then the
+// material's damping, and particles[] rebuilt from q
+void reduced_step(float dt) {
+    static float positions[2 * NUM_PARTICLES];
+    int r = reduced.modes;
+    if (reduced_resync) {
+        reduced_project(reduced.q, reduced.v, dt);
+        reduced_resync = false;
+    }
+    double k = projection_stiffness();
+    double force[REDUCED_MAX_MODES], stiffness[REDUCED_MAX_MODES * REDUCED_MAX_MODES] = {0};
+    for (int j = 0; j < r; j++) force[j] = reduced.gravity[j];
+    for (int e = 0; e < reduced.num_elements; e++) {
+        reduced_element_force(&reduced.elements[e], reduced.q, k, force, stiffness);
+    }
+    for (int i = 0; i < r; i++) {
+        for (int j = 0; j < i; j++) stiffness[i * r + j] = stiffness[j * r + i];
+    }
+    double rhs[REDUCED_MAX_MODES];
+    for (int i = 0; i < r; i++) {
+        double kv = 0;
+        for (int j = 0; j < r; j++) kv += stiffness[i * r + j] * reduced.v[j];
+        rhs[i] = dt * (force[i] - dt * kv);
+        for (int j = 0; j < r; j++) stiffness[i * r + j] *= (double)dt * dt;
+        stiffness[i * r + i] += current_material.mass;
+    }
+    if (!cholesky_solve(stiffness, rhs, r)) return;
+    double keep = powf(fast_settle ? SETTLE_DAMPING : current_material.damping, dt * 60.0f);
+    for (int j = 0; j < r; j++) {
+        reduced.v[j] = (reduced.v[j] + rhs[j]) * keep;
+        reduced.q[j] += dt * reduced.v[j];
+    }
+
+    reduced_reconstruct(reduced.q, positions);
+    for (int i = 0; i < NUM_PARTICLES; i++) {
+        Particle* p = &particles[i];
+        if (p->locked) continue;
+        p->old_x = p->x;
+        p->old_y = p->y;
+        p->x = positions[2 * i];
+        p->y = positions[2 * i + 1];
+        p->vx = (p->x - p->old_x) / dt;
+        p->vy = (p->y - p->old_y) / dt;
+    }
+}
+
+// One substep. AoS runs the material callbacks on particles[], split across
+// the thread pool when it has more than one thread (constraints then go color
+// by color); the other layouts run the layout kernels on their store.
+void substep_simulation(float dt) {
+    // Update physics using encoded laws
+    kernel_begin(KERNEL_APPLY_FORCE);
+    if (particle_layout == LAYOUT_SOA) {
+        integrate_soa(&particles_soa, NUM_PARTICLES, &current_material, dt);
+    } else if (particle_layout == LAYOUT_AOSOA) {
+        integrate_aosoa(&particles_aosoa, NUM_PARTICLES, &current_material, dt);
+    } else {
+        parallel_for(NUM_PARTICLES, apply_force_range, &dt);
+    }
+    if (num_force_fields > 0) apply_force_fields(dt);
+    kernel_end(KERNEL_APPLY_FORCE);
+
+    if (mouse_down) {
+        kernel_begin(KERNEL_MOUSE);
+        if (particle_layout == LAYOUT_SOA) {
+            drag_soa(&particles_soa, NUM_PARTICLES, mouse.x, mouse.y);
+        } else if (particle_layout == LAYOUT_AOSOA) {
+            drag_aosoa(&particles_aosoa, NUM_PARTICLES, mouse.x, mouse.y);
+        } else if (broad_phase_mode == BROAD_PHASE_SAP) {
+            broad_phase_update();
+            broad_phase_visit(PROXY_MOUSE, drag_particle_range);
+        } else {
+            handle_mouse_interaction();
+        }
+        kernel_end(KERNEL_MOUSE);
+    }
+
+    // Solve constraints using material-specific solvers
+    kernel_begin(KERNEL_SOLVE_CONSTRAINT);
+    for (int j = 0; j < solver.iterations; j++) {
+        if (particle_layout == LAYOUT_SOA && wide_batches) {
+            solve_constraints_wide(&particles_soa, colored_indices, color_offsets[NUM_CONSTRAINT_COLORS], &current_material);
+        } else if (particle_layout == LAYOUT_SOA) {
+            solve_constraints_soa(&particles_soa, constraint_indices, num_constraints, &current_material);
+        } else if (particle_layout == LAYOUT_AOSOA) {
+            solve_constraints_aosoa(&particles_aosoa, constraint_indices, num_constraints, &current_material);
+        } else if (thread_pool.num_threads > 1) {
+            for (int color = 0; color < NUM_CONSTRAINT_COLORS; color++) {
+                parallel_for(color_offsets[color + 1] - color_offsets[color], solve_constraint_range,
+                    &colored_constraints[color_offsets[color]]);
+            }
+        } else {
+            solve_constraint_range(0, num_constraints, constraints);
+        }
+    }
+    if (num_colliders > 0) {
+        if (particle_layout == LAYOUT_SOA) {
+            collide_soa(&particles_soa, 0, NUM_PARTICLES, colliders, num_colliders);
+        } else if (particle_layout == LAYOUT_AOSOA) {
+            collide_aosoa(&particles_aosoa, 0, NUM_PARTICLES, colliders, num_colliders);
+        } else if (broad_phase_mode == BROAD_PHASE_SAP) {
+            broad_phase_update();
+            broad_phase_collide();
+        } else {
+            ParticlesAoS aos = {particles};
+            collide_aos(&aos, 0, NUM_PARTICLES, colliders, num_colliders);
+        }
+    }
+    kernel_end(KERNEL_SOLVE_CONSTRAINT);
+}
+
+// One frame of simulation. Layouts other than AoS load particles[] into their
+// store and write the result back so rendering and input keep working on
+// particles[].
+void step_simulation(float dt) {
+    if (reduced.enabled) {
+        reduced_step(dt);
+        return;
+    }
+    if (mouse_down) wake_cloth();
+    metric_set(&sim_metrics.sleeping_particles, cloth_asleep ? NUM_PARTICLES : frozen_particles);
+    if (cloth_asleep) return;
+    if (wake_fragments) thaw_fragments();
+
+    if (particle_layout == LAYOUT_SOA) load_soa(&particles_soa, particles, NUM_PARTICLES);
+    if (particle_layout == LAYOUT_AOSOA) load_aosoa(&particles_aosoa, particles, NUM_PARTICLES);
+
+    for (int s = 0; s < solver.substeps; s++) {
+        substep_simulation(dt / solver.substeps);
+    }
+
+    if (particle_layout == LAYOUT_SOA) store_soa(&particles_soa, particles, NUM_PARTICLES);
+    if (particle_layout == LAYOUT_AOSOA) store_aosoa(&particles_aosoa, particles, NUM_PARTICLES);
+
+    float damping = fast_settle ? SETTLE_DAMPING : current_material.damping;
+    float max_speed_sq = 0;
+    if (num_fragments > 1) {
+        damp_fragment_motion(dt / solver.substeps, powf(damping, dt * 60.0f));
+        for (int f = 0; f < num_fragments; f++) max_speed_sq = fmaxf(max_speed_sq, fragments[f].speed_sq);
+    } else {
+        max_speed_sq = damp_relative_motion(dt / solver.substeps, powf(damping, dt * 60.0f));
+        fragments[0].speed_sq = max_speed_sq;
+    }
+    quiet_frames = (max_speed_sq < SLEEP_SPEED * SLEEP_SPEED) ? quiet_frames + 1 : 0;
+    if (quiet_frames >= SLEEP_FRAMES && num_force_fields == 0) cloth_asleep = true;
+
+    if (tearing) tear_constraints();
+    update_fragments();
+    recover_non_finite();
+    metric_set(&sim_metrics.constraints, (Uint64)num_constraints);
+}
+
+// Domain decomposition across processes. Each rank owns a band of rows and
+// steps only those; the vertical constraints crossing a band edge are solved
+// by both neighbours, each moving only its own particle, with the halo row
+// refreshed before every solver iteration. Rank 0 drives the others with a
+// per-step command and gathers their bands for rendering.
+//
+// Ranks talk through a Transport so the shared-memory mailboxes below can be
+// swapped for a socket implementation without touching the solver.
+struct Transport {
+    bool (*send)(Transport* t, int peer, int tag, const void* data, int size);
+    bool (*recv)(Transport* t, int peer, int tag, void* data, int size);
+    void (*abort)(Transport* t); // fail every rank's pending and later send/recv
+    void (*close)(Transport* t);
+    int rank;
+    int num_ranks;
+    void* impl;
+};
+
+enum {
+    DOMAIN_TAG_COMMAND = 1,
+    DOMAIN_TAG_HALO,
+    DOMAIN_TAG_BAND
+};
+
+typedef struct {
+    float dt;
+    int mouse_x, mouse_y;
+    int mouse_down;
+    int material;
+    int quit;
+} DomainCommand;
+
+#define MAX_DOMAINS 16
+#define DOMAIN_MAILBOX_CAPACITY (NUM_PARTICLES * 2 * (int)sizeof(float))
+
+Transport* domain_transport = NULL;
+int domain_row_begin, domain_row_end;
+Constraint domain_constraints[NUM_CONSTRAINTS];
+int num_domain_constraints = 0;
+
+#ifdef __linux__
+// One single-slot mailbox per (sender, receiver) pair. "full" doubles as the
+// futex word: senders wait for 0, receivers wait for 1. An abort sets it to 2
+// in every mailbox, which neither side waits for.
+typedef struct {
+    uint32_t full;
+    int tag;
+    int size;
+    uint32_t aborted;
+    unsigned char data[DOMAIN_MAILBOX_CAPACITY];
+} Mailbox;
+
+typedef struct {
+    Mailbox* boxes;
+    size_t bytes;
+    char name[64];
+    bool owner;
+} ShmTransport;
+
+void futex_wait(uint32_t* word, uint32_t expected) {
+    syscall(SYS_futex, word, FUTEX_WAIT, expected, NULL, NULL, 0);
+}
+
+void futex_wake(uint32_t* word) {
+    syscall(SYS_futex, word, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+
+Mailbox* shm_mailbox(Transport* t, int from, int to) {
+    return &((ShmTransport*)t->impl)->boxes[from * t->num_ranks + to];
+}
+
+bool shm_send(Transport* t, int peer, int tag, const void* data, int size) {
+    if (size > DOMAIN_MAILBOX_CAPACITY) return false;
+    Mailbox* box = shm_mailbox(t, t->rank, peer);
+    uint32_t full;
+    while ((full = __atomic_load_n(&box->full, __ATOMIC_ACQUIRE)) != 0) {
+        if (__atomic_load_n(&box->aborted, __ATOMIC_ACQUIRE)) return false;
+        futex_wait(&box->full, full);
+    }
+    box->tag = tag;
+    box->size = size;
+    memcpy(box->data, data, size);
+    __atomic_store_n(&box->full, 1, __ATOMIC_RELEASE);
+    futex_wake(&box->full);
+    return true;
+}
+
+bool shm_recv(Transport* t, int peer, int tag, void* data, int size) {
+    Mailbox* box = shm_mailbox(t, peer, t->rank);
+    uint32_t full;
+    while ((full = __atomic_load_n(&box->full, __ATOMIC_ACQUIRE)) != 1) {
+        if (__atomic_load_n(&box->aborted, __ATOMIC_ACQUIRE)) return false;
+        futex_wait(&box->full, full);
+    }
+    bool ok = box->tag == tag && box->size == size;
+    if (ok) memcpy(data, box->data, size);
+    __atomic_store_n(&box->full, 0, __ATOMIC_RELEASE);
+    futex_wake(&box->full);
+    return ok;
+}
+
+void shm_abort(Transport* t) {
+    for (int i = 0; i < t->num_ranks * t->num_ranks; i++) {
+        Mailbox* box = &((ShmTransport*)t->impl)->boxes[i];
+        __atomic_store_n(&box->aborted, 1, __ATOMIC_RELEASE);
+        __atomic_store_n(&box->full, 2, __ATOMIC_RELEASE);
+        futex_wake(&box->full);
+    }
+}
+
+void shm_close(Transport* t) {
+    ShmTransport* shm = t->impl;
+    munmap(shm->boxes, shm->bytes);
+    if (shm->owner) shm_unlink(shm->name);
+    free(shm);
+    free(t);
+}
+
+// Rank 0 creates the segment; other ranks wait for it to appear
+Transport* shm_transport_open(const char* name, int rank, int num_ranks) {
+    ShmTransport* shm = calloc(1, sizeof(ShmTransport));
+    Transport* t = calloc(1, sizeof(Transport));
+    if (!shm || !t) {
+        free(shm);
+        free(t);
+        return NULL;
+    }
+    snprintf(shm->name, sizeof(shm->name), "%s", name);
+    shm->bytes = sizeof(Mailbox) * num_ranks * num_ranks;
+    shm->owner = (rank == 0);
+
+    int fd = -1;
+    if (shm->owner) {
+        shm_unlink(name);
+        fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0600);
+        if (fd >= 0 && ftruncate(fd, shm->bytes) != 0) {
+            close(fd);
+            fd = -1;
+        }
+    } else {
+        for (int attempt = 0; attempt < 500 && fd < 0; attempt++) {
+            struct stat st;
+            fd = shm_open(name, O_RDWR, 0600);
+            if (fd >= 0 && (fstat(fd, &st) != 0 || (size_t)st.st_size < shm->bytes)) {
+                close(fd);
+                fd = -1;
+            }
+            if (fd < 0) SDL_Delay(10);
+        }
+    }
+    if (fd < 0) {
+        free(shm);
+        free(t);
+        return NULL;
+    }
+    shm->boxes = mmap(NULL, shm->bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (shm->boxes == MAP_FAILED) {
+        free(shm);
+        free(t);
+        return NULL;
+    }
+
+    t->send = shm_send;
+    t->recv = shm_recv;
+    t->abort = shm_abort;
+    t->close = shm_close;
+    t->rank = rank;
+    t->num_ranks = num_ranks;
+    t->impl = shm;
+    return t;
+}
+#else
+Transport* shm_transport_open(const char* name, int rank, int num_ranks) {
+    fprintf(stderr, "domains: shared-memory transport needs Linux futexes\n");
+    return NULL;
+}
+#endif
+
+// Rows owned by a rank, and the constraints it solves (everything touching
+// an owned particle, including the vertical links into the halo rows)
+void domain_setup(Transport* t) {
+    domain_transport = t;
+    domain_row_begin = t->rank * GRID_HEIGHT / t->num_ranks;
+    domain_row_end = (t->rank + 1) * GRID_HEIGHT / t->num_ranks;
+    Particle* first = &particles[domain_row_begin * GRID_WIDTH];
+    Particle* last = &particles[domain_row_end * GRID_WIDTH];
+    num_domain_constraints = 0;
+    for (int i = 0; i < NUM_CONSTRAINTS; i++) {
+        Constraint* c = &constraints[i];
+        bool owns1 = c->p1 >= first && c->p1 < last;
+        bool owns2 = c->p2 >= first && c->p2 < last;
+        if (owns1 || owns2) domain_constraints[num_domain_constraints++] = *c;
+    }
+}
+
+// A lost or mismatched message leaves the bands out of step for good: stop
+// every rank and exit with an error
+void domain_fail(Transport* t, int peer, const char* what) {
+    fprintf(stderr, "domains: rank %d: %s rank %d, stopping all ranks\n", t->rank, what, peer);
+    t->abort(t);
+#ifdef __linux__
+    if (t->rank == 0) {
+        while (wait(NULL) > 0) {}
+    }
+#endif
+    t->close(t);
+    exit(1);
+}
+
+void domain_send_row(Transport* t, int peer, int row) {
+    float buffer[GRID_WIDTH * 2];
+    for (int x = 0; x < GRID_WIDTH; x++) {
+        buffer[2 * x] = particles[row * GRID_WIDTH + x].x;
+        buffer[2 * x + 1] = particles[row * GRID_WIDTH + x].y;
+    }
+    if (!t->send(t, peer, DOMAIN_TAG_HALO, buffer, sizeof(buffer))) domain_fail(t, peer, "cannot send to");
+}
+
+void domain_recv_rows(Transport* t, int peer, int tag, int row_begin, int row_end) {
+    static float buffer[NUM_PARTICLES * 2];
+    int count = (row_end - row_begin) * GRID_WIDTH;
+    if (!t->recv(t, peer, tag, buffer, count * 2 * (int)sizeof(float))) {
+        domain_fail(t, peer, "lost or unexpected message from");
+    }
+    for (int i = 0; i < count; i++) {
+        particles[row_begin * GRID_WIDTH + i].x = buffer[2 * i];
+        particles[row_begin * GRID_WIDTH + i].y = buffer[2 * i + 1];
+    }
+}
+
+void domain_exchange_halo(Transport* t) {
+    int up = t->rank - 1, down = t->rank + 1;
+    if (up >= 0) domain_send_row(t, up, domain_row_begin);
+    if (down < t->num_ranks) domain_send_row(t, down, domain_row_end - 1);
+    if (up >= 0) domain_recv_rows(t, up, DOMAIN_TAG_HALO, domain_row_begin - 1, domain_row_begin);
+    if (down < t->num_ranks) domain_recv_rows(t, down, DOMAIN_TAG_HALO, domain_row_end, domain_row_end + 1);
+}
+
+// One step of this rank's band, then the bands are gathered on rank 0
+void domain_step(Transport* t, float dt) {
+    float h = dt / solver.substeps;
+    for (int s = 0; s < solver.substeps; s++) {
+        for (int i = domain_row_begin * GRID_WIDTH; i < domain_row_end * GRID_WIDTH; i++) {
+            current_material.apply_force(&particles[i], h);
+        }
+        if (mouse_down) drag_particle_range(domain_row_begin * GRID_WIDTH, domain_row_end * GRID_WIDTH);
+
+        for (int j = 0; j < solver.iterations; j++) {
+            domain_exchange_halo(t);
+            for (int i = 0; i < num_domain_constraints; i++) {
+                Constraint* c = &domain_constraints[i];
+                current_material.solve_constraint(c->p1, c->p2, c->rest_length);
+            }
+        }
+    }
+
+    if (t->rank == 0) {
+        for (int r = 1; r < t->num_ranks; r++) {
+            domain_recv_rows(t, r, DOMAIN_TAG_BAND, r * GRID_HEIGHT / t->num_ranks,
+                (r + 1) * GRID_HEIGHT / t->num_ranks);
+        }
+    } else {
+        static float buffer[NUM_PARTICLES * 2];
+        int count = (domain_row_end - domain_row_begin) * GRID_WIDTH;
+        for (int i = 0; i < count; i++) {
+            buffer[2 * i] = particles[domain_row_begin * GRID_WIDTH + i].x;
+            buffer[2 * i + 1] = particles[domain_row_begin * GRID_WIDTH + i].y;
+        }
+        if (!t->send(t, 0, DOMAIN_TAG_BAND, buffer, count * 2 * (int)sizeof(float))) {
+            domain_fail(t, 0, "cannot send to");
+        }
+    }
+}
+
+// Rank 0: broadcast this step's inputs, then step its own band
+void domain_step_root(float dt, bool quit) {
+    Transport* t = domain_transport;
+    DomainCommand command = {dt, mouse.x, mouse.y, mouse_down, current_material_index, quit};
+    for (int r = 1; r < t->num_ranks; r++) {
+        if (!t->send(t, r, DOMAIN_TAG_COMMAND, &command, sizeof(command))) domain_fail(t, r, "cannot send to");
+    }
+    if (!quit) domain_step(t, dt);
+}
+
+// Ranks > 0 run headless, driven entirely by rank 0's commands
+int domain_worker(Transport* t) {
+    init_particles();
+    init_constraints();
+    settle_cloth();
+    domain_setup(t);
+    DomainCommand command;
+    while (true) {
+        if (!t->recv(t, 0, DOMAIN_TAG_COMMAND, &command, sizeof(command))) {
+            domain_fail(t, 0, "lost or unexpected message from");
+        }
+        if (command.quit) break;
+        mouse.x = command.mouse_x;
+        mouse.y = command.mouse_y;
+        mouse_down = command.mouse_down;
+        if (command.material != current_material_index) select_material(MATERIALS[command.material]);
+        domain_step(t, command.dt);
+    }
+    t->close(t);
+    return 0;
+}
+
+// Join (or with rank 0 create) the shared segment. Without an explicit rank,
+// rank 0 forks the other ranks itself so a single command line runs them all.
+bool domain_start(const char* name, int num_ranks, int rank) {
+    if (num_ranks < 2 || num_ranks > MAX_DOMAINS || num_ranks > GRID_HEIGHT) {
+        fprintf(stderr, "domains: need 2..%d ranks\n", MAX_DOMAINS);
+        return false;
+    }
+    bool spawn = rank < 0;
+    Transport* t = shm_transport_open(name, spawn ? 0 : rank, num_ranks);
+    if (!t) {
+        fprintf(stderr, "domains: cannot open shared segment %s\n", name);
+        return false;
+    }
+#ifdef __linux__
+    if (spawn) {
+        for (int r = 1; r < num_ranks; r++) {
+            if (fork() == 0) {
+                t->rank = r;
+                ((ShmTransport*)t->impl)->owner = false;
+                exit(domain_worker(t));
+            }
+        }
+    }
+#endif
+    if (t->rank != 0) exit(domain_worker(t));
+    domain_transport = t;
+    return true;
+}
+
+void domain_stop() {
+    if (!domain_transport) return;
+    domain_step_root(0, true);
+    domain_transport->close(domain_transport);
+    domain_transport = NULL;
+#ifdef __linux__
+    while (wait(NULL) > 0) {}
+#endif
+}
+
+// Render snapshots: what the renderer needs from a step, 4 bytes per particle
+// instead of a whole Particle. Positions are 12.4 fixed point relative to the
+// viewport origin (+-2048 px, 1/16 px steps), saturated at the edges. Three
+// buffers rotate through a single atomic pointer swap; the low bit of the
+// shared pointer marks a snapshot the renderer has not picked up yet.
+#define SNAPSHOT_FRACTION_BITS 4
+
+typedef struct {
+    Sint16 x, y;
+} SnapshotPoint;
+
+typedef struct {
+    SnapshotPoint points[NUM_PARTICLES];
+    Uint32 locked_bits[(NUM_PARTICLES + 31) / 32]; // pins, not frozen fragments
+    Uint32 hidden_bits[(NUM_PARTICLES + 31) / 32]; // culled particles
+    Uint32 edge_bits[(NUM_CONSTRAINTS + 31) / 32]; // drawn all_constraints
+    Uint32 frame;
+} RenderSnapshot;
+
+RenderSnapshot snapshot_buffers[3];
+RenderSnapshot* snapshot_back = &snapshot_buffers[0];  // owned by the simulation
+void* snapshot_shared = &snapshot_buffers[1];          // exchanged
+RenderSnapshot* snapshot_front = &snapshot_buffers[2]; // owned by the renderer
+const RenderSnapshot* snapshot_published = &snapshot_buffers[1]; // read-only until the next publish
+int render_lod = 0; // 1 keeps every other grid line and only the pins
+Uint32 snapshot_frame = 0;
+
+// Quantize particles[] four at a time: scale, round, then pack x/y pairs to
+// 16 bits with signed saturation
+void snapshot_publish() {
+    RenderSnapshot* snapshot = snapshot_back;
+    const float scale = (float)(1 << SNAPSHOT_FRACTION_BITS);
+    const __m128 scale4 = _mm_set1_ps(scale);
+    const __m128 origin_x = _mm_set1_ps(view_x), origin_y = _mm_set1_ps(view_y);
+    int i = 0;
+    for (; i + 4 <= NUM_PARTICLES; i += 4) {
+        const Particle* p = &particles[i];
+        __m128 x = _mm_setr_ps(p[0].x, p[1].x, p[2].x, p[3].x);
+        __m128 y = _mm_setr_ps(p[0].y, p[1].y, p[2].y, p[3].y);
+        __m128i xi = _mm_cvtps_epi32(_mm_mul_ps(_mm_sub_ps(x, origin_x), scale4));
+        __m128i yi = _mm_cvtps_epi32(_mm_mul_ps(_mm_sub_ps(y, origin_y), scale4));
+        __m128i pairs = _mm_packs_epi32(_mm_unpacklo_epi32(xi, yi), _mm_unpackhi_epi32(xi, yi));
+        _mm_storeu_si128((__m128i*)&snapshot->points[i], pairs);
+    }
+    for (; i < NUM_PARTICLES; i++) {
+        float x = fminf(fmaxf((particles[i].x - view_x) * scale, -32768.0f), 32767.0f);
+        float y = fminf(fmaxf((particles[i].y - view_y) * scale, -32768.0f), 32767.0f);
+        snapshot->points[i] = (SnapshotPoint){(Sint16)lrintf(x), (Sint16)lrintf(y)};
+    }
+    memset(snapshot->locked_bits, 0, sizeof(snapshot->locked_bits));
+    memset(snapshot->hidden_bits, 0, sizeof(snapshot->hidden_bits));
+    for (i = 0; i < NUM_PARTICLES; i++) {
+        if (particles[i].locked && !particle_frozen[i]) snapshot->locked_bits[i / 32] |= 1u << (i % 32);
+        if (fragments[particle_fragment[i]].culled) snapshot->hidden_bits[i / 32] |= 1u << (i % 32);
+    }
+    memset(snapshot->edge_bits, 0, sizeof(snapshot->edge_bits));
+    for (i = 0; i < NUM_CONSTRAINTS; i++) {
+        int a = all_constraint_indices[i].a;
+        if (constraint_torn[i] || fragments[particle_fragment[a]].culled) continue;
+        if (render_lod > 0) {
+            bool horizontal = all_constraint_indices[i].b == a + 1;
+            if ((horizontal ? a / GRID_WIDTH : a % GRID_WIDTH) % 2 != 0) continue;
+        }
+        snapshot->edge_bits[i / 32] |= 1u << (i % 32);
+    }
+    if (render_lod > 0) {
+        for (i = 0; i < (NUM_PARTICLES + 31) / 32; i++) snapshot->hidden_bits[i] |= ~snapshot->locked_bits[i];
+    }
+    snapshot->frame = ++snapshot_frame;
+    snapshot_published = snapshot;
+
+    void* previous = SDL_AtomicSetPtr(&snapshot_shared, (void*)((uintptr_t)snapshot | 1));
+    snapshot_back = (RenderSnapshot*)((uintptr_t)previous & ~(uintptr_t)1);
+}
+
+// Latest published snapshot; keeps the current one if nothing new arrived
+const RenderSnapshot* snapshot_acquire() {
+    if ((uintptr_t)SDL_AtomicGetPtr(&snapshot_shared) & 1) {
+        void* latest = SDL_AtomicSetPtr(&snapshot_shared, snapshot_front);
+        snapshot_front = (RenderSnapshot*)((uintptr_t)latest & ~(uintptr_t)1);
+    }
+    return snapshot_front;
+}
+
+// Draws the latest render snapshot; never touches particles[]
+void render_cloth(SDL_Renderer *renderer) {
+    const RenderSnapshot* s = snapshot_acquire();
+    const int shift = SNAPSHOT_FRACTION_BITS;
+
+    // Draw constraints
+    SDL_SetRenderDrawColor(renderer, 200, 200, 200, 255);
+    for (int i = 0; i < NUM_CONSTRAINTS; i++) {
+        if (!(s->edge_bits[i / 32] & (1u << (i % 32)))) continue;
+        SnapshotPoint a = s->points[all_constraint_indices[i].a];
+        SnapshotPoint b = s->points[all_constraint_indices[i].b];
+        SDL_RenderDrawLine(renderer, 
+            a.x >> shift, a.y >> shift, 
+            b.x >> shift, b.y >> shift);
+    }
+    
+    // Draw particles
+    for (int i = 0; i < NUM_PARTICLES; i++) {
+        if (s->hidden_bits[i / 32] & (1u << (i % 32))) continue;
+        if (s->locked_bits[i / 32] & (1u << (i % 32))) {
+            SDL_SetRenderDrawColor(renderer, 255, 0, 0, 255);
+        } else {
+            SDL_SetRenderDrawColor(renderer, 100, 100, 100, 255);
+        }
+        SDL_Rect rect = {(s->points[i].x >> shift) - 2, (s->points[i].y >> shift) - 2, 4, 4};
+        SDL_RenderFillRect(renderer, &rect);
+    }
+}
+
+// Software rasterizer (--software-render). The snapshot is drawn into a CPU
+// framebuffer by the thread pool, each thread taking a band of rows and
+// clipping every line and particle to it, then uploaded with one
+// SDL_UpdateTexture into a streaming texture. That replaces thousands of
+// SDL_RenderDrawLine / SDL_RenderFillRect calls, each with driver overhead,
+// by a single upload of the framebuffer. Only the upload is independent of
+// the cloth: every band still walks all edges and particles, so the drawing
+// costs O(threads * (edges + particles)) in total.
+#define RASTER_EDGE_COLOR 0xFFC8C8C8u
+#define RASTER_PIN_COLOR 0xFFFF0000u
+#define RASTER_PARTICLE_COLOR 0xFF646464u
+
+bool software_render = false;
+SDL_Texture* raster_texture = NULL;
+Uint32 raster_pixels[SCREEN_WIDTH * SCREEN_HEIGHT]; // ARGB8888
+
+// Bresenham line, plotting only the pixels in rows [first, last)
+void raster_line(int first, int last, int x0, int y0, int x1, int y1, Uint32 color) {
+    if ((y0 < first && y1 < first) || (y0 >= last && y1 >= last)) return;
+    int dx = abs(x1 - x0), dy = -abs(y1 - y0);
+    int step_x = x0 < x1 ? 1 : -1, step_y = y0 < y1 ? 1 : -1;
+    int error = dx + dy;
+    for (;;) {
+        if (y0 >= first && y0 < last && x0 >= 0 && x0 < SCREEN_WIDTH) {
+            raster_pixels[y0 * SCREEN_WIDTH + x0] = color;
+        }
+        if (x0 == x1 && y0 == y1) break;
+        int twice = 2 * error;
+        if (twice >= dy) {
+            error += dy;
+            x0 += step_x;
+        }
+        if (twice <= dx) {
+            error += dx;
+            y0 += step_y;
+        }
+    }
+}
+
+// Clears and draws rows [first, last) of the framebuffer, in render_cloth's
+// order and colors
+void raster_rows(int first, int last, void* context) {
+    const RenderSnapshot* s = context;
+    const int shift = SNAPSHOT_FRACTION_BITS;
+    memset(&raster_pixels[first * SCREEN_WIDTH], 0, sizeof(Uint32) * SCREEN_WIDTH * (last - first));
+    for (int i = 0; i < NUM_CONSTRAINTS; i++) {
+        if (!(s->edge_bits[i / 32] & (1u << (i % 32)))) continue;
+        SnapshotPoint a = s->points[all_constraint_indices[i].a];
+        SnapshotPoint b = s->points[all_constraint_indices[i].b];
+        raster_line(first, last, a.x >> shift, a.y >> shift, b.x >> shift, b.y >> shift, RASTER_EDGE_COLOR);
+    }
+    for (int i = 0; i < NUM_PARTICLES; i++) {
+        if (s->hidden_bits[i / 32] & (1u << (i % 32))) continue;
+        int x = (s->points[i].x >> shift) - 2, y = (s->points[i].y >> shift) - 2;
+        int top = y > first ? y : first, bottom = y + 4 < last ? y + 4 : last;
+        int left = x > 0 ? x : 0, right = x + 4 < SCREEN_WIDTH ? x + 4 : SCREEN_WIDTH;
+        if (top >= bottom || left >= right) continue;
+        Uint32 color = (s->locked_bits[i / 32] & (1u << (i % 32))) ? RASTER_PIN_COLOR : RASTER_PARTICLE_COLOR;
+        for (int row = top; row < bottom; row++) {
+            for (int col = left; col < right; col++) raster_pixels[row * SCREEN_WIDTH + col] = color;
+        }
+    }
+}
+
+// Creates the streaming texture; false leaves the primitive path in use
+bool raster_start(SDL_Renderer* renderer) {
+    raster_texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING,
+        SCREEN_WIDTH, SCREEN_HEIGHT);
+    return raster_texture != NULL;
+}
+
+void raster_stop() {
+    if (raster_texture) SDL_DestroyTexture(raster_texture);
+    raster_texture = NULL;
+}
+
+// Draws the latest render snapshot through the framebuffer
+void render_cloth_raster(SDL_Renderer* renderer) {
+    parallel_for(SCREEN_HEIGHT, raster_rows, (void*)snapshot_acquire());
+    SDL_UpdateTexture(raster_texture, NULL, raster_pixels, SCREEN_WIDTH * (int)sizeof(Uint32));
+    SDL_RenderCopy(renderer, raster_texture, NULL, NULL);
+}
+
+// Flight recorder, always on unless --flight-seconds 0. The last
+// flight_seconds of frames (counted at FLIGHT_FPS) stay in a fixed ring:
+// timings, dt, input and the quantized render snapshot. The ring is written
+// out on F12, FLIGHT_TRAILING_FRAMES after a frame whose work took longer than
+// --flight-spike ms (so the dump shows what followed too), and from the crash
+// handler, so a hitch or a crash can be examined and its input replayed. A
+// dump copies the ring, oldest frame first, into a second buffer and a
+// writer thread writes and closes the file, so the frame loop only pays for
+// the copy; a dump asked for while the last is still being written is
+// skipped.
+#define FLIGHT_FPS 60
+#define FLIGHT_TRAILING_FRAMES 30
+
+typedef struct {
+    char magic[8];        // "CLTHFLIT"
+    Uint32 version;
+    Uint32 particles;
+    Uint32 grid_width, grid_height;
+    Uint32 fraction_bits; // of the quantized positions
+    Uint32 frames;        // that follow, oldest first
+    Uint32 trigger_frame; // the spike, the F12 press or the crash
+} FlightHeader;
+
+typedef struct {
+    Uint32 frame;
+    float dt;               // 0 when the frame did not step
+    float step_ms, work_ms; // simulation; everything before the frame delay
+    float view_x, view_y;   // world position of the quantized origin
+    Sint16 mouse_x, mouse_y;
+    Uint8 mouse_down, material;
+    Uint16 fragments;
+    SnapshotPoint points[NUM_PARTICLES];
+} FlightFrame;
+
+int flight_seconds = 10;
+float flight_spike_ms = 50;
+const char* flight_dir = ".";
+FlightFrame* flight_ring = NULL;
+int flight_capacity = 0, flight_count = 0, flight_head = 0; // head: next slot
+Uint32 flight_frames = 0;
+Uint32 flight_dump_frame = 0, flight_trigger = 0;
+bool flight_dump_pending = false;
+Uint32 flight_quiet_until = 0; // one spike dump per ring's worth of frames
+char flight_crash_path[512];
+FlightFrame* flight_copy = NULL; // the ring as the writer thread writes it
+FlightHeader flight_copy_header;
+char flight_copy_path[512];
+SDL_Thread* flight_writer = NULL;
+SDL_atomic_t flight_writing;
+
+FlightHeader flight_header(Uint32 trigger) {
+    FlightHeader header = {{'C', 'L', 'T', 'H', 'F', 'L', 'I', 'T'}, 1, NUM_PARTICLES, GRID_WIDTH, GRID_HEIGHT,
+        SNAPSHOT_FRACTION_BITS, (Uint32)flight_count, trigger};
+    return header;
+}
+
+// Oldest frames first: the ring from head on, then from the start
+const FlightFrame* flight_span(int part, int* count) {
+    int oldest = flight_count < flight_capacity ? 0 : flight_head;
+    *count = part == 0 ? flight_count - oldest : oldest;
+    return part == 0 ? &flight_ring[oldest] : flight_ring;
+}
+
+// Only async-signal-safe calls: the process is already going down
+#ifdef _WIN32
+LONG WINAPI flight_crash(EXCEPTION_POINTERS* info) {
+    if (!flight_ring) return EXCEPTION_CONTINUE_SEARCH;
+    HANDLE file = CreateFileA(flight_crash_path, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE) return EXCEPTION_CONTINUE_SEARCH;
+    FlightHeader header = flight_header(flight_frames);
+    DWORD written;
+    WriteFile(file, &header, sizeof(header), &written, NULL);
+    for (int part = 0; part < 2; part++) {
+        int count;
+        const FlightFrame* frames = flight_span(part, &count);
+        if (count > 0) WriteFile(file, frames, (DWORD)(count * sizeof(FlightFrame)), &written, NULL);
+    }
+    CloseHandle(file);
+    return EXCEPTION_CONTINUE_SEARCH;
+}
+#else
+void flight_crash(int sig) {
+    int fd = flight_ring ? open(flight_crash_path, O_WRONLY | O_CREAT | O_TRUNC, 0644) : -1;
+    if (fd >= 0) {
+        FlightHeader header = flight_header(flight_frames);
+        bool ok = write(fd, &header, sizeof(header)) == (ssize_t)sizeof(header);
+        for (int part = 0; part < 2 && ok; part++) {
+            int count;
+            const FlightFrame* frames = flight_span(part, &count);
+            ok = count == 0 || write(fd, frames, count * sizeof(FlightFrame)) == (ssize_t)(count * sizeof(FlightFrame));
+        }
+        close(fd);
+    }
+    raise(sig); // SA_RESETHAND restored the default action
+}
+#endif
+
+bool flight_start() {
+    if (flight_seconds <= 0) return true;
+    flight_capacity = flight_seconds * FLIGHT_FPS;
+    flight_ring = malloc(sizeof(FlightFrame) * flight_capacity);
+    flight_copy = malloc(sizeof(FlightFrame) * flight_capacity);
+    if (!flight_ring || !flight_copy) {
+        free(flight_ring);
+        free(flight_copy);
+        flight_ring = flight_copy = NULL;
+        return false;
+    }
+    snprintf(flight_crash_path, sizeof(flight_crash_path), "%s/flight-crash.bin", flight_dir);
+#ifdef _WIN32
+    SetUnhandledExceptionFilter(flight_crash);
+#else
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = flight_crash;
+    sa.sa_flags = SA_RESETHAND;
+    sigemptyset(&sa.sa_mask);
+    const int signals[] = {SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT};
+    for (int i = 0; i < (int)SDL_arraysize(signals); i++) sigaction(signals[i], &sa, NULL);
+#endif
+    return true;
+}
+
+int flight_write(void* unused) {
+    const FlightHeader* header = &flight_copy_header;
+    FILE* f = fopen(flight_copy_path, "wb");
+    bool ok = f && fwrite(header, sizeof(*header), 1, f) == 1 &&
+        fwrite(flight_copy, sizeof(FlightFrame), header->frames, f) == header->frames;
+    if (f && fclose(f) != 0) ok = false;
+    fprintf(stderr, "flight recorder: %u frames to %s%s\n", (unsigned)header->frames, flight_copy_path,
+        ok ? "" : " (incomplete)");
+    SDL_AtomicSet(&flight_writing, 0);
+    return ok ? 0 : 1;
+}
+
+// Copies the ring and hands it to the writer thread; reason names the file
+bool flight_dump(const char* reason, Uint32 trigger) {
+    if (!flight_ring || flight_count == 0) return false;
+    if (SDL_AtomicGet(&flight_writing)) {
+        fprintf(stderr, "flight recorder: still writing %s, skipping this dump\n", flight_copy_path);
+        return false;
+    }
+    if (flight_writer) SDL_WaitThread(flight_writer, NULL); // already finished
+    snprintf(flight_copy_path, sizeof(flight_copy_path), "%s/flight-%u-%s.bin", flight_dir, (unsigned)trigger, reason);
+    flight_copy_header = flight_header(trigger);
+    int copied = 0;
+    for (int part = 0; part < 2; part++) {
+        int count;
+        const FlightFrame* frames = flight_span(part, &count);
+        memcpy(flight_copy + copied, frames, (size_t)count * sizeof(FlightFrame));
+        copied += count;
+    }
+    SDL_AtomicSet(&flight_writing, 1);
+    flight_writer = SDL_CreateThread(flight_write, "cloth flight", NULL);
+    if (!flight_writer) {
+        SDL_AtomicSet(&flight_writing, 0);
+        return false;
+    }
+    return true;
+}
+
+// Appends one frame (positions from the snapshot last published) and runs
+// the spike trigger
+void flight_record(float dt, Uint64 step_ticks, Uint64 work_ticks) {
+    if (!flight_ring) return;
+    const double ms_per_tick = 1000.0 / SDL_GetPerformanceFrequency();
+    FlightFrame* f = &flight_ring[flight_head];
+    f->frame = flight_frames;
+    f->dt = dt;
+    f->step_ms = (float)(step_ticks * ms_per_tick);
+    f->work_ms = (float)(work_ticks * ms_per_tick);
+    f->view_x = view_x;
+    f->view_y = view_y;
+    f->mouse_x = (Sint16)mouse.x;
+    f->mouse_y = (Sint16)mouse.y;
+    f->mouse_down = mouse_down;
+    f->material = (Uint8)current_material_index;
+    f->fragments = (Uint16)num_fragments;
+    memcpy(f->points, snapshot_published->points, sizeof(f->points));
+    flight_head = (flight_head + 1) % flight_capacity;
+    if (flight_count < flight_capacity) flight_count++;
+
+    if (f->work_ms > flight_spike_ms && !flight_dump_pending && flight_frames >= flight_quiet_until) {
+        flight_dump_pending = true;
+        flight_trigger = flight_frames;
+        flight_dump_frame = flight_frames + FLIGHT_TRAILING_FRAMES;
+    }
+    if (flight_dump_pending && flight_frames == flight_dump_frame) {
+        flight_dump("spike", flight_trigger);
+        flight_dump_pending = false;
+        flight_quiet_until = flight_frames + flight_capacity;
+    }
+    flight_frames++;
+}
+
+void flight_stop() {
+    if (flight_writer) SDL_WaitThread(flight_writer, NULL);
+    flight_writer = NULL;
+    free(flight_ring);
+    free(flight_copy);
+    flight_ring = flight_copy = NULL;
+}
+
+// Quality tiers. Under CPU pressure the viewer sheds detail rather than
+// frames: each tier divides the configured substeps and iterations further,
+// and the last one also draws the cloth coarsely (every other grid line,
+// pins only). The controller smooths the frame's work time (all of it but
+// the frame delay) against --quality-budget ms. It steps down a tier after
+// QUALITY_DEGRADE_FRAMES frames over budget, and back up only after
+// QUALITY_RESTORE_FRAMES frames under QUALITY_RESTORE_FRACTION of it; the
+// gap keeps it from flipping between two tiers. Tiers that would change
+// nothing for the configured solver are skipped. The reduced model's cost
+// does not depend on the solver, and its stiffness (projection_stiffness)
+// does, so under --reduced only the render tier is left. --fixed-quality
+// turns it off, and so does --record, whose trajectories must all come from
+// the configured solver for --fit.
+#define QUALITY_TIERS 4
+#define QUALITY_SMOOTHING 0.1
+#define QUALITY_DEGRADE_FRAMES 10
+#define QUALITY_RESTORE_FRAMES 120
+#define QUALITY_RESTORE_FRACTION 0.5
+
+typedef struct {
+    const char* name;
+    int substep_divisor, iteration_divisor;
+    int render_lod;
+} QualityTier;
+
+const QualityTier QUALITY[QUALITY_TIERS] = {
+    {"full", 1, 1, 0},
+    {"half substeps", 2, 1, 0},
+    {"quarter substeps, half iterations", 4, 2, 0},
+    {"coarse render", 4, 2, 1},
+};
+
+bool quality_enabled = true;
+double quality_budget_ms = 1000.0 / 60;
+int quality_tier = 0;
+SolverConfig quality_base; // the configured solver, tier 0
+double quality_work_ms = -1; // smoothed; negative until the first frame of a tier
+int quality_over_frames = 0, quality_under_frames = 0;
+
+// Solver and render settings of a tier, from the configured solver
+void quality_settings(int tier, SolverConfig* out, int* lod) {
+    *out = quality_base;
+    if (!reduced.enabled) {
+        out->substeps = quality_base.substeps / QUALITY[tier].substep_divisor;
+        out->iterations = quality_base.iterations / QUALITY[tier].iteration_divisor;
+    }
+    if (out->substeps < 1) out->substeps = 1;
+    if (out->iterations < 1) out->iterations = 1;
+    *lod = QUALITY[tier].render_lod;
+}
+
+bool quality_same(int a, int b) {
+    SolverConfig sa, sb;
+    int lod_a, lod_b;
+    quality_settings(a, &sa, &lod_a);
+    quality_settings(b, &sb, &lod_b);
+    return sa.substeps == sb.substeps && sa.iterations == sb.iterations && lod_a == lod_b;
+}
+
+void quality_apply(int tier) {
+    quality_tier = tier;
+    quality_settings(tier, &solver, &render_lod);
+    quality_work_ms = -1;
+    quality_over_frames = quality_under_frames = 0;
+    metric_set(&sim_metrics.quality_tier, (Uint64)tier);
+}
+
+void quality_start() {
+    quality_base = solver;
+    quality_apply(0);
+}
+
+// Once per frame with the frame's work time
+void quality_update(Uint64 work_ticks) {
+    if (!quality_enabled) return;
+    double ms = 1000.0 * work_ticks / SDL_GetPerformanceFrequency();
+    quality_work_ms = quality_work_ms < 0 ? ms : quality_work_ms + QUALITY_SMOOTHING * (ms - quality_work_ms);
+    quality_over_frames = quality_work_ms > quality_budget_ms ? quality_over_frames + 1 : 0;
+    quality_under_frames = quality_work_ms < QUALITY_RESTORE_FRACTION * quality_budget_ms ? quality_under_frames + 1 : 0;
+
+    int tier = quality_tier;
+    if (quality_over_frames >= QUALITY_DEGRADE_FRAMES) {
+        while (tier + 1 < QUALITY_TIERS && quality_same(++tier, quality_tier)) {}
+    } else if (quality_under_frames >= QUALITY_RESTORE_FRAMES) {
+        while (tier > 0 && quality_same(--tier, quality_tier)) {}
+    }
+    if (tier == quality_tier || quality_same(tier, quality_tier)) return;
+    fprintf(stderr, "quality: tier %d (%s), work %.1f ms against a %.1f ms budget\n",
+        tier, QUALITY[tier].name, quality_work_ms, quality_budget_ms);
+    quality_apply(tier);
+}
+
+// Error of each rsqrt accuracy against a double-precision reference, sampled
+// log-uniformly over the squared lengths the solver sees (1e-8 .. 1e8)
+int rsqrt_report() {
+    const char* names[] = {"exact", "approx", "newton1", "newton2"};
+    const int samples = 1 << 20;
+
+    printf("%-8s %14s %14s\n", "mode", "max rel err", "rms rel err");
+    for (int mode = RSQRT_EXACT; mode <= RSQRT_NEWTON2; mode++) {
+        double max_err = 0, sum_sq = 0;
+        for (int i = 0; i < samples; i++) {
+            float x = (float)pow(10.0, -8.0 + 16.0 * i / (samples - 1));
+            double ref = 1.0 / sqrt((double)x);
+            double err = fabs(rsqrt_refined(x, (RsqrtAccuracy)mode) - ref) / ref;
+            if (err > max_err) max_err = err;
+            sum_sq += err * err;
+        }
+        printf("%-8s %14.3e %14.3e\n", names[mode], max_err, sqrt(sum_sq / samples));
+    }
+    return 0;
+}
+
+// Time the layout kernels on a width x height grid. "grid" sweeps constraints
+// in row order, "recursive" in recursive-bisection order, "shuffled" in random
+// order to mimic an irregular mesh. Like the live step, the SoA and AoSoA
+// runs load their store from a Particle array and write it back every step;
+// that round trip is included in ns/step and also shown on its own.
+int bench_layouts(int width, int height, int steps) {
+    int count = width * height;
+    int num_edges = (width - 1) * height + width * (height - 1);
+    Particle* aos = _mm_malloc(sizeof(Particle) * count, 64);
+    ConstraintIndex* grid_order = malloc(sizeof(ConstraintIndex) * num_edges);
+    ConstraintIndex* shuffled = malloc(sizeof(ConstraintIndex) * num_edges);
+    ConstraintIndex* recursive = malloc(sizeof(ConstraintIndex) * num_edges);
+    Particle* initial = malloc(sizeof(Particle) * count);
+    Particle* frame = malloc(sizeof(Particle) * count);
+    ParticlesSoA soa;
+    ParticlesAoSoA aosoa;
+    memset(&soa, 0, sizeof(soa));
+    memset(&aosoa, 0, sizeof(aosoa));
+    if (!aos || !grid_order || !shuffled || !recursive || !initial || !frame || !alloc_soa(&soa, count) ||
+        !alloc_aosoa(&aosoa, count)) {
+        fprintf(stderr, "bench: out of memory\n");
+        free_soa(&soa);
+        free_aosoa(&aosoa);
+        _mm_free(aos);
+        free(grid_order);
+        free(shuffled);
+        free(recursive);
+        free(initial);
+        free(frame);
+        return 1;
+    }
+
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            Particle* p = &initial[y * width + x];
+            memset(p, 0, sizeof(*p));
+            p->x = p->old_x = x * PARTICLE_SPACING;
+            p->y = p->old_y = y * PARTICLE_SPACING;
+            p->mass = current_material.mass;
+            p->material = &current_material;
+            p->locked = (y == 0);
+        }
+    }
+    int index = 0;
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width - 1; x++) {
+            grid_order[index++] = (ConstraintIndex){y * width + x, y * width + x + 1, PARTICLE_SPACING};
+        }
+    }
+    for (int y = 0; y < height - 1; y++) {
+        for (int x = 0; x < width; x++) {
+            grid_order[index++] = (ConstraintIndex){y * width + x, (y + 1) * width + x, PARTICLE_SPACING};
+        }
+    }
+    emit_recursive_order(recursive, 0, width, height, 0, 0, width, height);
+    memcpy(shuffled, grid_order, sizeof(ConstraintIndex) * num_edges);
+    unsigned int seed = 12345;
+    for (int i = num_edges - 1; i > 0; i--) {
+        seed = seed * 1664525u + 1013904223u;
+        int j = (int)((seed >> 8) % (unsigned int)(i + 1));
+        ConstraintIndex tmp = shuffled[i];
+        shuffled[i] = shuffled[j];
+        shuffled[j] = tmp;
+    }
+
+    const float dt = 1.0f / 60.0f;
+    const char* orders[] = {"grid", "recursive", "shuffled"};
+    printf("%dx%d particles, %d constraints, %d steps, AoSoA width %d\n",
+        width, height, num_edges, steps, AOSOA_WIDTH);
+    printf("%-8s %-6s %12s %12s %12s\n", "order", "layout", "ns/step", "ns/particle", "copy ns");
+    for (int o = 0; o < 3; o++) {
+        const ConstraintIndex* c = (o == 0) ? grid_order : (o == 1) ? recursive : shuffled;
+        double ns[3], copy_ns[3];
+        for (int layout = LAYOUT_AOS; layout <= LAYOUT_AOSOA; layout++) {
+            ParticlesAoS aos_store = {aos};
+            if (layout == LAYOUT_AOS) memcpy(aos, initial, sizeof(Particle) * count);
+            memcpy(frame, initial, sizeof(Particle) * count);
+
+            Uint64 copy = 0;
+            Uint64 start = SDL_GetPerformanceCounter();
+            for (int step = 0; step < steps; step++) {
+                Uint64 copy_start = SDL_GetPerformanceCounter();
+                if (layout == LAYOUT_SOA) load_soa(&soa, frame, count);
+                if (layout == LAYOUT_AOSOA) load_aosoa(&aosoa, frame, count);
+                copy += SDL_GetPerformanceCounter() - copy_start;
+                if (layout == LAYOUT_AOS) {
+                    integrate_aos(&aos_store, count, &current_material, dt);
+                    for (int j = 0; j < SOLVER_ITERATIONS; j++) {
+                        solve_constraints_aos(&aos_store, c, num_edges, &current_material);
+                    }
+                } else if (layout == LAYOUT_SOA) {
+                    integrate_soa(&soa, count, &current_material, dt);
+                    for (int j = 0; j < SOLVER_ITERATIONS; j++) {
+                        solve_constraints_soa(&soa, c, num_edges, &current_material);
+                    }
+                } else {
+                    integrate_aosoa(&aosoa, count, &current_material, dt);
+                    for (int j = 0; j < SOLVER_ITERATIONS; j++) {
+                        solve_constraints_aosoa(&aosoa, c, num_edges, &current_material);
+                    }
+                }
+                copy_start = SDL_GetPerformanceCounter();
+                if (layout == LAYOUT_SOA) store_soa(&soa, frame, count);
+                if (layout == LAYOUT_AOSOA) store_aosoa(&aosoa, frame, count);
+                copy += SDL_GetPerformanceCounter() - copy_start;
+            }
+            Uint64 elapsed = SDL_GetPerformanceCounter() - start;
+            ns[layout] = 1e9 * elapsed / SDL_GetPerformanceFrequency() / steps;
+            copy_ns[layout] = 1e9 * copy / SDL_GetPerformanceFrequency() / steps;
+        }
+
+        // All layouts run the same arithmetic, so they must agree exactly
+        store_soa(&soa, initial, count);
+        float max_diff = 0;
+        for (int i = 0; i < count; i++) {
+            max_diff = fmaxf(max_diff, fabsf(initial[i].x - aos[i].x));
+            max_diff = fmaxf(max_diff, fabsf(AOSOA_X(&aosoa, i) - aos[i].x));
+        }
+        const char* names[] = {"aos", "soa", "aosoa"};
+        for (int layout = LAYOUT_AOS; layout <= LAYOUT_AOSOA; layout++) {
+            printf("%-8s %-6s %12.0f %12.2f %12.0f\n", orders[o], names[layout], ns[layout], ns[layout] / count,
+                copy_ns[layout]);
+        }
+        printf("%-8s max layout difference %g\n", orders[o], max_diff);
+
+        // Reset the reference grid for the next ordering
+        for (int i = 0; i < count; i++) {
+            initial[i].x = initial[i].old_x = (i % width) * PARTICLE_SPACING;
+            initial[i].y = initial[i].old_y = (i / width) * PARTICLE_SPACING;
+            initial[i].vx = initial[i].vy = 0;
+        }
+    }
+
+    free_soa(&soa);
+    free_aosoa(&aosoa);
+    _mm_free(aos);
+    free(grid_order);
+    free(shuffled);
+    free(recursive);
+    free(initial);
+    free(frame);
+    return 0;
+}
+
+// Scene/solver config files: "key = value" lines, '#' starts a comment
+bool load_config(const char* path) {
+    FILE* f = fopen(path, "r");
+    if (!f) {
+        fprintf(stderr, "config: cannot open %s\n", path);
+        return false;
+    }
+    char line[512];
+    int line_number = 0;
+    bool ok = true;
+    while (fgets(line, sizeof(line), f)) {
+        line_number++;
+        line[strcspn(line, "#\r\n")] = '\0';
+        char key[64], value[256];
+        if (sscanf(line, " %63[^= ] = %255s", key, value) != 2) continue;
+
+        if (strcmp(key, "iterations") == 0) solver.iterations = atoi(value);
+        else if (strcmp(key, "substeps") == 0) solver.substeps = atoi(value);
+        else if (strcmp(key, "relaxation") == 0) solver.relaxation = (float)atof(value);
+        else if (strcmp(key, "threads") == 0) solver.threads = atoi(value);
+        else if (strcmp(key, "fast_settle") == 0) fast_settle = atoi(value) != 0;
+        else if (strcmp(key, "settle") == 0) settle_start = atoi(value) != 0;
+        else if (strcmp(key, "tear") == 0) tearing = atoi(value) != 0;
+        else if (strcmp(key, "reduced") == 0) reduced_modes = atoi(value);
+        else if (strcmp(key, "force_field") == 0) ok = force_field_add(value) && ok;
+        else if (strcmp(key, "broad_phase") == 0) {
+            if (strcmp(value, "brute") == 0) broad_phase_mode = BROAD_PHASE_BRUTE;
+            else if (strcmp(value, "sap") == 0) broad_phase_mode = BROAD_PHASE_SAP;
+            else ok = false;
+        }
+        else if (strcmp(key, "wide_batches") == 0) wide_batches = atoi(value) != 0;
+        else if (strcmp(key, "settle_cache") == 0) settle_cache_dir = strdup(value);
+        else if (strcmp(key, "pins") == 0) {
+            if (strcmp(value, "top") == 0) pin_mode = PINS_TOP_ROW;
+            else if (strcmp(value, "corners") == 0) pin_mode = PINS_CORNERS;
+            else ok = false;
+        } else if (strcmp(key, "collider") == 0) {
+            Collider c;
+            if (num_colliders < MAX_COLLIDERS && sscanf(value, "%f,%f,%f", &c.x, &c.y, &c.radius) == 3 && c.radius > 0) {
+                colliders[num_colliders++] = c;
+            } else {
+                fprintf(stderr, "config: %s:%d: bad collider '%s' (want x,y,radius; at most %d)\n",
+                    path, line_number, value, MAX_COLLIDERS);
+                ok = false;
+            }
+        }
+        else if (strcmp(key, "sweep_order") == 0) {
+            if (strcmp(value, "rows") == 0) sweep_order = SWEEP_ROWS;
+            else if (strcmp(value, "recursive") == 0) sweep_order = SWEEP_RECURSIVE;
+            else ok = false;
+        }
+        else if (strcmp(key, "material") == 0) {
+            if (strcmp(value, "cotton") == 0) current_material_index = 0;
+            else if (strcmp(value, "silk") == 0) current_material_index = 1;
+            else if (strcmp(value, "denim") == 0) current_material_index = 2;
+            else ok = false;
+        } else {
+            fprintf(stderr, "config: %s:%d: unknown key '%s'\n", path, line_number, key);
+            ok = false;
+        }
+    }
+    fclose(f);
+    if (solver.iterations < 1) solver.iterations = 1;
+    if (solver.substeps < 1) solver.substeps = 1;
+    if (solver.threads < 1) solver.threads = 1;
+    return ok;
+}
+
+bool write_config(const char* path, const char* comment) {
+    const char* material_names[] = {"cotton", "silk", "denim"};
+    FILE* f = fopen(path, "w");
+    if (!f) {
+        fprintf(stderr, "config: cannot write %s\n", path);
+        return false;
+    }
+    if (comment) fprintf(f, "# %s\n", comment);
+    fprintf(f, "material = %s\n", material_names[current_material_index]);
+    fprintf(f, "iterations = %d\n", solver.iterations);
+    fprintf(f, "substeps = %d\n", solver.substeps);
+    fprintf(f, "relaxation = %.9g\n", solver.relaxation);
+    fprintf(f, "threads = %d\n", solver.threads);
+    fprintf(f, "sweep_order = %s\n", sweep_order == SWEEP_RECURSIVE ? "recursive" : "rows");
+    fprintf(f, "fast_settle = %d\n", fast_settle ? 1 : 0);
+    fprintf(f, "settle = %d\n", settle_start ? 1 : 0);
+    fprintf(f, "tear = %d\n", tearing ? 1 : 0);
+    fprintf(f, "pins = %s\n", pin_mode == PINS_CORNERS ? "corners" : "top");
+    fprintf(f, "broad_phase = %s\n", broad_phase_mode == BROAD_PHASE_SAP ? "sap" : "brute");
+    fprintf(f, "wide_batches = %d\n", wide_batches ? 1 : 0);
+    fprintf(f, "reduced = %d\n", reduced_modes);
+    if (settle_cache_dir) fprintf(f, "settle_cache = %s\n", settle_cache_dir);
+    for (int i = 0; i < num_colliders; i++) {
+        fprintf(f, "collider = %.9g,%.9g,%.9g\n", colliders[i].x, colliders[i].y, colliders[i].radius);
+    }
+    for (int i = 0; i < num_force_fields; i++) fprintf(f, "force_field = %s\n", force_fields[i].spec);
+    fclose(f);
+    return true;
+}
+
+// Total energy: per-particle kinetic + gravity from the material law, plus
+// the spring energy stored in every constraint
+double total_energy() {
+    double energy = 0;
+    for (int i = 0; i < NUM_PARTICLES; i++) {
+        energy += current_material.calc_energy(&particles[i], NULL, 0);
+    }
+    for (int i = 0; i < num_constraints; i++) {
+        Constraint* c = &constraints[i];
+        float dx = c->p2->x - c->p1->x, dy = c->p2->y - c->p1->y;
+        float stretch = sqrtf(dx * dx + dy * dy) - c->rest_length;
+        energy += 0.5 * current_material.stiffness * stretch * stretch;
+    }
+    return energy;
+}
+
+// Mean |length - rest| / rest over the active constraints
+double constraint_residual() {
+    double sum = 0;
+    for (int i = 0; i < num_constraints; i++) {
+        Constraint* c = &constraints[i];
+        float dx = c->p2->x - c->p1->x, dy = c->p2->y - c->p1->y;
+        sum += fabs(sqrtf(dx * dx + dy * dy) - c->rest_length) / c->rest_length;
+    }
+    return num_constraints > 0 ? sum / num_constraints : 0;
+}
+
+#define TUNE_FRAMES 180
+#define TUNE_DT (1.0f / 60.0f)
+
+typedef struct {
+    double ms_per_frame;
+    double residual;
+    double energy[TUNE_FRAMES]; // after each frame
+} TrialResult;
+
+typedef struct {
+    TrialResult reference;
+    double max_residual;
+    double max_drift;
+} TuneTolerance;
+
+// Run the scene headless from its initial state with the current solver.
+// Only the steps are timed, not the energy taken after each of them.
+TrialResult run_trial() {
+    TrialResult result;
+    bool tore = tearing; // trials compare solvers on the intact cloth
+    tearing = false;
+    thread_pool_start(solver.threads);
+    init_particles();
+    init_constraints();
+    init_constraint_indices();
+    init_constraint_colors();
+    Uint64 ticks = 0;
+    for (int frame = 0; frame < TUNE_FRAMES; frame++) {
+        Uint64 start = SDL_GetPerformanceCounter();
+        step_simulation(TUNE_DT);
+        ticks += SDL_GetPerformanceCounter() - start;
+        result.energy[frame] = total_energy();
+    }
+    result.ms_per_frame = 1000.0 * ticks / SDL_GetPerformanceFrequency() / TUNE_FRAMES;
+    result.residual = constraint_residual();
+    tearing = tore;
+    return result;
+}
+
+// Energy drift: the largest gap, relative to the reference, between the
+// trial's energy and the reference run's at the same frame
+double energy_drift(const TrialResult* trial, const TrialResult* reference) {
+    double drift = 0;
+    for (int frame = 0; frame < TUNE_FRAMES; frame++) {
+        double gap = fabs(trial->energy[frame] - reference->energy[frame]) / fabs(reference->energy[frame]);
+        if (gap > drift) drift = gap;
+    }
+    return drift;
+}
+
+bool trial_passes(const TrialResult* trial, const TuneTolerance* tolerance) {
+    double residual = trial->residual - tolerance->reference.residual;
+    return residual <= tolerance->max_residual && energy_drift(trial, &tolerance->reference) <= tolerance->max_drift;
+}
+
+// Search for the cheapest solver settings whose residual (above a converged
+// reference run) and energy drift (over the run, against that reference)
+// stay within tolerance. For every substeps/relaxation/threads combination the smallest
+// passing iteration count is bracketed by doubling, then bisected.
+int tune_solver(const char* out_path, double max_residual, double max_drift) {
+    const int substep_options[] = {1, 2, 3, 4};
+    const float relaxation_options[] = {1.0f, 1.25f, 1.5f, 1.75f, 2.0f};
+    const int max_iterations = 40;
+    SolverConfig configured = solver;
+
+    solver = (SolverConfig){max_iterations, 4, 1.0f, 1};
+    TrialResult reference = run_trial();
+    printf("reference: residual %.5f, final energy %.6g\n", reference.residual, reference.energy[TUNE_FRAMES - 1]);
+    TuneTolerance tolerance = {reference, max_residual, max_drift};
+
+    int thread_options[8], num_thread_options = 0;
+    int cpus = SDL_GetCPUCount();
+    for (int t = 1; t <= cpus && t <= MAX_THREADS && num_thread_options < 8; t *= 2) {
+        thread_options[num_thread_options++] = t;
+    }
+
+    SolverConfig best = configured;
+    TrialResult best_result = {1e30, 0, {0}};
+    bool found = false;
+    printf("%5s %8s %10s %7s %10s %10s %10s\n", "iters", "substeps", "relaxation", "threads",
+        "ms/frame", "residual", "drift");
+    for (int t = 0; t < num_thread_options; t++) {
+        for (int s = 0; s < (int)SDL_arraysize(substep_options); s++) {
+            for (int r = 0; r < (int)SDL_arraysize(relaxation_options); r++) {
+                SolverConfig candidate = {1, substep_options[s], relaxation_options[r], thread_options[t]};
+                TrialResult trial;
+                int low = 0, high = 1;
+                for (;;) {
+                    solver = candidate;
+                    solver.iterations = high;
+                    trial = run_trial();
+                    if (trial_passes(&trial, &tolerance) || high >= max_iterations) break;
+                    low = high;
+                    high = (high * 2 < max_iterations) ? high * 2 : max_iterations;
+                }
+                if (!trial_passes(&trial, &tolerance)) continue;
+                while (high - low > 1) {
+                    solver = candidate;
+                    solver.iterations = (low + high) / 2;
+                    TrialResult mid = run_trial();
+                    if (trial_passes(&mid, &tolerance)) {
+                        high = solver.iterations;
+                        trial = mid;
+                    } else {
+                        low = solver.iterations;
+                    }
+                }
+                solver = candidate;
+                solver.iterations = high;
+
+                // Re-time the passing candidate so a noisy first run does not win
+                trial.ms_per_frame = fmin(trial.ms_per_frame, run_trial().ms_per_frame);
+                printf("%5d %8d %10.2f %7d %10.3f %10.5f %10.5f\n", solver.iterations, solver.substeps,
+                    solver.relaxation, solver.threads, trial.ms_per_frame, trial.residual - reference.residual,
+                    energy_drift(&trial, &reference));
+                if (trial.ms_per_frame < best_result.ms_per_frame) {
+                    best = solver;
+                    best_result = trial;
+                    found = true;
+                }
+            }
+        }
+    }
+    thread_pool_stop();
+
+    if (!found) {
+        fprintf(stderr, "tune: no setting met residual %.4f / drift %.4f\n", max_residual, max_drift);
+        solver = configured;
+        return 1;
+    }
+    solver = best;
+    char comment[160];
+    snprintf(comment, sizeof(comment), "tuned: %.3f ms/frame, residual tolerance %g, drift tolerance %g",
+        best_result.ms_per_frame, max_residual, max_drift);
+    printf("best: %d iterations, %d substeps, relaxation %.2f, %d threads (%.3f ms/frame)\n",
+        best.iterations, best.substeps, best.relaxation, best.threads, best_result.ms_per_frame);
+    return write_config(out_path, comment) ? 0 : 1;
+}
+
+// Batch runner: every scene file runs headless for a fixed number of frames
+// and records its trajectory to OUTDIR/<scene>.traj. Jobs are separate
+// processes, at most one per core, and each job's thread pool is capped at
+// its share of the cores so the node is never oversubscribed.
+#define BATCH_DT (1.0f / 60.0f)
+
+typedef struct {
+    bool ok;
+    int threads;
+    double seconds;
+    double residual;
+} BatchResult;
+
+// Settings a scene file can change; restored between in-process jobs
+typedef struct {
+    SolverConfig solver;
+    int material_index;
+    SweepOrder sweep_order;
+    PinMode pin_mode;
+    BroadPhaseMode broad_phase_mode;
+    Collider colliders[MAX_COLLIDERS];
+    int num_colliders, num_force_fields, reduced_modes;
+    bool settle_start, fast_settle, tearing, wide_batches;
+    const char* settle_cache_dir;
+} BatchDefaults;
+
+BatchDefaults batch_defaults() {
+    BatchDefaults d = {solver, current_material_index, sweep_order, pin_mode, broad_phase_mode, {{0, 0, 0}},
+        num_colliders, num_force_fields, reduced_modes, settle_start, fast_settle, tearing, wide_batches,
+        settle_cache_dir};
+    memcpy(d.colliders, colliders, sizeof(colliders));
+    return d;
+}
+
+void batch_restore(const BatchDefaults* d) {
+    solver = d->solver;
+    current_material_index = d->material_index;
+    sweep_order = d->sweep_order;
+    pin_mode = d->pin_mode;
+    broad_phase_mode = d->broad_phase_mode;
+    memcpy(colliders, d->colliders, sizeof(colliders));
+    num_colliders = d->num_colliders;
+    force_fields_truncate(d->num_force_fields);
+    reduced_modes = d->reduced_modes;
+    settle_start = d->settle_start;
+    fast_settle = d->fast_settle;
+    tearing = d->tearing;
+    wide_batches = d->wide_batches;
+    // Anything else came from a scene's settle_cache line, strdup'ed
+    if (settle_cache_dir != d->settle_cache_dir) free((char*)settle_cache_dir);
+    settle_cache_dir = d->settle_cache_dir;
+}
+
+// OUTDIR/<scene file name without its last extension>.traj
+void batch_output_path(char* path, size_t size, const char* scene, const char* out_dir) {
+    const char* name = scene;
+    for (const char* c = scene; *c; c++) {
+        if (*c == '/' || *c == '\\') name = c + 1;
+    }
+    const char* dot = strrchr(name, '.');
+    int length = (dot && dot != name) ? (int)(dot - name) : (int)strlen(name);
+    snprintf(path, size, "%s/%.*s.traj", out_dir, length, name);
+}
+
+BatchResult batch_run_job(const char* scene, int frames, const char* out_dir, int max_threads) {
+    BatchResult result = {false, 1, 0, 0};
+    if (!load_config(scene)) return result;
+    select_material(MATERIALS[current_material_index]);
+    if (solver.threads > max_threads) solver.threads = max_threads;
+    result.threads = solver.threads;
+
+    char path[512];
+    batch_output_path(path, sizeof(path), scene, out_dir);
+
+    init_particles();
+    init_constraints();
+    init_constraint_indices();
+    init_constraint_colors();
+    settle_cloth();
+    thread_pool_start(solver.threads);
+    if ((reduced_modes > 0 && !reduced_build(reduced_modes, true)) || !trajectory_start(path)) {
+        reduced_free();
+        thread_pool_stop();
+        return result;
+    }
+    Uint64 start = SDL_GetPerformanceCounter();
+    for (int frame = 0; frame < frames; frame++) {
+        step_simulation(BATCH_DT);
+        trajectory_record(BATCH_DT);
+    }
+    trajectory_stop();
+    result.seconds = (double)(SDL_GetPerformanceCounter() - start) / SDL_GetPerformanceFrequency();
+    reduced_free();
+    thread_pool_stop();
+    output_stop();
+    result.residual = constraint_residual();
+    result.ok = true;
+    return result;
+}
+
+void batch_print(const char* scene, int frames, const BatchResult* r) {
+    if (!r->ok) {
+        printf("%-32s  failed\n", scene);
+        return;
+    }
+    printf("%-32s %8d %8d %10.2f %10.1f %10.3f %10.4f\n", scene, frames, r->threads, r->seconds,
+        frames / r->seconds, 1000.0 * r->seconds / frames, r->residual);
+}
+
+int run_batch(int frames, const char* out_dir, int num_scenes, char** scenes) {
+    if (frames < 1 || num_scenes < 1) {
+        fprintf(stderr, "batch: need --batch FRAMES OUTDIR scene.cfg...\n");
+        return 1;
+    }
+    // Two scenes with the same file name would write the same trajectory
+    for (int j = 1; j < num_scenes; j++) {
+        char path[512];
+        batch_output_path(path, sizeof(path), scenes[j], out_dir);
+        for (int k = 0; k < j; k++) {
+            char other[512];
+            batch_output_path(other, sizeof(other), scenes[k], out_dir);
+            if (strcmp(path, other) == 0) {
+                fprintf(stderr, "batch: %s and %s would both write %s\n", scenes[k], scenes[j], path);
+                return 1;
+            }
+        }
+    }
+    int cores = SDL_GetCPUCount();
+    int concurrent = num_scenes < cores ? num_scenes : cores;
+    int max_threads = cores / concurrent;
+    printf("batch: %d scenes, %d at a time, up to %d threads each\n", num_scenes, concurrent, max_threads);
+    printf("%-32s %8s %8s %10s %10s %10s %10s\n", "scene", "frames", "threads", "seconds", "frames/s", "ms/frame", "residual");
+    int failures = 0;
+    Uint64 start = SDL_GetPerformanceCounter();
+
+#ifdef __linux__
+    // One forked process per job; each reports its result over a pipe
+    pid_t* pids = calloc(num_scenes, sizeof(pid_t));
+    int* pipes = calloc(num_scenes, sizeof(int));
+    if (!pids || !pipes) return 1;
+    fflush(stdout);
+    int next = 0, running = 0;
+    while (next < num_scenes || running > 0) {
+        while (next < num_scenes && running < concurrent) {
+            int fds[2];
+            if (pipe(fds) != 0) return 1;
+            pid_t pid = fork();
+            if (pid == 0) {
+                close(fds[0]);
+                BatchResult r = batch_run_job(scenes[next], frames, out_dir, max_threads);
+                ssize_t written = write(fds[1], &r, sizeof(r));
+                _exit(written == (ssize_t)sizeof(r) && r.ok ? 0 : 1);
+            }
+            close(fds[1]);
+            if (pid < 0) {
+                close(fds[0]);
+                return 1;
+            }
+            pids[next] = pid;
+            pipes[next] = fds[0];
+            next++;
+            running++;
+        }
+        int status;
+        pid_t done = wait(&status);
+        if (done < 0) break;
+        for (int j = 0; j < next; j++) {
+            if (pids[j] != done) continue;
+            BatchResult r = {false, 0, 0, 0};
+            if (read(pipes[j], &r, sizeof(r)) != (ssize_t)sizeof(r)) r.ok = false;
+            close(pipes[j]);
+            batch_print(scenes[j], frames, &r);
+            if (!r.ok) failures++;
+            running--;
+        }
+    }
+    free(pids);
+    free(pipes);
+#else
+    // No fork: run the jobs one after another in this process
+    BatchDefaults defaults = batch_defaults();
+    for (int j = 0; j < num_scenes; j++) {
+        batch_restore(&defaults);
+        BatchResult r = batch_run_job(scenes[j], frames, out_dir, cores);
+        batch_print(scenes[j], frames, &r);
+        if (!r.ok) failures++;
+    }
+#endif
+
+    double seconds = (double)(SDL_GetPerformanceCounter() - start) / SDL_GetPerformanceFrequency();
+    printf("batch: %d/%d scenes done in %.2f s, %.1f frames/s overall\n",
+        num_scenes - failures, num_scenes, seconds, (double)(num_scenes - failures) * frames / seconds);
+    return failures ? 1 : 0;
+}
+
+// Differentiable mode for fitting material parameters to captured motion.
+// The model is the single-threaded AoS frame: the material's force law on
+// every particle and solver.iterations sweeps of its constraint law in
+// constraints[] order per substep (exact square roots), then the damping of
+// motion relative to the rigid motion from step_simulation. Mouse,
+// colliders and force fields are not part of it, and the start state is
+// held fixed. The loss is the mean squared distance to a recorded
+// trajectory; its gradient comes from one reverse (adjoint) pass. States
+// are checkpointed every sqrt(frames) frames, each segment is recomputed on
+// the way back, and one frame at a time is re-run with a tape of what its
+// reverse step needs: the state before each force pass, both endpoints
+// before each constraint projection and the state before damping.
+typedef enum {
+    FIT_ELASTICITY,
+    FIT_STIFFNESS,
+    FIT_DAMPING,
+    FIT_AIR_FRICTION,
+    FIT_PARAMS
+} FitParam;
+
+const char* FIT_PARAM_NAMES[FIT_PARAMS] = {"elasticity", "stiffness", "damping", "air_friction"};
+
+typedef struct {
+    float x, y, old_x, old_y, vx, vy;
+} FitState;
+
+// Adjoint of a FitState: d loss / d each field
+typedef struct {
+    double x, y, old_x, old_y, vx, vy;
+} FitAdjoint;
+
+typedef struct {
+    float params[FIT_PARAMS];
+    float rest_scale; // denim pulls to 0.9 of the rest length
+} FitModel;
+
+typedef struct {
+    FitState* force_in;  // [substeps][NUM_PARTICLES]
+    float* endpoints;    // [substeps][iterations][NUM_CONSTRAINTS] x 4
+    FitState* damp_in;   // [NUM_PARTICLES]
+} FitTape;
+
+FitModel fit_model(const Material* m) {
+    FitModel model = {{m->elasticity, m->stiffness, m->damping, m->air_friction}, material_rest_scale(m)};
+    return model;
+}
+
+float fit_retention(const FitModel* model, float dt) {
+    return powf(fast_settle ? SETTLE_DAMPING : model->params[FIT_DAMPING], dt * 60.0f);
+}
+
+void fit_load_state(FitState* s) {
+    for (int i = 0; i < NUM_PARTICLES; i++) {
+        const Particle* p = &particles[i];
+        s[i] = (FitState){p->x, p->y, p->old_x, p->old_y, p->vx, p->vy};
+    }
+}
+
+// Rigid motion of the unlocked particles: centre, its velocity and spin
+typedef struct {
+    double mass, cx, cy, cvx, cvy, momentum, inertia, omega;
+} FitRigid;
+
+FitRigid fit_rigid(const FitState* s, float h) {
+    FitRigid r = {0};
+    for (int i = 0; i < NUM_PARTICLES; i++) {
+        if (particles[i].locked) continue;
+        double m = particles[i].mass;
+        r.mass += m;
+        r.cx += m * s[i].x;
+        r.cy += m * s[i].y;
+        r.cvx += m * (s[i].x - s[i].old_x) / h;
+        r.cvy += m * (s[i].y - s[i].old_y) / h;
+    }
+    if (r.mass <= 0) return r;
+    r.cx /= r.mass;
+    r.cy /= r.mass;
+    r.cvx /= r.mass;
+    r.cvy /= r.mass;
+    for (int i = 0; i < NUM_PARTICLES; i++) {
+        if (particles[i].locked) continue;
+        double m = particles[i].mass;
+        double rx = s[i].x - r.cx, ry = s[i].y - r.cy;
+        double ux = (s[i].x - s[i].old_x) / h - r.cvx, uy = (s[i].y - s[i].old_y) / h - r.cvy;
+        r.momentum += m * (rx * uy - ry * ux);
+        r.inertia += m * (rx * rx + ry * ry);
+    }
+    r.omega = r.inertia > 0 ? r.momentum / r.inertia : 0;
+    return r;
+}
+
+// One frame of the model on s; records the tape when one is given
+void fit_frame(const FitModel* model, FitState* s, float dt, FitTape* tape) {
+    const float GRAVITY = 980.0f;
+    float h = dt / solver.substeps;
+    float c = 0.5f * solver.relaxation * model->params[FIT_ELASTICITY];
+    float* endpoint = tape ? tape->endpoints : NULL;
+    for (int sub = 0; sub < solver.substeps; sub++) {
+        if (tape) memcpy(tape->force_in + sub * NUM_PARTICLES, s, sizeof(FitState) * NUM_PARTICLES);
+        for (int i = 0; i < NUM_PARTICLES; i++) {
+            if (particles[i].locked) continue;
+            FitState* p = &s[i];
+            float drag = model->params[FIT_AIR_FRICTION] * sqrtf(p->vx * p->vx + p->vy * p->vy) / particles[i].mass;
+            float ux = (p->x - p->old_x) / h - drag * p->vx * h;
+            float uy = (p->y - p->old_y) / h + (GRAVITY - drag * p->vy) * h;
+            p->old_x = p->x;
+            p->old_y = p->y;
+            p->x += ux * h;
+            p->y += uy * h;
+            p->vx = ux;
+            p->vy = uy;
+        }
+        for (int j = 0; j < solver.iterations; j++) {
+            for (int e = 0; e < NUM_CONSTRAINTS; e++) {
+                const ConstraintIndex* ci = &constraint_indices[e];
+                FitState *a = &s[ci->a], *b = &s[ci->b];
+                if (endpoint) {
+                    endpoint[0] = a->x;
+                    endpoint[1] = a->y;
+                    endpoint[2] = b->x;
+                    endpoint[3] = b->y;
+                    endpoint += 4;
+                }
+                float dx = b->x - a->x, dy = b->y - a->y;
+                float dist_sq = dx * dx + dy * dy;
+                if (dist_sq <= 0.0001f * 0.0001f) continue;
+                float step = c * (1.0f - model->rest_scale * ci->rest_length / sqrtf(dist_sq));
+                if (!particles[ci->a].locked) {
+                    a->x += dx * step;
+                    a->y += dy * step;
+                }
+                if (!particles[ci->b].locked) {
+                    b->x -= dx * step;
+                    b->y -= dy * step;
+                }
+            }
+        }
+    }
+
+    if (tape) memcpy(tape->damp_in, s, sizeof(FitState) * NUM_PARTICLES);
+    FitRigid r = fit_rigid(s, h);
+    if (r.mass <= 0) return;
+    float keep = fit_retention(model, dt);
+    for (int i = 0; i < NUM_PARTICLES; i++) {
+        if (particles[i].locked) continue;
+        FitState* p = &s[i];
+        double rigid_vx = r.cvx - r.omega * (p->y - r.cy), rigid_vy = r.cvy + r.omega * (p->x - r.cx);
+        p->vx = (float)(rigid_vx + keep * ((p->x - p->old_x) / h - rigid_vx));
+        p->vy = (float)(rigid_vy + keep * ((p->y - p->old_y) / h - rigid_vy));
+        p->old_x = p->x - p->vx * h;
+        p->old_y = p->y - p->vy * h;
+    }
+}
+
+// Reverse of fit_frame: g holds d loss / d state after the frame on entry
+// and before it on return; parameter derivatives are added to grad
+void fit_frame_adjoint(const FitModel* model, const FitTape* tape, float dt, FitAdjoint* g, double* grad) {
+    float h = dt / solver.substeps;
+
+    // Damping: new v = rigid + keep * (v - rigid), old = x - new v * h, where
+    // rigid = cv + omega * perp(x - c) depends on every unlocked particle
+    const FitState* s = tape->damp_in;
+    FitRigid r = fit_rigid(s, h);
+    if (r.mass > 0) {
+        double keep = fit_retention(model, dt);
+        double sum_rigid_x = 0, sum_rigid_y = 0, g_omega = 0, g_keep = 0;
+        for (int i = 0; i < NUM_PARTICLES; i++) {
+            if (particles[i].locked) continue;
+            double rx = s[i].x - r.cx, ry = s[i].y - r.cy;
+            double vx = (s[i].x - s[i].old_x) / h, vy = (s[i].y - s[i].old_y) / h;
+            double rigid_vx = r.cvx - r.omega * ry, rigid_vy = r.cvy + r.omega * rx;
+            double gvx = g[i].vx - h * g[i].old_x, gvy = g[i].vy - h * g[i].old_y;
+            g_keep += gvx * (vx - rigid_vx) + gvy * (vy - rigid_vy);
+            sum_rigid_x += (1 - keep) * gvx;
+            sum_rigid_y += (1 - keep) * gvy;
+            g_omega += (1 - keep) * (gvy * rx - gvx * ry);
+        }
+        double g_momentum = 0, g_inertia = 0;
+        if (r.inertia > 0) {
+            g_momentum = g_omega / r.inertia;
+            g_inertia = -g_omega * r.momentum / (r.inertia * r.inertia);
+        }
+        double sum_rx = 0, sum_ry = 0, sum_ux = 0, sum_uy = 0;
+        for (int i = 0; i < NUM_PARTICLES; i++) {
+            if (particles[i].locked) continue;
+            double m = particles[i].mass;
+            double rx = s[i].x - r.cx, ry = s[i].y - r.cy;
+            double ux = (s[i].x - s[i].old_x) / h - r.cvx, uy = (s[i].y - s[i].old_y) / h - r.cvy;
+            double gvx = g[i].vx - h * g[i].old_x, gvy = g[i].vy - h * g[i].old_y;
+            sum_rx += r.omega * (1 - keep) * gvy + 2 * m * rx * g_inertia + m * uy * g_momentum;
+            sum_ry += -r.omega * (1 - keep) * gvx + 2 * m * ry * g_inertia - m * ux * g_momentum;
+            sum_ux += -m * ry * g_momentum;
+            sum_uy += m * rx * g_momentum;
+        }
+        double g_cvx = sum_rigid_x - sum_ux, g_cvy = sum_rigid_y - sum_uy;
+        double g_cx = -sum_rx, g_cy = -sum_ry;
+        for (int i = 0; i < NUM_PARTICLES; i++) {
+            if (particles[i].locked) continue;
+            double m = particles[i].mass;
+            double rx = s[i].x - r.cx, ry = s[i].y - r.cy;
+            double ux = (s[i].x - s[i].old_x) / h - r.cvx, uy = (s[i].y - s[i].old_y) / h - r.cvy;
+            double gvx = g[i].vx - h * g[i].old_x, gvy = g[i].vy - h * g[i].old_y;
+            double grx = r.omega * (1 - keep) * gvy + 2 * m * rx * g_inertia + m * uy * g_momentum;
+            double gry = -r.omega * (1 - keep) * gvx + 2 * m * ry * g_inertia - m * ux * g_momentum;
+            double gux = -m * ry * g_momentum, guy = m * rx * g_momentum;
+            double gx = g[i].x + g[i].old_x + grx + m / r.mass * g_cx;
+            double gy = g[i].y + g[i].old_y + gry + m / r.mass * g_cy;
+            double g_vx = keep * gvx + gux + m / r.mass * g_cvx;
+            double g_vy = keep * gvy + guy + m / r.mass * g_cvy;
+            g[i] = (FitAdjoint){gx + g_vx / h, gy + g_vy / h, -g_vx / h, -g_vy / h, 0, 0};
+        }
+        if (!fast_settle) {
+            double d = model->params[FIT_DAMPING];
+            grad[FIT_DAMPING] += g_keep * dt * 60.0 * pow(d, dt * 60.0 - 1.0);
+        }
+    }
+
+    double c = 0.5 * solver.relaxation * model->params[FIT_ELASTICITY];
+    const float* endpoint = tape->endpoints + (size_t)solver.substeps * solver.iterations * NUM_CONSTRAINTS * 4;
+    for (int sub = solver.substeps - 1; sub >= 0; sub--) {
+        // Constraint projections in reverse: a += d * step, b -= d * step
+        // with d = b - a and step = c * (1 - rest / |d|)
+        for (int j = solver.iterations - 1; j >= 0; j--) {
+            for (int e = NUM_CONSTRAINTS - 1; e >= 0; e--) {
+                endpoint -= 4;
+                const ConstraintIndex* ci = &constraint_indices[e];
+                double dx = endpoint[2] - endpoint[0], dy = endpoint[3] - endpoint[1];
+                double dist_sq = dx * dx + dy * dy;
+                if (dist_sq <= 0.0001 * 0.0001) continue;
+                double dist = sqrt(dist_sq), rest = model->rest_scale * ci->rest_length;
+                double step = c * (1 - rest / dist);
+                FitAdjoint *ga = &g[ci->a], *gb = &g[ci->b];
+                double wx = 0, wy = 0; // d loss / d (d * step)
+                if (!particles[ci->a].locked) {
+                    wx += ga->x;
+                    wy += ga->y;
+                }
+                if (!particles[ci->b].locked) {
+                    wx -= gb->x;
+                    wy -= gb->y;
+                }
+                double g_step = wx * dx + wy * dy;
+                grad[FIT_ELASTICITY] += g_step * step / model->params[FIT_ELASTICITY];
+                double radial = g_step * c * rest / (dist_sq * dist);
+                double gdx = wx * step + radial * dx, gdy = wy * step + radial * dy;
+                ga->x -= gdx;
+                ga->y -= gdy;
+                gb->x += gdx;
+                gb->y += gdy;
+            }
+        }
+
+        // Force law: u = (x - old) / h + a * h with drag a = -air |v| v / m,
+        // then x += u * h, old = x, v = u
+        const FitState* in = tape->force_in + sub * NUM_PARTICLES;
+        for (int i = 0; i < NUM_PARTICLES; i++) {
+            if (particles[i].locked) continue;
+            const FitState* p = &in[i];
+            FitAdjoint* gi = &g[i];
+            double m = particles[i].mass;
+            double speed = sqrt((double)p->vx * p->vx + (double)p->vy * p->vy);
+            double air = model->params[FIT_AIR_FRICTION];
+            double gux = gi->x * h + gi->vx, guy = gi->y * h + gi->vy;
+            double gax = gux * h, gay = guy * h;
+            grad[FIT_AIR_FRICTION] -= (gax * p->vx + gay * p->vy) * speed / m;
+            double gvx = 0, gvy = 0;
+            if (speed > 0) {
+                double along = (gax * p->vx + gay * p->vy) / speed;
+                gvx = -air / m * (speed * gax + along * p->vx);
+                gvy = -air / m * (speed * gay + along * p->vy);
+            }
+            *gi = (FitAdjoint){gi->x + gi->old_x + gux / h, gi->y + gi->old_y + guy / h, -gux / h, -guy / h, gvx, gvy};
+        }
+    }
+}
+
+double fit_frame_loss(const FitState* s, const float* target, double weight, FitAdjoint* g) {
+    double loss = 0;
+    for (int i = 0; i < NUM_PARTICLES; i++) {
+        double dx = s[i].x - target[2 * i], dy = s[i].y - target[2 * i + 1];
+        loss += weight * (dx * dx + dy * dy);
+        if (g) {
+            g[i].x += 2 * weight * dx;
+            g[i].y += 2 * weight * dy;
+        }
+    }
+    return loss;
+}
+
+// Loss of the model from start against frames target frames (2 floats per
+// particle each, stepped by dt[f]) and, when grad is given, its gradient by
+// the checkpointed adjoint pass. Returns a negative loss when out of memory.
+double fit_gradient(const FitModel* model, const FitState* start, const float* target, const float* dt,
+    int frames, double* grad) {
+    double weight = 1.0 / ((double)frames * NUM_PARTICLES);
+    int segment = (int)ceil(sqrt((double)frames));
+    int num_checkpoints = (frames + segment - 1) / segment;
+    size_t state_bytes = sizeof(FitState) * NUM_PARTICLES;
+    size_t endpoint_floats = (size_t)solver.substeps * solver.iterations * NUM_CONSTRAINTS * 4;
+    FitState* checkpoints = malloc(state_bytes * (num_checkpoints + segment + solver.substeps + 2));
+    float* endpoints = malloc(sizeof(float) * endpoint_floats);
+    FitAdjoint* g = calloc(NUM_PARTICLES, sizeof(FitAdjoint));
+    if (!checkpoints || !endpoints || !g) {
+        free(checkpoints);
+        free(endpoints);
+        free(g);
+        return -1;
+    }
+    FitState* states = checkpoints + (size_t)num_checkpoints * NUM_PARTICLES; // one segment's frames
+    FitState* current = states + (size_t)segment * NUM_PARTICLES;
+    FitTape tape = {current + NUM_PARTICLES, endpoints, current + (size_t)(1 + solver.substeps) * NUM_PARTICLES};
+
+    // Forward: loss, keeping the state at the start of every segment
+    double loss = 0;
+    memcpy(current, start, state_bytes);
+    for (int f = 0; f < frames; f++) {
+        if (f % segment == 0) memcpy(checkpoints + (size_t)(f / segment) * NUM_PARTICLES, current, state_bytes);
+        fit_frame(model, current, dt[f], NULL);
+        loss += fit_frame_loss(current, target + (size_t)f * 2 * NUM_PARTICLES, weight, NULL);
+    }
+
+    if (grad) {
+        for (int k = 0; k < FIT_PARAMS; k++) grad[k] = 0;
+        for (int seg = num_checkpoints - 1; seg >= 0; seg--) {
+            int first = seg * segment, last = (first + segment < frames) ? first + segment : frames;
+            memcpy(states, checkpoints + (size_t)seg * NUM_PARTICLES, state_bytes);
+            for (int f = first; f + 1 < last; f++) {
+                FitState* next = states + (size_t)(f - first + 1) * NUM_PARTICLES;
+                memcpy(next, next - NUM_PARTICLES, state_bytes);
+                fit_frame(model, next, dt[f], NULL);
+            }
+            for (int f = last - 1; f >= first; f--) {
+                memcpy(current, states + (size_t)(f - first) * NUM_PARTICLES, state_bytes);
+                fit_frame(model, current, dt[f], &tape);
+                fit_frame_loss(current, target + (size_t)f * 2 * NUM_PARTICLES, weight, g);
+                fit_frame_adjoint(model, &tape, dt[f], g, grad);
+            }
+        }
+    }
+    free(checkpoints);
+    free(endpoints);
+    free(g);
+    return loss;
+}
+
+// Clamps a parameter to the range the laws stay stable in
+float fit_clamp(FitParam k, float value) {
+    const float lo[FIT_PARAMS] = {0.01f, 0.0f, 0.5f, 0.0f};
+    const float hi[FIT_PARAMS] = {1.0f, 1.0f, 1.0f, 1.0f};
+    return value < lo[k] ? lo[k] : value > hi[k] ? hi[k] : value;
+}
+
+// --fit: gradient descent (Adam, steps relative to each starting value) on
+// the current material's parameters against a --record trajectory
+int run_fit(const char* path, int steps) {
+    if (num_colliders > 0 || num_force_fields > 0 || tearing) {
+        fprintf(stderr, "fit: the fitted model has no colliders, force fields or tearing; "
+            "remove them from the scene\n");
+        return 1;
+    }
+    FILE* f = fopen(path, "rb");
+    TrajectoryHeader header;
+    if (!f || fread(&header, sizeof(header), 1, f) != 1 || memcmp(header.magic, "CLTHTRAJ", 8) != 0 ||
+        header.particles != NUM_PARTICLES) {
+        fprintf(stderr, "fit: %s is not a trajectory of this grid\n", path);
+        if (f) fclose(f);
+        return 1;
+    }
+    static TrajectoryFrame frame;
+    float *target = NULL, *dt = NULL;
+    int frames = 0;
+    while (fread(&frame, sizeof(frame), 1, f) == 1) {
+        float* grown_target = realloc(target, sizeof(float) * 2 * NUM_PARTICLES * (frames + 1));
+        float* grown_dt = realloc(dt, sizeof(float) * (frames + 1));
+        if (grown_target) target = grown_target;
+        if (grown_dt) dt = grown_dt;
+        if (!grown_target || !grown_dt) break;
+        memcpy(target + (size_t)frames * 2 * NUM_PARTICLES, frame.positions, sizeof(frame.positions));
+        dt[frames++] = frame.dt;
+    }
+    fclose(f);
+    if (frames == 0) {
+        fprintf(stderr, "fit: %s has no frames\n", path);
+        free(target);
+        free(dt);
+        return 1;
+    }
+
+    init_particles();
+    init_constraints();
+    init_constraint_indices();
+    settle_cloth();
+    static FitState start[NUM_PARTICLES];
+    fit_load_state(start);
+
+    FitModel model = fit_model(&current_material);
+    float initial[FIT_PARAMS], best[FIT_PARAMS];
+    memcpy(initial, model.params, sizeof(initial));
+    memcpy(best, model.params, sizeof(best));
+    double moment[FIT_PARAMS] = {0}, second[FIT_PARAMS] = {0}, grad[FIT_PARAMS];
+    const double rate = 0.05, beta1 = 0.9, beta2 = 0.999;
+    printf("fitting %d frames of %s\n", frames, path);
+    printf("%5s %12s", "step", "loss");
+    for (int k = 0; k < FIT_PARAMS; k++) printf(" %12s", FIT_PARAM_NAMES[k]);
+    printf("\n");
+    double loss = 0, best_loss = INFINITY;
+    for (int step = 0; step <= steps; step++) {
+        loss = fit_gradient(&model, start, target, dt, frames, step < steps ? grad : NULL);
+        if (loss < 0) break;
+        printf("%5d %12.6g", step, loss);
+        for (int k = 0; k < FIT_PARAMS; k++) printf(" %12.6g", model.params[k]);
+        printf("\n");
+        if (loss < best_loss) {
+            best_loss = loss;
+            memcpy(best, model.params, sizeof(best));
+        }
+        if (step == steps) break;
+        for (int k = 0; k < FIT_PARAMS; k++) {
+            // Step sizes scale with each parameter's own range: damping by
+            // its distance from 1, the others by their starting value
+            float unit = (k == FIT_DAMPING) ? 1 - initial[k] : initial[k];
+            if (unit <= 0) unit = 0.01f;
+            moment[k] = beta1 * moment[k] + (1 - beta1) * grad[k];
+            second[k] = beta2 * second[k] + (1 - beta2) * grad[k] * grad[k];
+            double m_hat = moment[k] / (1 - pow(beta1, step + 1)), v_hat = second[k] / (1 - pow(beta2, step + 1));
+            model.params[k] = fit_clamp((FitParam)k, model.params[k] - (float)(rate * unit * m_hat / (sqrt(v_hat) + 1e-30)));
+        }
+    }
+    free(target);
+    free(dt);
+    if (loss < 0) {
+        fprintf(stderr, "fit: out of memory\n");
+        return 1;
+    }
+    // stiffness only enters the energy, so its gradient is always zero
+    printf("fitted (loss %.6g):", best_loss);
+    for (int k = 0; k < FIT_PARAMS; k++) printf(" %s %.6g", FIT_PARAM_NAMES[k], best[k]);
+    printf("\n");
+    return 0;
+}
+
+// Self-test: every fast variant against the scalar reference (the scene
+// material's apply_force / solve_constraint in constraints[] order) on
+// randomized scenes, compared in ULPs of the particle positions, then a
+// stress run of the thread pool that must match a sequential sweep exactly.
+unsigned int selftest_seed = 1;
+
+float selftest_random(float lo, float hi) {
+    selftest_seed = selftest_seed * 1664525u + 1013904223u;
+    return lo + (hi - lo) * (float)(selftest_seed >> 8) / 16777216.0f;
+}
+
+// Distance in representable floats; NaN counts as infinitely far
+Uint32 ulp_distance(float a, float b) {
+    if (isnan(a) || isnan(b)) return 0xFFFFFFFFu;
+    Sint32 ia, ib;
+    memcpy(&ia, &a, sizeof(ia));
+    memcpy(&ib, &b, sizeof(ib));
+    if (ia < 0) ia = (Sint32)(0x80000000u - (Uint32)ia);
+    if (ib < 0) ib = (Sint32)(0x80000000u - (Uint32)ib);
+    Sint64 d = (Sint64)ia - (Sint64)ib;
+    return (Uint32)(d < 0 ? -d : d);
+}
+
+Uint32 max_position_ulps(const Particle* a, const Particle* b) {
+    Uint32 worst = 0;
+    for (int i = 0; i < NUM_PARTICLES; i++) {
+        Uint32 dx = ulp_distance(a[i].x, b[i].x), dy = ulp_distance(a[i].y, b[i].y);
+        if (dx > worst) worst = dx;
+        if (dy > worst) worst = dy;
+    }
+    return worst;
+}
+
+// Jittered grid with random velocities, pins and material accuracy
+void selftest_scene(RsqrtAccuracy accuracy) {
+    select_material(MATERIALS[(int)selftest_random(0, 2.99f)]);
+    current_material.rsqrt_accuracy = accuracy;
+    init_particles();
+    for (int i = 0; i < NUM_PARTICLES; i++) {
+        Particle* p = &particles[i];
+        p->x += selftest_random(-4, 4);
+        p->y += selftest_random(-4, 4);
+        p->old_x = p->x - selftest_random(-2, 2);
+        p->old_y = p->y - selftest_random(-2, 2);
+        p->vx = selftest_random(-200, 200);
+        p->vy = selftest_random(-200, 200);
+        p->locked = selftest_random(0, 1) < 0.05f;
+    }
+}
+
+bool selftest_check(const char* name, Uint32 ulps, Uint32 tolerance) {
+    bool ok = ulps <= tolerance;
+    printf("%-34s %10u %10u  %s\n", name, ulps, tolerance, ok ? "ok" : "FAIL");
+    return ok;
+}
+
+int run_selftest(int scenes) {
+    static Particle reference[NUM_PARTICLES], start[NUM_PARTICLES];
+    const char* accuracy_names[] = {"exact", "approx", "newton1", "newton2"};
+    // Same law, different association of the products: a few ULPs per step
+    const Uint32 tolerance = 8;
+    bool ok = true;
+
+    init_particles();
+    init_constraints();
+    init_constraint_indices();
+    init_constraint_colors();
+    SolverConfig configured = solver;
+    int configured_material = current_material_index;
+
+    printf("%-34s %10s %10s\n", "variant", "max ulps", "tolerance");
+    for (int accuracy = RSQRT_EXACT; accuracy <= RSQRT_NEWTON2; accuracy++) {
+        Uint32 worst[3] = {0, 0, 0};
+        for (int scene = 0; scene < scenes; scene++) {
+            selftest_scene((RsqrtAccuracy)accuracy);
+            solver.relaxation = selftest_random(1.0f, 1.8f);
+            float dt = selftest_random(1.0f / 240, 1.0f / 30);
+            memcpy(start, particles, sizeof(particles));
+
+            // Reference: one integration and one sweep through the material's law
+            for (int i = 0; i < NUM_PARTICLES; i++) current_material.apply_force(&particles[i], dt);
+            for (int i = 0; i < NUM_CONSTRAINTS; i++) {
+                current_material.solve_constraint(constraints[i].p1, constraints[i].p2, constraints[i].rest_length);
+            }
+            memcpy(reference, particles, sizeof(particles));
+
+            for (int layout = LAYOUT_AOS; layout <= LAYOUT_AOSOA; layout++) {
+                memcpy(particles, start, sizeof(particles));
+                if (layout == LAYOUT_AOS) {
+                    ParticlesAoS store = {particles};
+                    integrate_aos(&store, NUM_PARTICLES, &current_material, dt);
+                    solve_constraints_aos(&store, constraint_indices, NUM_CONSTRAINTS, &current_material);
+                } else if (layout == LAYOUT_SOA) {
+                    load_soa(&particles_soa, particles, NUM_PARTICLES);
+                    integrate_soa(&particles_soa, NUM_PARTICLES, &current_material, dt);
+                    solve_constraints_soa(&particles_soa, constraint_indices, NUM_CONSTRAINTS, &current_material);
+                    store_soa(&particles_soa, particles, NUM_PARTICLES);
+                } else {
+                    load_aosoa(&particles_aosoa, particles, NUM_PARTICLES);
+                    integrate_aosoa(&particles_aosoa, NUM_PARTICLES, &current_material, dt);
+                    solve_constraints_aosoa(&particles_aosoa, constraint_indices, NUM_CONSTRAINTS, &current_material);
+                    store_aosoa(&particles_aosoa, particles, NUM_PARTICLES);
+                }
+                Uint32 ulps = max_position_ulps(particles, reference);
+                if (ulps > worst[layout]) worst[layout] = ulps;
+            }
+        }
+        const char* layout_names[] = {"aos", "soa", "aosoa"};
+        for (int layout = LAYOUT_AOS; layout <= LAYOUT_AOSOA; layout++) {
+            char name[64];
+            snprintf(name, sizeof(name), "%s kernels, rsqrt %s", layout_names[layout], accuracy_names[accuracy]);
+            ok &= selftest_check(name, worst[layout], tolerance);
+        }
+    }
+
+    // Colored sweeps share no particles within a color, so any thread count
+    // must reproduce the sequential colored sweep bit for bit
+    solver = configured;
+    solver.iterations = SOLVER_ITERATIONS;
+    solver.substeps = 1;
+    int thread_counts[] = {2, 3, 4, 8};
+    for (int t = 0; t < (int)SDL_arraysize(thread_counts); t++) {
+        Uint32 worst = 0;
+        for (int scene = 0; scene < scenes; scene++) {
+            selftest_scene(RSQRT_NEWTON1);
+            float dt = 1.0f / 60;
+            memcpy(start, particles, sizeof(particles));
+
+            thread_pool_start(1);
+            for (int frame = 0; frame < 10; frame++) {
+                for (int i = 0; i < NUM_PARTICLES; i++) current_material.apply_force(&particles[i], dt);
+                for (int j = 0; j < solver.iterations; j++) {
+                    solve_constraint_range(0, NUM_CONSTRAINTS, colored_constraints);
+                }
+            }
+            memcpy(reference, particles, sizeof(particles));
+
+            memcpy(particles, start, sizeof(particles));
+            thread_pool_start(thread_counts[t]);
+            for (int frame = 0; frame < 10; frame++) substep_simulation(dt);
+            Uint32 ulps = max_position_ulps(particles, reference);
+            if (ulps > worst) worst = ulps;
+        }
+        char name[64];
+        snprintf(name, sizeof(name), "thread pool, %d threads", thread_counts[t]);
+        ok &= selftest_check(name, worst, 0);
+    }
+
+    // Stress: many short parallel_for rounds with pool restarts in between
+    Uint32 worst = 0;
+    selftest_scene(RSQRT_NEWTON1);
+    memcpy(start, particles, sizeof(particles));
+    thread_pool_start(4);
+    for (int frame = 0; frame < 500; frame++) substep_simulation(1.0f / 60);
+    memcpy(reference, particles, sizeof(particles));
+    for (int round = 0; round < 20; round++) {
+        memcpy(particles, start, sizeof(particles));
+        thread_pool_start(2 + round % 7);
+        for (int frame = 0; frame < 500; frame++) substep_simulation(1.0f / 60);
+        Uint32 ulps = max_position_ulps(particles, reference);
+        if (ulps > worst) worst = ulps;
+    }
+    ok &= selftest_check("thread pool stress, 20 x 500 steps", worst, 0);
+
+    // Sweep and prune: after every update the incremental pair set must match
+    // a brute-force overlap test of the same boxes, and the frames must match
+    // the brute-force passes bit for bit
+    Uint32 mismatches = 0, broad_worst = 0;
+    int configured_colliders = num_colliders;
+    Collider configured_set[MAX_COLLIDERS];
+    memcpy(configured_set, colliders, sizeof(colliders));
+    BroadPhaseMode configured_mode = broad_phase_mode;
+    ParticleLayout configured_layout = particle_layout;
+    particle_layout = LAYOUT_AOS;
+    broad_phase.built = false;
+    thread_pool_start(1);
+    for (int scene = 0; scene < scenes; scene++) {
+        selftest_scene(RSQRT_NEWTON1);
+        num_colliders = 1 + scene % MAX_COLLIDERS;
+        for (int c = 0; c < num_colliders; c++) {
+            colliders[c] = (Collider){selftest_random(0, SCREEN_WIDTH), selftest_random(0, SCREEN_HEIGHT), selftest_random(10, 120)};
+        }
+        memcpy(start, particles, sizeof(particles));
+        for (int pass = 0; pass < 2; pass++) {
+            broad_phase_mode = pass ? BROAD_PHASE_SAP : BROAD_PHASE_BRUTE;
+            memcpy(particles, start, sizeof(particles));
+            for (int frame = 0; frame < 60; frame++) {
+                mouse_down = (frame / 20) % 2 == 0;
+                mouse.x = 400 + 300 * sinf(frame * 0.1f);
+                mouse.y = 300 + 200 * cosf(frame * 0.13f);
+                substep_simulation(1.0f / 60);
+                if (!pass) continue;
+                for (int tile = 0; tile < NUM_TILES; tile++) {
+                    for (int other = NUM_TILES; other < MAX_PROXIES; other++) {
+                        bool overlap = bounds_overlap(&broad_phase.bounds[tile], &broad_phase.bounds[other]);
+                        if (overlap != (broad_phase.pair_slot[tile][other - NUM_TILES] >= 0)) mismatches++;
+                    }
+                }
+            }
+            if (!pass) memcpy(reference, particles, sizeof(particles));
+        }
+        // A scene that blows up leaves NaNs whose bits are not comparable
+        bool finite = true;
+        for (int i = 0; i < NUM_PARTICLES; i++) finite = finite && isfinite(reference[i].x) && isfinite(reference[i].y);
+        Uint32 ulps = finite ? max_position_ulps(particles, reference) : 0;
+        if (ulps > broad_worst) broad_worst = ulps;
+    }
+    mouse_down = false;
+    num_colliders = configured_colliders;
+    memcpy(colliders, configured_set, sizeof(colliders));
+    broad_phase_mode = configured_mode;
+    particle_layout = configured_layout;
+    ok &= selftest_check("sweep and prune vs brute force", mismatches, 0);
+    ok &= selftest_check("sweep and prune frames vs brute", broad_worst, 0);
+
+    // Force fields: the AoS gather, the SoA store and the AoSoA blocks hand
+    // the same particles to the same SIMD loops, so the kicks must agree
+    int configured_fields = num_force_fields;
+    force_field_add("vortex:400,300,500000,20");
+    force_field_add("attractor:300,400,200000,30");
+    force_field_add("explosion:500,200,1000000,0.5");
+    worst = 0;
+    for (int scene = 0; scene < scenes; scene++) {
+        selftest_scene(RSQRT_NEWTON1);
+        float dt = selftest_random(1.0f / 240, 1.0f / 30), time = selftest_random(0, 2);
+        memcpy(start, particles, sizeof(particles));
+        for (int layout = LAYOUT_AOS; layout <= LAYOUT_AOSOA; layout++) {
+            memcpy(particles, start, sizeof(particles));
+            particle_layout = (ParticleLayout)layout;
+            field_time = time;
+            if (layout == LAYOUT_SOA) load_soa(&particles_soa, particles, NUM_PARTICLES);
+            if (layout == LAYOUT_AOSOA) load_aosoa(&particles_aosoa, particles, NUM_PARTICLES);
+            apply_force_fields(dt);
+            if (layout == LAYOUT_SOA) store_soa(&particles_soa, particles, NUM_PARTICLES);
+            if (layout == LAYOUT_AOSOA) store_aosoa(&particles_aosoa, particles, NUM_PARTICLES);
+            if (layout == LAYOUT_AOS) {
+                memcpy(reference, particles, sizeof(particles));
+            } else {
+                Uint32 ulps = max_position_ulps(particles, reference);
+                if (ulps > worst) worst = ulps;
+            }
+        }
+    }
+    force_fields_truncate(configured_fields);
+    particle_layout = configured_layout;
+    ok &= selftest_check("force fields, all layouts", worst, 0);
+
+    // Wide batches one color at a time, where no batch has conflicts, against
+    // the sequential SoA sweep of the same order: the split path always, the
+    // vpconflictd kernel where the CPU has it
+    WideKernel wide_kernels[2] = {solve_constraints_wide_split, NULL};
+    if (wide_kernel() == solve_constraints_wide_avx512) wide_kernels[1] = solve_constraints_wide_avx512;
+    worst = 0;
+    for (int scene = 0; scene < scenes; scene++) {
+        selftest_scene(RSQRT_EXACT);
+        solver.relaxation = selftest_random(1.0f, 1.8f);
+        memcpy(start, particles, sizeof(particles));
+        load_soa(&particles_soa, start, NUM_PARTICLES);
+        for (int j = 0; j < SOLVER_ITERATIONS; j++) {
+            solve_constraints_soa(&particles_soa, colored_indices, NUM_CONSTRAINTS, &current_material);
+        }
+        store_soa(&particles_soa, reference, NUM_PARTICLES);
+        float k = 0.5f * current_material.elasticity * solver.relaxation;
+        float rest_scale = material_rest_scale(&current_material);
+        for (int kernel = 0; kernel < 2 && wide_kernels[kernel]; kernel++) {
+            load_soa(&particles_soa, start, NUM_PARTICLES);
+            for (int i = 0; i < NUM_PARTICLES; i++) wide_weight[i] = particles_soa.locked[i] ? 0.0f : 1.0f;
+            for (int j = 0; j < SOLVER_ITERATIONS; j++) {
+                for (int color = 0; color < NUM_CONSTRAINT_COLORS; color++) {
+                    wide_kernels[kernel](&particles_soa, &colored_indices[color_offsets[color]],
+                        color_offsets[color + 1] - color_offsets[color], k, rest_scale);
+                }
+            }
+            store_soa(&particles_soa, particles, NUM_PARTICLES);
+            Uint32 ulps = max_position_ulps(particles, reference);
+            if (ulps > worst) worst = ulps;
+        }
+    }
+    solver = configured;
+    ok &= selftest_check("wide batches per color vs soa", worst, 0);
+
+    // Wide batches: the vpconflictd scatter against the split path, in the
+    // colored order and in the recursive order, where each cell's right and
+    // down links share a particle and so every batch has conflicts
+    if (wide_kernel() == solve_constraints_wide_avx512) {
+        static ConstraintIndex cell_order[NUM_CONSTRAINTS];
+        emit_recursive_order(cell_order, 0, GRID_WIDTH, GRID_HEIGHT, 0, 0, GRID_WIDTH, GRID_HEIGHT);
+        worst = 0;
+        for (int scene = 0; scene < scenes; scene++) {
+            selftest_scene(RSQRT_EXACT);
+            solver.relaxation = selftest_random(1.0f, 1.8f);
+            memcpy(start, particles, sizeof(particles));
+            for (int order = 0; order < 2; order++) {
+                const ConstraintIndex* c = order == 0 ? colored_indices : cell_order;
+                for (int kernel = 0; kernel < 2; kernel++) {
+                    load_soa(&particles_soa, start, NUM_PARTICLES);
+                    for (int i = 0; i < NUM_PARTICLES; i++) wide_weight[i] = particles_soa.locked[i] ? 0.0f : 1.0f;
+                    float k = 0.5f * current_material.elasticity * solver.relaxation;
+                    float rest_scale = material_rest_scale(&current_material);
+                    for (int j = 0; j < SOLVER_ITERATIONS; j++) {
+                        if (kernel == 0) solve_constraints_wide_split(&particles_soa, c, NUM_CONSTRAINTS, k, rest_scale);
+                        else solve_constraints_wide_avx512(&particles_soa, c, NUM_CONSTRAINTS, k, rest_scale);
+                    }
+                    store_soa(&particles_soa, particles, NUM_PARTICLES);
+                    if (kernel == 0) {
+                        memcpy(reference, particles, sizeof(particles));
+                    } else {
+                        Uint32 ulps = max_position_ulps(particles, reference);
+                        if (ulps > worst) worst = ulps;
+                    }
+                }
+            }
+        }
+        solver = configured;
+        ok &= selftest_check("wide batches, avx512 vs split", worst, 0);
+    } else {
+        printf("%-34s %10s %10s  %s\n", "wide batches, avx512 vs split", "-", "-", "no AVX-512 CD");
+    }
+
+    // Adjoint gradient against central differences of the loss, per material,
+    // in thousandths of the difference quotient
+    Uint32 worst_permille = 0;
+    static FitState fit_start[NUM_PARTICLES], fit_state[NUM_PARTICLES];
+    static float fit_target[20 * 2 * NUM_PARTICLES], fit_dt[20];
+    const int fit_frames = (int)SDL_arraysize(fit_dt);
+    solver = configured;
+    solver.iterations = SOLVER_ITERATIONS;
+    solver.substeps = 1;
+    for (int material = 0; material < (int)SDL_arraysize(MATERIALS); material++) {
+        select_material(MATERIALS[material]);
+        init_particles();
+        for (int i = 0; i < NUM_PARTICLES; i++) {
+            particles[i].old_x -= 0.5f * sinf(i * 0.37f);
+            particles[i].vx = 3 * cosf(i * 0.1f);
+        }
+        fit_load_state(fit_start);
+        FitModel model = fit_model(&current_material), truth = model;
+        truth.params[FIT_ELASTICITY] *= 1.2f;
+        truth.params[FIT_DAMPING] *= 0.98f;
+        truth.params[FIT_AIR_FRICTION] *= 1.5f;
+        memcpy(fit_state, fit_start, sizeof(fit_state));
+        for (int f = 0; f < fit_frames; f++) {
+            fit_dt[f] = 1.0f / 60;
+            fit_frame(&truth, fit_state, fit_dt[f], NULL);
+            for (int i = 0; i < NUM_PARTICLES; i++) {
+                fit_target[f * 2 * NUM_PARTICLES + 2 * i] = fit_state[i].x;
+                fit_target[f * 2 * NUM_PARTICLES + 2 * i + 1] = fit_state[i].y;
+            }
+        }
+        double grad[FIT_PARAMS];
+        fit_gradient(&model, fit_start, fit_target, fit_dt, fit_frames, grad);
+        for (int k = 0; k < FIT_PARAMS; k++) {
+            FitModel up = model, down = model;
+            float eps = (k == FIT_DAMPING) ? 3e-3f : 1e-2f * model.params[k];
+            up.params[k] += eps;
+            down.params[k] -= eps;
+            double quotient = (fit_gradient(&up, fit_start, fit_target, fit_dt, fit_frames, NULL) -
+                fit_gradient(&down, fit_start, fit_target, fit_dt, fit_frames, NULL)) / (2 * eps);
+            double error = fabs(grad[k] - quotient) / fmax(fabs(quotient), 1e-9);
+            Uint32 permille = (grad[k] == 0 && quotient == 0) ? 0 : (Uint32)fmin(error * 1000, 1e9);
+            if (permille > worst_permille) worst_permille = permille;
+        }
+    }
+    select_material(MATERIALS[configured_material]);
+    ok &= selftest_check("adjoint vs finite differences", worst_permille, 10);
+
+    // Reduced model: trained on the settled cotton scene, then started with
+    // the first training kick. The subspace leaves out air friction and the
+    // rigid-motion split of the damping, so it drifts from the full run; ten
+    // frames in, the rms position error must stay within a quarter of the
+    // rms distance the full run has moved.
+    ParticleLayout reduced_layout = particle_layout;
+    particle_layout = LAYOUT_AOS;
+    thread_pool_start(1);
+    select_material(&COTTON);
+    init_particles();
+    init_constraints();
+    init_constraint_indices();
+    init_constraint_colors();
+    settle_static();
+    Uint32 reduced_permille = 1000000;
+    if (reduced_build(16, false)) {
+        for (int i = 0; i < NUM_PARTICLES; i++) {
+            Particle* p = &particles[i];
+            if (p->locked) continue;
+            float u = (float)(i % GRID_WIDTH) / (GRID_WIDTH - 1), w = (float)(i / GRID_WIDTH) / (GRID_HEIGHT - 1);
+            p->old_x = p->x - 300 * sinf(3.14159265f * u) * w / 60;
+            p->old_y = p->y - 200 * cosf(3.14159265f * u) * w / 60;
+        }
+        memcpy(start, particles, sizeof(particles));
+        reduced.enabled = false;
+        wake_cloth();
+        for (int frame = 0; frame < 10; frame++) step_simulation(1.0f / 60);
+        memcpy(reference, particles, sizeof(particles));
+        memcpy(particles, start, sizeof(particles));
+        reduced.enabled = true;
+        wake_cloth();
+        for (int frame = 0; frame < 10; frame++) step_simulation(1.0f / 60);
+        double error = 0, moved = 0;
+        for (int i = 0; i < NUM_PARTICLES; i++) {
+            double ex = particles[i].x - reference[i].x, ey = particles[i].y - reference[i].y;
+            double mx = reference[i].x - start[i].x, my = reference[i].y - start[i].y;
+            error += ex * ex + ey * ey;
+            moved += mx * mx + my * my;
+        }
+        reduced_permille = moved > 0 ? (Uint32)fmin(1000 * sqrt(error / moved), 1e9) : 0;
+    }
+    reduced_free();
+    particle_layout = reduced_layout;
+    select_material(MATERIALS[configured_material]);
+    ok &= selftest_check("reduced vs full, 10 frames", reduced_permille, 250);
+
+    // Union-find fragments against a flood fill of the intact constraints
+    // (each particle labelled with the lowest particle it reaches), over
+    // increasingly torn cloth; counts particles grouped differently
+    Uint32 fragment_mismatches = 0;
+    static int flood[NUM_PARTICLES];
+    init_particles();
+    init_constraints();
+    for (int round = 0; round < 8; round++) {
+        for (int e = 0; e < NUM_CONSTRAINTS; e++) {
+            if (selftest_random(0, 1) < 0.05f * (round + 1)) constraint_torn[e] = true;
+        }
+        rebuild_fragments();
+        for (int i = 0; i < NUM_PARTICLES; i++) flood[i] = i;
+        for (bool spread = true; spread;) {
+            spread = false;
+            for (int e = 0; e < NUM_CONSTRAINTS; e++) {
+                if (constraint_torn[e]) continue;
+                int a = all_constraint_indices[e].a, b = all_constraint_indices[e].b;
+                if (flood[a] == flood[b]) continue;
+                flood[a] = flood[b] = flood[a] < flood[b] ? flood[a] : flood[b];
+                spread = true;
+            }
+        }
+        int components = 0;
+        for (int i = 0; i < NUM_PARTICLES; i++) {
+            if (flood[i] == i) components++;
+            if (particle_fragment[i] != particle_fragment[flood[i]]) fragment_mismatches++;
+        }
+        if (components != num_fragments) fragment_mismatches++;
+    }
+    init_constraints();
+    init_constraint_indices();
+    init_constraint_colors();
+    ok &= selftest_check("fragments vs flood fill", fragment_mismatches, 0);
+
+    // Software rasterizer bands on 4 threads against one pass over the whole
+    // frame, over a torn, partly off-screen cloth; counts differing pixels
+    static Uint32 raster_reference[SCREEN_WIDTH * SCREEN_HEIGHT];
+    init_particles();
+    init_constraints();
+    for (int i = 0; i < NUM_PARTICLES; i++) {
+        particles[i].x += selftest_random(-300, 300);
+        particles[i].y += selftest_random(-200, 400);
+    }
+    for (int e = 0; e < NUM_CONSTRAINTS; e++) constraint_torn[e] = selftest_random(0, 1) < 0.2f;
+    snapshot_publish();
+    const RenderSnapshot* raster_snapshot = snapshot_acquire();
+    raster_rows(0, SCREEN_HEIGHT, (void*)raster_snapshot);
+    memcpy(raster_reference, raster_pixels, sizeof(raster_pixels));
+    thread_pool_start(4);
+    parallel_for(SCREEN_HEIGHT, raster_rows, (void*)raster_snapshot);
+    Uint32 raster_mismatches = 0;
+    for (int i = 0; i < SCREEN_WIDTH * SCREEN_HEIGHT; i++) raster_mismatches += raster_pixels[i] != raster_reference[i];
+    init_particles();
+    init_constraints();
+    init_constraint_indices();
+    init_constraint_colors();
+    ok &= selftest_check("software raster, 4 threads", raster_mismatches, 0);
+
+    // Config files: a scene with every key off its default, written out and
+    // loaded back over the defaults, must come back as the same state
+    const char* config_path = "selftest.cfg";
+    const char* config_fields[] = {"vortex:400,300,500000,20", "explosion:500,200,1000000,0.5"};
+    BatchDefaults before_config = batch_defaults();
+    current_material_index = 1;
+    solver.iterations = 7;
+    solver.substeps = 3;
+    solver.relaxation = 1.37f;
+    solver.threads = 2;
+    sweep_order = SWEEP_RECURSIVE;
+    fast_settle = settle_start = tearing = wide_batches = true;
+    pin_mode = PINS_CORNERS;
+    broad_phase_mode = BROAD_PHASE_SAP;
+    reduced_modes = 6;
+    settle_cache_dir = strdup("settle_cache");
+    colliders[0] = (Collider){412.5f, 300.1f, 33.3f};
+    num_colliders = 1;
+    for (int i = 0; i < 2; i++) force_field_add(config_fields[i]);
+    BatchDefaults scene = batch_defaults();
+    Uint32 config_mismatches = !write_config(config_path, "selftest");
+    batch_restore(&before_config);
+    config_mismatches += !load_config(config_path);
+    remove(config_path);
+    BatchDefaults loaded = batch_defaults();
+    config_mismatches += memcmp(&loaded.solver, &scene.solver, sizeof(SolverConfig)) != 0;
+    config_mismatches += loaded.material_index != scene.material_index;
+    config_mismatches += loaded.sweep_order != scene.sweep_order;
+    config_mismatches += loaded.pin_mode != scene.pin_mode;
+    config_mismatches += loaded.broad_phase_mode != scene.broad_phase_mode;
+    config_mismatches += loaded.num_colliders != scene.num_colliders;
+    config_mismatches += memcmp(loaded.colliders, scene.colliders, sizeof(Collider) * scene.num_colliders) != 0;
+    config_mismatches += loaded.reduced_modes != scene.reduced_modes;
+    config_mismatches += loaded.settle_start != scene.settle_start;
+    config_mismatches += loaded.fast_settle != scene.fast_settle;
+    config_mismatches += loaded.tearing != scene.tearing;
+    config_mismatches += loaded.wide_batches != scene.wide_batches;
+    config_mismatches += !settle_cache_dir || strcmp(settle_cache_dir, "settle_cache") != 0;
+    config_mismatches += num_force_fields != before_config.num_force_fields + 2;
+    for (int i = 0; i < 2 && before_config.num_force_fields + i < num_force_fields; i++) {
+        config_mismatches += strcmp(force_fields[before_config.num_force_fields + i].spec, config_fields[i]) != 0;
+    }
+    batch_restore(&before_config);
+    ok &= selftest_check("config write then load", config_mismatches, 0);
+
+    thread_pool_stop();
+    solver = configured;
+    printf("%s\n", ok ? "all variants match the reference" : "MISMATCH against the reference");
+    return ok ? 0 : 1;
+}
+
+// Input-to-photon latency. Every input event gets its arrival time (SDL's
+// ms timestamp, mapped onto the performance counter when it is polled); the
+// first SDL_RenderPresent after the poll is the first frame reflecting it.
+#define LATENCY_MAX_SAMPLES 65536
+#define LATENCY_MAX_PENDING 1024
+
+bool latency_enabled = false;
+float latency_total_ms[LATENCY_MAX_SAMPLES];
+float latency_queue_ms[LATENCY_MAX_SAMPLES];
+int latency_count = 0;
+Uint64 latency_pending[LATENCY_MAX_PENDING];
+Uint64 latency_pending_polled[LATENCY_MAX_PENDING];
+int latency_num_pending = 0;
+
+void latency_input(const SDL_Event* event) {
+    if (!latency_enabled || latency_num_pending == LATENCY_MAX_PENDING) return;
+    Uint64 now = SDL_GetPerformanceCounter();
+    Uint32 age_ms = SDL_GetTicks() - event->common.timestamp;
+    Uint64 age = (Uint64)age_ms * SDL_GetPerformanceFrequency() / 1000;
+    latency_pending[latency_num_pending] = (age < now) ? now - age : now;
+    latency_pending_polled[latency_num_pending] = now;
+    latency_num_pending++;
+}
+
+void latency_presented() {
+    if (!latency_enabled) return;
+    Uint64 now = SDL_GetPerformanceCounter();
+    double to_ms = 1000.0 / SDL_GetPerformanceFrequency();
+    for (int i = 0; i < latency_num_pending; i++) {
+        int slot = latency_count++ % LATENCY_MAX_SAMPLES;
+        latency_total_ms[slot] = (float)((now - latency_pending[i]) * to_ms);
+        latency_queue_ms[slot] = (float)((latency_pending_polled[i] - latency_pending[i]) * to_ms);
+    }
+    latency_num_pending = 0;
+}
+
+int compare_float(const void* a, const void* b) {
+    float fa = *(const float*)a, fb = *(const float*)b;
+    return (fa > fb) - (fa < fb);
+}
+
+void latency_print_row(const char* name, float* samples, int count) {
+    qsort(samples, count, sizeof(float), compare_float);
+    double sum = 0;
+    for (int i = 0; i < count; i++) sum += samples[i];
+    printf("%-14s %7.2f %7.2f %7.2f %7.2f %7.2f %7.2f\n", name, samples[0], sum / count,
+        samples[count / 2], samples[count * 9 / 10], samples[count * 99 / 100], samples[count - 1]);
+}
+
+void latency_report() {
+    int count = latency_count < LATENCY_MAX_SAMPLES ? latency_count : LATENCY_MAX_SAMPLES;
+    if (count == 0) {
+        printf("latency: no input events\n");
+        return;
+    }
+    printf("input-to-photon latency over %d events (ms)\n", count);
+    printf("%-14s %7s %7s %7s %7s %7s %7s\n", "", "min", "mean", "p50", "p90", "p99", "max");
+    latency_print_row("arrival->poll", latency_queue_ms, count);
+    latency_print_row("total", latency_total_ms, count);
+}
+
+// STREAM-style calibration of the host: best-of-5 triad bandwidth over
+// arrays well beyond the LLC, and scalar peak from independent FMA-shaped
+// chains (the kernels are scalar, so that is their compute roof).
+double calibrate_bandwidth() {
+    const size_t n = 4 << 20; // 3 x 32 MiB of doubles
+    double *a = malloc(n * sizeof(double)), *b = malloc(n * sizeof(double)), *c = malloc(n * sizeof(double));
+    if (!a || !b || !c) {
+        free(a);
+        free(b);
+        free(c);
+        return 0;
+    }
+    for (size_t i = 0; i < n; i++) {
+        a[i] = 1.0;
+        b[i] = 2.0;
+        c[i] = 0.0;
+    }
+    double best = 0;
+    for (int rep = 0; rep < 5; rep++) {
+        Uint64 start = SDL_GetPerformanceCounter();
+        for (size_t i = 0; i < n; i++) {
+            a[i] = b[i] + 3.0 * c[i];
+        }
+        double seconds = (double)(SDL_GetPerformanceCounter() - start) / SDL_GetPerformanceFrequency();
+        double rate = 3.0 * n * sizeof(double) / seconds;
+        if (rate > best) best = rate;
+    }
+    volatile double sink = a[n / 2];
+    (void)sink;
+    free(a);
+    free(b);
+    free(c);
+    return best;
+}
+
+double calibrate_flops() {
+    float a0 = 0, a1 = 1, a2 = 2, a3 = 3, a4 = 4, a5 = 5, a6 = 6, a7 = 7;
+    const float mul = 0.999999f, add = 1e-6f;
+    const int reps = 20000000;
+    Uint64 start = SDL_GetPerformanceCounter();
+    for (int i = 0; i < reps; i++) {
+        a0 = a0 * mul + add;
+        a1 = a1 * mul + add;
+        a2 = a2 * mul + add;
+        a3 = a3 * mul + add;
+        a4 = a4 * mul + add;
+        a5 = a5 * mul + add;
+        a6 = a6 * mul + add;
+        a7 = a7 * mul + add;
+        // Each chain in its own register: the compiler cannot pack the eight
+        // into one vector multiply-add, so this roof stays scalar
+        __asm__("" : "+x"(a0), "+x"(a1), "+x"(a2), "+x"(a3), "+x"(a4), "+x"(a5), "+x"(a6), "+x"(a7));
+    }
+    double seconds = (double)(SDL_GetPerformanceCounter() - start) / SDL_GetPerformanceFrequency();
+    volatile float sink = a0 + a7;
+    (void)sink;
+    return 2.0 * 8 * reps / seconds;
+}
+
+// Achieved GB/s and GFLOP/s per kernel against the calibrated roofline.
+// A kernel well under both roofs is limited by latency (dependent loads,
+// sqrt/div chains), not by bandwidth or arithmetic throughput.
+void roofline_report() {
+    printf("calibrating host...\n");
+    double peak_bw = calibrate_bandwidth();
+    double peak_flops = calibrate_flops();
+    double ridge = peak_flops / peak_bw;
+    printf("host: %.2f GB/s triad, %.2f GFLOP/s scalar, ridge %.2f FLOP/byte\n",
+        peak_bw / 1e9, peak_flops / 1e9, ridge);
+    printf("%-17s %8s %10s %9s %9s %7s %9s %6s  %s\n", "kernel", "calls", "us/call",
+        "GB/s", "GFLOP/s", "AI", "dram GB/s", "%roof", "bound");
+    for (int id = 0; id < NUM_KERNELS; id++) {
+        KernelStats* k = &kernel_stats[id];
+        if (k->calls == 0) continue;
+        double seconds = (double)k->ticks / SDL_GetPerformanceFrequency();
+        double bw = k->bytes / seconds;
+        double flops = k->flops / seconds;
+        double intensity = k->flops / k->bytes;
+        double roof = fmin(peak_flops, intensity * peak_bw);
+        double fraction = flops / roof;
+        const char* bound = (fraction < 0.25) ? "latency" : (intensity < ridge) ? "bandwidth" : "compute";
+        printf("%-17s %8llu %10.2f %9.2f %9.2f %7.2f %9.2f %5.0f%%  %s\n", k->name,
+            (unsigned long long)k->calls, 1e6 * seconds / k->calls, bw / 1e9, flops / 1e9, intensity,
+            uncore_count ? k->dram_bytes / seconds / 1e9 : 0.0, 100 * fraction, bound);
+    }
+}
+
+// Sampling profiler. Samples are raw return-address stacks gathered by
+// walking frame pointers (build with -fno-omit-frame-pointer); they are
+// symbolized and folded ("main;step_simulation;... count") only on exit,
+// ready for flamegraph.pl. Linux samples on SIGPROF from ITIMER_PROF, so only
+// threads burning CPU are hit; Windows suspends each registered thread from a
+// sampler thread and reads its context. The samples form a ring, so a long
+// run's profile covers its last PROFILER_MAX_SAMPLES samples (about 33 s at
+// the default rate) rather than its first.
+#define PROFILER_MAX_DEPTH 32
+#define PROFILER_MAX_SAMPLES (1 << 15)
+#define PROFILER_MAX_THREADS 16
+
+typedef struct {
+    int depth;
+    void* pc[PROFILER_MAX_DEPTH];
+} ProfileSample;
+
+ProfileSample* profile_samples = NULL;
+SDL_atomic_t profile_count; // samples taken, including overwritten ones
+const char* profile_path = NULL;
+int profile_hz = 997; // prime, so sampling does not lock onto the 16 ms frame
+
+// Walk a frame-pointer chain that must stay inside [lo, hi)
+int profiler_walk(void** pcs, void* pc, uintptr_t fp, uintptr_t lo, uintptr_t hi) {
+    int depth = 0;
+    pcs[depth++] = pc;
+    while (depth < PROFILER_MAX_DEPTH && fp >= lo && fp + 2 * sizeof(void*) <= hi && fp % sizeof(void*) == 0) {
+        uintptr_t* frame = (uintptr_t*)fp;
+        if (frame[1] == 0) break;
+        pcs[depth++] = (void*)frame[1];
+        if (frame[0] <= fp) break; // the chain must move towards the stack base
+        fp = frame[0];
+    }
+    return depth;
+}
+
+void profiler_record(void* pc, uintptr_t fp, uintptr_t lo, uintptr_t hi) {
+    unsigned int slot = (unsigned int)SDL_AtomicAdd(&profile_count, 1) % PROFILER_MAX_SAMPLES;
+    ProfileSample* sample = &profile_samples[slot];
+    sample->depth = profiler_walk(sample->pc, pc, fp, lo, hi);
+}
+
+#ifdef _WIN32
+HANDLE profiler_threads[PROFILER_MAX_THREADS];
+ULONG_PTR profiler_stack_lo[PROFILER_MAX_THREADS], profiler_stack_hi[PROFILER_MAX_THREADS];
+SDL_atomic_t profiler_num_threads;
+volatile bool profiler_running = false;
+HANDLE profiler_sampler = NULL;
+
+// Called by every thread that should show up in the profile
+void profiler_register_thread() {
+    if (!profile_samples) return;
+    int slot = SDL_AtomicAdd(&profiler_num_threads, 1);
+    if (slot >= PROFILER_MAX_THREADS) return;
+    GetCurrentThreadStackLimits(&profiler_stack_lo[slot], &profiler_stack_hi[slot]);
+    DuplicateHandle(GetCurrentProcess(), GetCurrentThread(), GetCurrentProcess(), &profiler_threads[slot],
+        THREAD_SUSPEND_RESUME | THREAD_GET_CONTEXT, FALSE, 0);
+}
+
+DWORD WINAPI profiler_sampler_main(LPVOID unused) {
+    DWORD interval = 1000 / profile_hz > 0 ? 1000 / profile_hz : 1;
+    while (profiler_running) {
+        Sleep(interval);
+        int count = SDL_AtomicGet(&profiler_num_threads);
+        for (int i = 0; i < count && i < PROFILER_MAX_THREADS; i++) {
+            if (SuspendThread(profiler_threads[i]) == (DWORD)-1) continue;
+            CONTEXT ctx;
+            ctx.ContextFlags = CONTEXT_CONTROL | CONTEXT_INTEGER;
+            if (GetThreadContext(profiler_threads[i], &ctx)) {
+#ifdef _M_ARM64
+                profiler_record((void*)ctx.Pc, ctx.Fp, profiler_stack_lo[i], profiler_stack_hi[i]);
+#else
+                profiler_record((void*)ctx.Rip, ctx.Rbp, profiler_stack_lo[i], profiler_stack_hi[i]);
+#endif
+            }
+            ResumeThread(profiler_threads[i]);
+        }
+    }
+    return 0;
+}
+
+bool profiler_start_timer() {
+    profiler_running = true;
+    profiler_sampler = CreateThread(NULL, 0, profiler_sampler_main, NULL, 0, NULL);
+    return profiler_sampler != NULL;
+}
+
+void profiler_stop_timer() {
+    profiler_running = false;
+    if (profiler_sampler) {
+        WaitForSingleObject(profiler_sampler, INFINITE);
+        CloseHandle(profiler_sampler);
+    }
+}
+
+void profiler_symbol(void* pc, char* out, size_t size) {
+    HMODULE module;
+    char path[MAX_PATH];
+    if (GetModuleHandleExA(GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS | GET_MODULE_HANDLE_EX_FLAG_UNCHANGED_REFCOUNT,
+            (LPCSTR)pc, &module) && GetModuleFileNameA(module, path, sizeof(path))) {
+        const char* base = strrchr(path, '\\');
+        snprintf(out, size, "%s+0x%llx", base ? base + 1 : path,
+            (unsigned long long)((char*)pc - (char*)module));
+    } else {
+        snprintf(out, size, "0x%llx", (unsigned long long)(uintptr_t)pc);
+    }
+}
+#else
+__thread uintptr_t profiler_stack_lo = 0, profiler_stack_hi = 0;
+
+// Called by every thread so its frame chain can be walked safely
+void profiler_register_thread() {
+    pthread_attr_t attr;
+    void* base;
+    size_t size;
+    if (pthread_getattr_np(pthread_self(), &attr) != 0) return;
+    if (pthread_attr_getstack(&attr, &base, &size) == 0) {
+        profiler_stack_lo = (uintptr_t)base;
+        profiler_stack_hi = (uintptr_t)base + size;
+    }
+    pthread_attr_destroy(&attr);
+}
+
+void profiler_signal(int sig, siginfo_t* info, void* context) {
+    ucontext_t* uc = (ucontext_t*)context;
+#if defined(__x86_64__)
+    void* pc = (void*)uc->uc_mcontext.gregs[REG_RIP];
+    uintptr_t fp = (uintptr_t)uc->uc_mcontext.gregs[REG_RBP];
+#elif defined(__aarch64__)
+    void* pc = (void*)uc->uc_mcontext.pc;
+    uintptr_t fp = (uintptr_t)uc->uc_mcontext.regs[29];
+#else
+    void* pc = NULL;
+    uintptr_t fp = 0;
+#endif
+    // Unregistered threads still get their leaf frame
+    profiler_record(pc, fp, profiler_stack_lo, profiler_stack_hi);
+}
+
+bool profiler_start_timer() {
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = profiler_signal;
+    sa.sa_flags = SA_SIGINFO | SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(SIGPROF, &sa, NULL) != 0) return false;
+
+    struct itimerval timer;
+    timer.it_interval.tv_sec = 0;
+    timer.it_interval.tv_usec = 1000000 / profile_hz;
+    timer.it_value = timer.it_interval;
+    return setitimer(ITIMER_PROF, &timer, NULL) == 0;
+}
+
+void profiler_stop_timer() {
+    struct itimerval timer;
+    memset(&timer, 0, sizeof(timer));
+    setitimer(ITIMER_PROF, &timer, NULL);
+    signal(SIGPROF, SIG_IGN);
+}
+
+// Symbols need -rdynamic for functions in the executable itself
+void profiler_symbol(void* pc, char* out, size_t size) {
+    Dl_info info;
+    int found = dladdr(pc, &info);
+    if (found && info.dli_sname) {
+        snprintf(out, size, "%s", info.dli_sname);
+    } else if (found && info.dli_fname) {
+        const char* base = strrchr(info.dli_fname, '/');
+        snprintf(out, size, "%s+0x%llx", base ? base + 1 : info.dli_fname,
+            (unsigned long long)((char*)pc - (char*)info.dli_fbase));
+    } else {
+        snprintf(out, size, "0x%llx", (unsigned long long)(uintptr_t)pc);
+    }
+}
+#endif
+
+bool profiler_start(const char* path) {
+    profile_samples = malloc(sizeof(ProfileSample) * PROFILER_MAX_SAMPLES);
+    if (!profile_samples) return false;
+    profile_path = path;
+    SDL_AtomicSet(&profile_count, 0);
+    profiler_register_thread();
+    return profiler_start_timer();
+}
+
+int compare_folded(const void* a, const void* b) {
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+// Stop sampling and write one "root;...;leaf count" line per distinct stack
+void profiler_stop() {
+    if (!profile_samples) return;
+    profiler_stop_timer();
+
+    int taken = SDL_AtomicGet(&profile_count);
+    int count = taken > PROFILER_MAX_SAMPLES ? PROFILER_MAX_SAMPLES : taken;
+    char** lines = malloc(sizeof(char*) * (count > 0 ? count : 1));
+    FILE* out = fopen(profile_path, "w");
+    if (!lines || !out) {
+        fprintf(stderr, "profiler: cannot write %s\n", profile_path);
+        if (out) fclose(out);
+        free(lines);
+        free(profile_samples);
+        profile_samples = NULL;
+        return;
+    }
+
+    const size_t line_size = PROFILER_MAX_DEPTH * 64;
+    for (int i = 0; i < count; i++) {
+        ProfileSample* sample = &profile_samples[i];
+        char* line = malloc(line_size);
+        if (!line) {
+            // Out of memory part way: drop the dump rather than write a
+            // profile missing an arbitrary share of the samples
+            fprintf(stderr, "profiler: out of memory, %s not written\n", profile_path);
+            fclose(out);
+            remove(profile_path);
+            for (int j = 0; j < i; j++) free(lines[j]);
+            free(lines);
+            free(profile_samples);
+            profile_samples = NULL;
+            return;
+        }
+        size_t len = 0;
+        line[0] = '\0';
+        for (int d = sample->depth - 1; d >= 0; d--) {
+            char name[256];
+            // Return addresses point past the call; step back into it
+            char* pc = (char*)sample->pc[d] - (d > 0 ? 1 : 0);
+            profiler_symbol(pc, name, sizeof(name));
+            len += snprintf(line + len, line_size - len, "%s%s", len ? ";" : "", name);
+            if (len >= line_size) len = line_size - 1;
+        }
+        lines[i] = line;
+    }
+
+    qsort(lines, count, sizeof(char*), compare_folded);
+    for (int i = 0; i < count;) {
+        int j = i;
+        while (j < count && strcmp(lines[i], lines[j]) == 0) j++;
+        fprintf(out, "%s %d\n", lines[i], j - i);
+        i = j;
+    }
+    fclose(out);
+
+    printf("profiler: %d samples written to %s", count, profile_path);
+    if (taken > count) printf(" (the last of %d; %d older ones overwritten)", taken, taken - count);
+    printf("\n");
+    for (int i = 0; i < count; i++) free(lines[i]);
+    free(lines);
+    free(profile_samples);
+    profile_samples = NULL;
+}
+
+#ifdef _WIN32
+int main(int argc, char *argv[]);
+
+int WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR lpCmdLine, int nCmdShow) {
+    return main(__argc, __argv);
+}
+#endif
+
+int main(int argc, char *argv[]) {
+    int domain_count = 0, domain_rank = -1;
+    const char* domain_shm = "/cloth_domains";
+    const char* tune_path = NULL;
+    double tune_residual = 0.01, tune_drift = 0.02;
+    int selftest_scenes = 0;
+    const char* record_path = NULL;
+    const char* fit_path = NULL;
+    int fit_steps = 50;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--rsqrt-report") == 0) {
+            return rsqrt_report();
+        } else if (strcmp(argv[i], "--rsqrt") == 0 && i + 1 < argc) {
+            const char* mode = argv[++i];
+            if (strcmp(mode, "exact") == 0) rsqrt_override = RSQRT_EXACT;
+            else if (strcmp(mode, "approx") == 0) rsqrt_override = RSQRT_APPROX;
+            else if (strcmp(mode, "newton1") == 0) rsqrt_override = RSQRT_NEWTON1;
+            else if (strcmp(mode, "newton2") == 0) rsqrt_override = RSQRT_NEWTON2;
+            else {
+                fprintf(stderr, "rsqrt: unknown mode '%s' (exact, approx, newton1 or newton2)\n", mode);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--layout") == 0 && i + 1 < argc) {
+            const char* layout = argv[++i];
+            if (strcmp(layout, "aos") == 0) particle_layout = LAYOUT_AOS;
+            else if (strcmp(layout, "soa") == 0) particle_layout = LAYOUT_SOA;
+            else if (strcmp(layout, "aosoa") == 0) particle_layout = LAYOUT_AOSOA;
+            else {
+                fprintf(stderr, "layout: unknown layout '%s' (aos, soa or aosoa)\n", layout);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--settle-cache") == 0 && i + 1 < argc) {
+            settle_cache_dir = argv[++i];
+        } else if (strcmp(argv[i], "--wide-batches") == 0) {
+            wide_batches = true;
+        } else if (strcmp(argv[i], "--broad-phase") == 0 && i + 1 < argc) {
+            const char* mode = argv[++i];
+            if (strcmp(mode, "sap") == 0) broad_phase_mode = BROAD_PHASE_SAP;
+            else if (strcmp(mode, "brute") == 0) broad_phase_mode = BROAD_PHASE_BRUTE;
+            else {
+                fprintf(stderr, "broad phase: unknown mode '%s' (brute or sap)\n", mode);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--force-field") == 0 && i + 1 < argc) {
+            if (!force_field_add(argv[++i])) return 1;
+        } else if (strcmp(argv[i], "--reduced") == 0 && i + 1 < argc) {
+            reduced_modes = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--no-settle") == 0) {
+            settle_start = false;
+        } else if (strcmp(argv[i], "--tear") == 0) {
+            tearing = true;
+        } else if (strcmp(argv[i], "--fast-settle") == 0) {
+            fast_settle = true;
+        } else if (strcmp(argv[i], "--sweep-order") == 0 && i + 1 < argc) {
+            const char* order = argv[++i];
+            if (strcmp(order, "rows") == 0) sweep_order = SWEEP_ROWS;
+            else if (strcmp(order, "recursive") == 0) sweep_order = SWEEP_RECURSIVE;
+            else {
+                fprintf(stderr, "sweep order: unknown order '%s' (rows or recursive)\n", order);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--bench-layouts") == 0) {
+            select_material(&COTTON);
+            int width = (i + 1 < argc) ? atoi(argv[i + 1]) : 0;
+            int height = (i + 2 < argc) ? atoi(argv[i + 2]) : 0;
+            if (width < 2 || height < 2) width = height = 256;
+            return bench_layouts(width, height, 50);
+        } else if (strcmp(argv[i], "--profile") == 0 && i + 1 < argc) {
+            profile_path = argv[++i];
+        } else if (strcmp(argv[i], "--roofline") == 0) {
+            roofline_enabled = true;
+        } else if (strcmp(argv[i], "--roofline-uncore") == 0) {
+            roofline_enabled = true;
+            if (uncore_open() == 0) {
+                fprintf(stderr, "roofline: no uncore memory counters available\n");
+            }
+        } else if (strcmp(argv[i], "--latency") == 0) {
+            latency_enabled = true;
+        } else if (strcmp(argv[i], "--software-render") == 0) {
+            software_render = true;
+        } else if (strcmp(argv[i], "--flight-seconds") == 0 && i + 1 < argc) {
+            flight_seconds = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--flight-spike") == 0 && i + 1 < argc) {
+            flight_spike_ms = (float)atof(argv[++i]);
+        } else if (strcmp(argv[i], "--flight-dir") == 0 && i + 1 < argc) {
+            flight_dir = argv[++i];
+        } else if (strcmp(argv[i], "--quality-budget") == 0 && i + 1 < argc) {
+            quality_budget_ms = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--fixed-quality") == 0) {
+            quality_enabled = false;
+        } else if (strcmp(argv[i], "--domains") == 0 && i + 1 < argc) {
+            domain_count = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--domain-rank") == 0 && i + 1 < argc) {
+            domain_rank = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--domain-shm") == 0 && i + 1 < argc) {
+            domain_shm = argv[++i];
+        } else if (strcmp(argv[i], "--config") == 0 && i + 1 < argc) {
+            if (!load_config(argv[++i])) return 1;
+        } else if (strcmp(argv[i], "--tune") == 0 && i + 1 < argc) {
+            tune_path = argv[++i];
+        } else if (strcmp(argv[i], "--tune-residual") == 0 && i + 1 < argc) {
+            tune_residual = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--tune-drift") == 0 && i + 1 < argc) {
+            tune_drift = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--fit") == 0 && i + 1 < argc) {
+            fit_path = argv[++i];
+        } else if (strcmp(argv[i], "--fit-steps") == 0 && i + 1 < argc) {
+            fit_steps = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--batch") == 0 && i + 2 < argc) {
+            // Everything after FRAMES OUTDIR is a scene file
+            select_material(MATERIALS[current_material_index]);
+            if (!alloc_soa(&particles_soa, NUM_PARTICLES) || !alloc_aosoa(&particles_aosoa, NUM_PARTICLES)) return 1;
+            return run_batch(atoi(argv[i + 1]), argv[i + 2], argc - i - 3, argv + i + 3);
+        } else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc) {
+            record_path = argv[++i];
+        } else if (strcmp(argv[i], "--output-thread") == 0) {
+            output_force_thread = true;
+        } else if (strcmp(argv[i], "--metrics") == 0 && i + 1 < argc) {
+            metrics_path = argv[++i];
+        } else if (strcmp(argv[i], "--metrics-interval") == 0 && i + 1 < argc) {
+            metrics_interval_ms = (int)(atof(argv[++i]) * 1000);
+            if (metrics_interval_ms < 100) metrics_interval_ms = 100;
+        } else if (strcmp(argv[i], "--selftest") == 0) {
+            selftest_scenes = 50;
+        } else if (strcmp(argv[i], "--profile-hz") == 0 && i + 1 < argc) {
+            profile_hz = atoi(argv[++i]);
+            if (profile_hz < 1 || profile_hz > 10000) profile_hz = 997;
+        }
+    }
+    select_material(MATERIALS[current_material_index]);
+    if (!alloc_soa(&particles_soa, NUM_PARTICLES) || !alloc_aosoa(&particles_aosoa, NUM_PARTICLES)) {
+        fprintf(stderr, "Failed to allocate particle layouts\n");
+        return 1;
+    }
+    if (tune_path) {
+        return tune_solver(tune_path, tune_residual, tune_drift);
+    }
+    if (fit_path) {
+        return run_fit(fit_path, fit_steps);
+    }
+    if (selftest_scenes > 0) {
+        return run_selftest(selftest_scenes);
+    }
+    // Worker ranks never return from here; rank 0 continues as the viewer
+    if (domain_count > 0 && !domain_start(domain_shm, domain_count, domain_rank)) {
+        return 1;
+    }
+
+    SDL_Init(SDL_INIT_VIDEO);
+    SDL_Window *window = SDL_CreateWindow("Encoded Physics Cloth Simulation",
+        SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED,
+        SCREEN_WIDTH, SCREEN_HEIGHT, 0);
+    SDL_Renderer *renderer = SDL_CreateRenderer(window, -1,
+        SDL_RENDERER_ACCELERATED);
+
+    init_particles();
+    init_constraints();
+    init_constraint_indices();
+    init_constraint_colors();
+    settle_cloth();
+    if (domain_transport) domain_setup(domain_transport);
+    thread_pool_start(solver.threads);
+    if (reduced_modes > 0 && !reduced_build(reduced_modes, true)) return 1;
+    snapshot_publish();
+    if (metrics_path) metrics_start(metrics_path);
+    if (record_path && !trajectory_start(record_path)) return 1;
+    if (!flight_start()) fprintf(stderr, "flight recorder: out of memory, continuing without it\n");
+    if (domain_transport) quality_enabled = false; // ranks keep their own solver settings
+    if (record_path) quality_enabled = false;      // --fit replays the configured solver
+    quality_start();
+
+    if (profile_path && !profiler_start(profile_path)) {
+        fprintf(stderr, "profiler: failed to start, continuing without it\n");
+    }
+    if (software_render && !raster_start(renderer)) {
+        fprintf(stderr, "software render: no streaming texture (%s), drawing primitives\n", SDL_GetError());
+    }
+
+    bool running = true;
+    SDL_Event event;
+    Uint32 last_time = SDL_GetTicks();
+
+    while (running) {
+        Uint64 frame_start = SDL_GetPerformanceCounter();
+        Uint64 step_ticks = 0;
+        while (SDL_PollEvent(&event)) {
+            if (event.type == SDL_MOUSEBUTTONDOWN || event.type == SDL_MOUSEBUTTONUP ||
+                event.type == SDL_MOUSEMOTION || event.type == SDL_KEYDOWN) {
+                latency_input(&event);
+            }
+            if (event.type == SDL_QUIT) {
+                running = false;
+            } else if (event.type == SDL_MOUSEBUTTONDOWN) {
+                mouse_down = true;
+                mouse.x = event.button.x;
+                mouse.y = event.button.y;
+            } else if (event.type == SDL_MOUSEBUTTONUP) {
+                mouse_down = false;
+            } else if (event.type == SDL_MOUSEMOTION) {
+                mouse.x = event.motion.x;
+                mouse.y = event.motion.y;
+            } else if (event.type == SDL_KEYDOWN) {
+                switch (event.key.keysym.sym) {
+                    case SDLK_1: select_material(&COTTON); break;
+                    case SDLK_2: select_material(&SILK); break;
+                    case SDLK_3: select_material(&DENIM); break;
+                    case SDLK_F12: flight_dump("manual", flight_frames); break;
+                }
+            }
+        }
+
+        Uint32 current_time = SDL_GetTicks();
+        float dt = (current_time - last_time) / 1000.0f;
+        last_time = current_time;
+
+        // Frames closer than 1 ms give dt == 0, which the velocity
+        // (x - old_x) / dt cannot take; wait for time to pass instead
+        if (dt > 0) {
+            Uint64 step_start = SDL_GetPerformanceCounter();
+            if (domain_transport) {
+                domain_step_root(dt, false);
+            } else {
+                step_simulation(dt);
+            }
+            step_ticks = SDL_GetPerformanceCounter() - step_start;
+            metrics_record_step(step_ticks);
+            trajectory_record(dt);
+            snapshot_publish();
+        }
+
+        SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
+        SDL_RenderClear(renderer);
+        if (raster_texture) {
+            render_cloth_raster(renderer);
+        } else {
+            render_cloth(renderer);
+        }
         SDL_RenderPresent(renderer);
+        latency_presented();
+        Uint64 work_ticks = SDL_GetPerformanceCounter() - frame_start;
+        flight_record(dt > 0 ? dt : 0, step_ticks, work_ticks);
+        quality_update(work_ticks);
 
         SDL_Delay(16);
     }
 
+    domain_stop();
+    thread_pool_stop();
+    metrics_stop();
+    trajectory_stop();
+    flight_stop();
+    output_stop();
+    force_fields_truncate(0);
+    profiler_stop();
+    if (roofline_enabled) roofline_report();
+    if (latency_enabled) latency_report();
+    raster_stop();
     SDL_DestroyRenderer(renderer);
     SDL_DestroyWindow(window);
     SDL_Quit();